@@ -0,0 +1,1354 @@
+/* gpitool - Converts images into .GPI format
+ * Copyright (c) 2024 Maxim Hoxha
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Benchmarks for the hot image processing paths
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+#include "benchmark.h"
+#include "imagehandler.h"
+#include "colourconvert.h"
+#include "colourhistogram.h"
+#include "kmeans.h"
+#include "quantizer.h"
+#include "nearestcolour.h"
+#include "errordiffusion.h"
+#include "planardata.h"
+
+typedef struct
+{
+    const char* name;
+    const char* description;
+    void (*func)();
+} Benchmark;
+
+//Deterministic noise so that runs are comparable between machines
+static unsigned int BenchmarkRandom(unsigned int* state)
+{
+    *state = (*state * 1664525u) + 1013904223u;
+    return *state;
+}
+
+static ColourRGBA8* MakeNoiseImage(long long numPixels, unsigned int seed)
+{
+    ColourRGBA8* pixels = new ColourRGBA8[numPixels];
+    for (long long i = 0; i < numPixels; i++)
+    {
+        unsigned int r = BenchmarkRandom(&seed);
+        ColourRGBA8 col = { (unsigned char)(r >> 24), (unsigned char)(r >> 16), (unsigned char)(r >> 8), 0xFF };
+        pixels[i] = col;
+    }
+    return pixels;
+}
+
+//A photo-like image: gradients with a bit of noise, so that nearly every pixel is a different colour
+static ColourRGBA8* MakeSmoothImage(int w, int h, unsigned int seed)
+{
+    ColourRGBA8* pixels = new ColourRGBA8[((long long)w) * h];
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            unsigned int r = BenchmarkRandom(&seed);
+            int red = ((x * 255)/w) + (int)((r >> 24) & 0xF) - 8;
+            int green = ((y * 255)/h) + (int)((r >> 16) & 0xF) - 8;
+            int blue = (((x + y) * 255)/(w + h)) + (int)((r >> 8) & 0xF) - 8;
+            ColourRGBA8 col = { (unsigned char)(red < 0 ? 0 : (red > 255 ? 255 : red)), (unsigned char)(green < 0 ? 0 : (green > 255 ? 255 : green)), (unsigned char)(blue < 0 ? 0 : (blue > 255 ? 255 : blue)), 0xFF };
+            pixels[((long long)y) * w + x] = col;
+        }
+    }
+    return pixels;
+}
+
+//Pixel art or a screenshot: flat blocks from a small set of colours
+static ColourRGBA8* MakeBlockImage(int w, int h, int numColours, unsigned int seed)
+{
+    ColourRGBA8 cols[256];
+    for (int i = 0; i < numColours; i++)
+    {
+        unsigned int r = BenchmarkRandom(&seed);
+        ColourRGBA8 col = { (unsigned char)(r >> 24), (unsigned char)(r >> 16), (unsigned char)(r >> 8), 0xFF };
+        cols[i] = col;
+    }
+    ColourRGBA8* pixels = new ColourRGBA8[((long long)w) * h];
+    for (int y = 0; y < h; y += 8)
+    {
+        for (int x = 0; x < w; x += 8)
+        {
+            ColourRGBA8 col = cols[(BenchmarkRandom(&seed) >> 8) % numColours];
+            for (int by = y; by < y + 8 && by < h; by++)
+            {
+                for (int bx = x; bx < x + 8 && bx < w; bx++)
+                {
+                    pixels[((long long)by) * w + bx] = col;
+                }
+            }
+        }
+    }
+    return pixels;
+}
+
+//A sprite sheet: a grid of round sprites on a transparent background, with a few empty rows of cells
+static ColourRGBA8* MakeSpriteSheet(int w, int h, int cellSize, unsigned int seed)
+{
+    ColourRGBA8* pixels = MakeSmoothImage(w, h, seed);
+    const int radius = cellSize * 3 / 8;
+    for (int y = 0; y < h; y++)
+    {
+        const int cy = (y % cellSize) - cellSize/2;
+        const bool emptyRow = ((y / cellSize) % 5) == 4;
+        for (int x = 0; x < w; x++)
+        {
+            const int cx = (x % cellSize) - cellSize/2;
+            if (emptyRow || cx * cx + cy * cy > radius * radius) pixels[((long long)y) * w + x].A = 0x00;
+        }
+    }
+    return pixels;
+}
+
+//Gives the handler 8 planes of random colours, which is the slowest case for the palette searches
+static void SetNoisePalette(ImageHandler* ihand, unsigned int seed)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        ihand->AddPlane(4 + i);
+    }
+    ColourRGBA8* palCols = MakeNoiseImage(256, seed);
+    for (int i = 0; i < 256; i++)
+    {
+        ihand->SetPaletteColour(i, palCols[i]);
+    }
+    delete[] palCols;
+}
+
+//Seconds taken by DitherImage with the handler's current settings, once the working buffer is warmed up
+static double TimeDitherImage(ImageHandler* ihand)
+{
+    ihand->DitherImage(); //Warm up the working buffer
+    double startTime = omp_get_wtime();
+    ihand->DitherImage();
+    return omp_get_wtime() - startTime;
+}
+
+//Number of floats in two sets of three arrays that aren't bit for bit the same
+static long long CountBitDifferences(const float* x0, const float* y0, const float* z0, const float* x1, const float* y1, const float* z1, long long n)
+{
+    long long numDiff = 0;
+    for (long long i = 0; i < n; i++)
+    {
+        if (memcmp(&x0[i], &x1[i], sizeof(float))) numDiff++;
+        if (memcmp(&y0[i], &y1[i], sizeof(float))) numDiff++;
+        if (memcmp(&z0[i], &z1[i], sizeof(float))) numDiff++;
+    }
+    return numDiff;
+}
+
+static void BenchmarkColourConvert()
+{
+    const long long numPixels = 3840 * 2160 + 13; //Not a multiple of any vector width, so the kernels' scalar tails get used too
+    const int reps = 5;
+    ColourRGBA8* pixels = MakeNoiseImage(numPixels, 1);
+    float* refL = new float[numPixels];
+    float* refa = new float[numPixels];
+    float* refb = new float[numPixels];
+    float* refR = new float[numPixels];
+    float* refG = new float[numPixels];
+    float* refB = new float[numPixels];
+    float* scalarL = new float[numPixels];
+    float* scalara = new float[numPixels];
+    float* scalarb = new float[numPixels];
+    float* scalarR = new float[numPixels];
+    float* scalarG = new float[numPixels];
+    float* scalarB = new float[numPixels];
+    float* outL = new float[numPixels];
+    float* outa = new float[numPixels];
+    float* outb = new float[numPixels];
+    float* outA = new float[numPixels];
+
+    //Reference: the per-pixel path used everywhere before batching
+    double startTime = omp_get_wtime();
+    for (int r = 0; r < reps; r++)
+    {
+        for (long long i = 0; i < numPixels; i++)
+        {
+            ColourOkLabA col = SRGBToOkLab(SRGB8ToLinearFloat(pixels[i]));
+            refL[i] = col.L; refa[i] = col.a; refb[i] = col.b;
+        }
+    }
+    double refTime = (omp_get_wtime() - startTime)/reps;
+    startTime = omp_get_wtime();
+    for (int r = 0; r < reps; r++)
+    {
+        for (long long i = 0; i < numPixels; i++)
+        {
+            ColourOkLabA col = { refL[i], refa[i], refb[i], 1.0f };
+            ColourRGBA outcol = OkLabToSRGB(col);
+            refR[i] = outcol.R; refG[i] = outcol.G; refB[i] = outcol.B;
+        }
+    }
+    double refBackTime = (omp_get_wtime() - startTime)/reps;
+    printf("%lld pixels, single thread\n", numPixels);
+    printf("  %-10s sRGB8->OkLab %8.2f Mpix/s OkLab->sRGB %8.2f Mpix/s\n", "per-pixel", (numPixels/refTime) * 1e-6, (numPixels/refBackTime) * 1e-6);
+
+    //The kernels have to agree bit for bit, the scalar one only differs from the per-pixel functions in its cube root
+    for (int k = CONVERT_SCALAR; k <= CONVERT_AVX512; k++)
+    {
+        if (!IsConvertKernelSupported(k))
+        {
+            printf("  %-10s not supported on this machine\n", GetConvertKernelName(k));
+            continue;
+        }
+        startTime = omp_get_wtime();
+        for (int r = 0; r < reps; r++)
+        {
+            SRGB8ToOkLabBatch(pixels, outL, outa, outb, outA, numPixels, k);
+        }
+        double fwdTime = (omp_get_wtime() - startTime)/reps;
+        if (k == CONVERT_SCALAR)
+        {
+            memcpy(scalarL, outL, numPixels * sizeof(float));
+            memcpy(scalara, outa, numPixels * sizeof(float));
+            memcpy(scalarb, outb, numPixels * sizeof(float));
+        }
+        const long long fwdDiff = CountBitDifferences(outL, outa, outb, scalarL, scalara, scalarb, numPixels);
+        double fwdErr = 0.0;
+        for (long long i = 0; i < numPixels; i++)
+        {
+            fwdErr = fmax(fwdErr, fabs(outL[i] - refL[i]));
+            fwdErr = fmax(fwdErr, fabs(outa[i] - refa[i]));
+            fwdErr = fmax(fwdErr, fabs(outb[i] - refb[i]));
+        }
+        startTime = omp_get_wtime();
+        for (int r = 0; r < reps; r++)
+        {
+            OkLabToSRGBBatch(refL, refa, refb, outL, outa, outb, numPixels, k);
+        }
+        double backTime = (omp_get_wtime() - startTime)/reps;
+        if (k == CONVERT_SCALAR)
+        {
+            memcpy(scalarR, outL, numPixels * sizeof(float));
+            memcpy(scalarG, outa, numPixels * sizeof(float));
+            memcpy(scalarB, outb, numPixels * sizeof(float));
+        }
+        const long long backDiff = CountBitDifferences(outL, outa, outb, scalarR, scalarG, scalarB, numPixels);
+        if (k == CONVERT_SCALAR)
+        {
+            printf("  %-10s sRGB8->OkLab %8.2f Mpix/s OkLab->sRGB %8.2f Mpix/s, per-pixel functions are within %.2e\n", GetConvertKernelName(k), (numPixels/fwdTime) * 1e-6, (numPixels/backTime) * 1e-6, fwdErr);
+        }
+        else if (fwdDiff == 0 && backDiff == 0)
+        {
+            printf("  %-10s sRGB8->OkLab %8.2f Mpix/s OkLab->sRGB %8.2f Mpix/s, same as scalar\n", GetConvertKernelName(k), (numPixels/fwdTime) * 1e-6, (numPixels/backTime) * 1e-6);
+        }
+        else
+        {
+            printf("  %-10s sRGB8->OkLab %8.2f Mpix/s OkLab->sRGB %8.2f Mpix/s, DIFFERENT FROM SCALAR (%lld and %lld floats)\n", GetConvertKernelName(k), (numPixels/fwdTime) * 1e-6, (numPixels/backTime) * 1e-6, fwdDiff, backDiff);
+        }
+    }
+
+    delete[] pixels;
+    delete[] refL; delete[] refa; delete[] refb;
+    delete[] refR; delete[] refG; delete[] refB;
+    delete[] scalarL; delete[] scalara; delete[] scalarb;
+    delete[] scalarR; delete[] scalarG; delete[] scalarB;
+    delete[] outL; delete[] outa; delete[] outb; delete[] outA;
+}
+
+static void BenchmarkColourHistogram()
+{
+    const long long numPixels = 1920 * 1080;
+    const int numColours = 256;
+    ColourRGBA8 pal[256];
+    unsigned int seed = 2;
+    for (int i = 0; i < numColours; i++)
+    {
+        unsigned int r = BenchmarkRandom(&seed);
+        ColourRGBA8 col = { (unsigned char)(r >> 24), (unsigned char)(r >> 16), (unsigned char)(r >> 8), 0xFF };
+        pal[i] = col;
+    }
+    //A dithered looking image: every pixel is a palette colour
+    ColourRGBA8* pixels = new ColourRGBA8[numPixels];
+    for (long long i = 0; i < numPixels; i++)
+    {
+        pixels[i] = pal[BenchmarkRandom(&seed) >> 24];
+    }
+    printf("%lld pixels, %d colour palette, %d threads\n", numPixels, numColours, omp_get_max_threads());
+
+    //Reference: per-pixel linear search of the palette, as the occurrence count used to do it
+    double startTime = omp_get_wtime();
+    long long refOcc[256];
+    memset(refOcc, 0, sizeof(refOcc));
+    const uint32_t* pixui = (const uint32_t*)pixels;
+    const uint32_t* palui = (const uint32_t*)pal;
+    for (long long i = 0; i < numPixels; i++)
+    {
+        for (int j = 0; j < numColours; j++)
+        {
+            if (pixui[i] == palui[j]) refOcc[j]++;
+        }
+    }
+    double refTime = omp_get_wtime() - startTime;
+
+    startTime = omp_get_wtime();
+    ColourHistogram hist;
+    hist.Build(pixels, numPixels);
+    double buildTime = omp_get_wtime() - startTime;
+    startTime = omp_get_wtime();
+    bool subset = hist.IsSubsetOf(pal, numColours);
+    long long occ[256];
+    for (int j = 0; j < numColours; j++)
+    {
+        occ[j] = hist.GetCount(pal[j]);
+    }
+    double queryTime = omp_get_wtime() - startTime;
+    bool match = subset && !memcmp(occ, refOcc, sizeof(occ));
+    printf("  linear scan      %9.3f ms\n", refTime * 1e3);
+    printf("  histogram build  %9.3f ms, queries %.3f ms (%lld colours, %s)\n", buildTime * 1e3, queryTime * 1e3, hist.GetNumColours(), match ? "matches" : "MISMATCH");
+    delete[] pixels;
+
+    //Worst case, nearly every pixel a different colour
+    const long long numNoisePixels = 3840 * 2160;
+    pixels = MakeNoiseImage(numNoisePixels, 3);
+    startTime = omp_get_wtime();
+    hist.Build(pixels, numNoisePixels);
+    buildTime = omp_get_wtime() - startTime;
+    printf("  noise %lldpx     %9.3f ms (%lld colours)\n", numNoisePixels, buildTime * 1e3, hist.GetNumColours());
+    delete[] pixels;
+}
+
+//Total squared distance from every point to its closest mean, weighted like the clustering itself
+static double KMeansCost(const KMeansPoints* pts, const ColourOkLabA* means, int numMeans)
+{
+    double cost = 0.0;
+    #pragma omp parallel for reduction(+:cost)
+    for (long long i = 0; i < pts->numPoints; i++)
+    {
+        float lowestDistance = 999999999999999999999999.9;
+        for (int j = 0; j < numMeans; j++)
+        {
+            const float dL = pts->L[i] - means[j].L;
+            const float da = pts->a[i] - means[j].a;
+            const float db = pts->b[i] - means[j].b;
+            const float dist = (dL * dL) + (da * da) + (db * db);
+            if (dist < lowestDistance) lowestDistance = dist;
+        }
+        cost += ((double)pts->weights[i]) * ((double)lowestDistance);
+    }
+    return cost;
+}
+
+static void BenchmarkKMeans()
+{
+    const int w = 1920;
+    const int h = 1080;
+    const long long numPixels = w * h;
+    const int numSrcColours = 2000;
+    const int numMeans = 16;
+    //Pixel art scaled up 4x, drawn from a limited set of colours
+    ColourRGBA8* srcPal = MakeNoiseImage(numSrcColours, 4);
+    ColourRGBA8* pixels = new ColourRGBA8[numPixels];
+    unsigned int seed = 5;
+    for (int y = 0; y < h; y += 4)
+    {
+        for (int x = 0; x < w; x += 4)
+        {
+            ColourRGBA8 col = srcPal[(BenchmarkRandom(&seed) >> 8) % numSrcColours];
+            for (int i = 0; i < 4; i++)
+            {
+                for (int j = 0; j < 4; j++)
+                {
+                    pixels[(y + i) * w + x + j] = col;
+                }
+            }
+        }
+    }
+    printf("%lld pixels, %d source colours, %d means, %d threads\n", numPixels, numSrcColours, numMeans, omp_get_max_threads());
+
+    KMeansPoints pixelPts;
+    AllocKMeansPoints(&pixelPts, numPixels);
+    float* alpha = new float[numPixels];
+    SRGB8ToOkLabBatch(pixels, pixelPts.L, pixelPts.a, pixelPts.b, alpha, numPixels);
+    for (long long i = 0; i < numPixels; i++)
+    {
+        pixelPts.weights[i] = 1;
+    }
+    delete[] alpha;
+    ColourOkLabA means[256];
+    std::mt19937_64 rng(1);
+    double startTime = omp_get_wtime();
+    RunKMeans(&pixelPts, means, numMeans, 1.0f, true, rng);
+    double pixelTime = omp_get_wtime() - startTime;
+    double pixelCost = KMeansCost(&pixelPts, means, numMeans);
+
+    //Weighted unique colours, including the time taken to collapse the image
+    startTime = omp_get_wtime();
+    ColourHistogram hist;
+    hist.Build(pixels, numPixels);
+    long long numUnique = hist.GetNumColours();
+    ColourRGBA8* uniqueCols = new ColourRGBA8[numUnique];
+    long long* counts = new long long[numUnique];
+    hist.GetColours(uniqueCols, counts);
+    KMeansPoints uniquePts;
+    AllocKMeansPoints(&uniquePts, numUnique);
+    alpha = new float[numUnique];
+    SRGB8ToOkLabBatch(uniqueCols, uniquePts.L, uniquePts.a, uniquePts.b, alpha, numUnique);
+    for (long long i = 0; i < numUnique; i++)
+    {
+        uniquePts.weights[i] = (unsigned int)counts[i];
+    }
+    double collapseTime = omp_get_wtime() - startTime;
+    rng.seed(1);
+    startTime = omp_get_wtime();
+    RunKMeans(&uniquePts, means, numMeans, 1.0f, true, rng);
+    double uniqueTime = omp_get_wtime() - startTime;
+    double uniqueCost = KMeansCost(&pixelPts, means, numMeans);
+
+    printf("  every pixel      %9.3f ms (cost %.4f)\n", pixelTime * 1e3, pixelCost/numPixels);
+    printf("  unique colours   %9.3f ms + %.3f ms to collapse (%lld points, cost %.4f)\n", uniqueTime * 1e3, collapseTime * 1e3, numUnique, uniqueCost/numPixels);
+    delete[] alpha;
+    delete[] uniqueCols;
+    delete[] counts;
+    FreeKMeansPoints(&pixelPts);
+    FreeKMeansPoints(&uniquePts);
+    delete[] pixels;
+    delete[] srcPal;
+}
+
+static void BenchmarkKMeansEngines()
+{
+    const long long numPoints = 50000;
+    const int numMeansToTry[] = { 16, 64, 256 };
+    ColourRGBA8* cols = MakeNoiseImage(numPoints, 6);
+    KMeansPoints pts;
+    AllocKMeansPoints(&pts, numPoints);
+    float* alpha = new float[numPoints];
+    SRGB8ToOkLabBatch(cols, pts.L, pts.a, pts.b, alpha, numPoints);
+    for (long long i = 0; i < numPoints; i++)
+    {
+        pts.weights[i] = 1;
+    }
+    delete[] alpha;
+    delete[] cols;
+    printf("%lld points, %d threads\n", numPoints, omp_get_max_threads());
+
+    for (int n = 0; n < 3; n++)
+    {
+        const int numMeans = numMeansToTry[n];
+        ColourOkLabA lloydMeans[256];
+        ColourOkLabA hamerlyMeans[256];
+        std::mt19937_64 rng(1);
+        SeedKMeans(&pts, lloydMeans, numMeans, 1.0f, rng);
+        memcpy(hamerlyMeans, lloydMeans, sizeof(lloydMeans));
+        std::mt19937_64 rngCopy = rng;
+        double startTime = omp_get_wtime();
+        int lloydIters = IterateKMeans(&pts, lloydMeans, numMeans, 1.0f, true, rng, KMEANS_ENGINE_LLOYD);
+        double lloydTime = omp_get_wtime() - startTime;
+        startTime = omp_get_wtime();
+        int hamerlyIters = IterateKMeans(&pts, hamerlyMeans, numMeans, 1.0f, true, rngCopy, KMEANS_ENGINE_HAMERLY);
+        double hamerlyTime = omp_get_wtime() - startTime;
+        bool match = (lloydIters == hamerlyIters) && !memcmp(lloydMeans, hamerlyMeans, numMeans * sizeof(ColourOkLabA));
+        printf("  %3d means  Lloyd %8.1f it/s, Hamerly %8.1f it/s (%d iterations, %s)\n", numMeans, lloydIters/lloydTime, hamerlyIters/hamerlyTime, hamerlyIters, match ? "matches" : "MISMATCH");
+    }
+    FreeKMeansPoints(&pts);
+}
+
+static void BenchmarkKMeansThreads()
+{
+    const long long numPoints = 200000;
+    const int numMeans = 64;
+    const int maxThreads = omp_get_max_threads();
+    ColourRGBA8* cols = MakeNoiseImage(numPoints, 7);
+    KMeansPoints pts;
+    AllocKMeansPoints(&pts, numPoints);
+    float* alpha = new float[numPoints];
+    SRGB8ToOkLabBatch(cols, pts.L, pts.a, pts.b, alpha, numPoints);
+    for (long long i = 0; i < numPoints; i++)
+    {
+        pts.weights[i] = 1;
+    }
+    delete[] alpha;
+    delete[] cols;
+    printf("%lld points, %d means\n", numPoints, numMeans);
+
+    double seedTime1 = 0.0;
+    double iterTime1 = 0.0;
+    ColourOkLabA means1[256];
+    for (int t = 1; t <= maxThreads; t = (t * 2 > maxThreads && t != maxThreads) ? maxThreads : t * 2)
+    {
+        omp_set_num_threads(t);
+        ColourOkLabA means[256];
+        std::mt19937_64 rng(1);
+        double startTime = omp_get_wtime();
+        SeedKMeans(&pts, means, numMeans, 1.0f, rng);
+        double seedTime = omp_get_wtime() - startTime;
+        startTime = omp_get_wtime();
+        int iters = IterateKMeans(&pts, means, numMeans, 1.0f, true, rng, KMEANS_ENGINE_LLOYD);
+        double iterTime = (omp_get_wtime() - startTime)/iters;
+        if (t == 1)
+        {
+            seedTime1 = seedTime;
+            iterTime1 = iterTime;
+            memcpy(means1, means, sizeof(means));
+        }
+        bool match = !memcmp(means1, means, numMeans * sizeof(ColourOkLabA));
+        printf("  %3d threads  seeding %9.3f ms (x%5.2f), Lloyd iteration %8.3f ms (x%5.2f), %s\n", t, seedTime * 1e3, seedTime1/seedTime, iterTime * 1e3, iterTime1/iterTime, match ? "same means" : "DIFFERENT MEANS");
+    }
+    omp_set_num_threads(maxThreads);
+    FreeKMeansPoints(&pts);
+}
+
+static void BenchmarkKMeansMiniBatch()
+{
+    const int w = 1920;
+    const int h = 1080;
+    const long long numPixels = w * h;
+    const int numMeans = 64;
+    ColourRGBA8* pixels = MakeSmoothImage(w, h, 8);
+    KMeansPoints pts;
+    AllocKMeansPoints(&pts, numPixels);
+    float* alpha = new float[numPixels];
+    SRGB8ToOkLabBatch(pixels, pts.L, pts.a, pts.b, alpha, numPixels);
+    for (long long i = 0; i < numPixels; i++)
+    {
+        pts.weights[i] = 1;
+    }
+    delete[] alpha;
+    delete[] pixels;
+    printf("%lld pixels, %d means, %d threads\n", numPixels, numMeans, omp_get_max_threads());
+
+    ColourOkLabA means[256];
+    std::mt19937_64 rng(1);
+    double startTime = omp_get_wtime();
+    int iters = RunKMeans(&pts, means, numMeans, 1.0f, true, rng);
+    double fullTime = omp_get_wtime() - startTime;
+    printf("  full Hamerly          %9.3f ms (%d iterations, cost %.6f)\n", fullTime * 1e3, iters, KMeansCost(&pts, means, numMeans)/numPixels);
+    const int batchSizes[] = { 1024, 4096, 16384 };
+    for (int i = 0; i < 3; i++)
+    {
+        rng.seed(1);
+        startTime = omp_get_wtime();
+        int batches = RunMiniBatchKMeans(&pts, means, numMeans, 1.0f, true, rng, batchSizes[i], false);
+        double batchTime = omp_get_wtime() - startTime;
+        printf("  mini-batch %5d      %9.3f ms (%d batches, cost %.6f)\n", batchSizes[i], batchTime * 1e3, batches, KMeansCost(&pts, means, numMeans)/numPixels);
+    }
+    rng.seed(1);
+    startTime = omp_get_wtime();
+    iters = RunMiniBatchKMeans(&pts, means, numMeans, 1.0f, true, rng, 4096, true);
+    double refineTime = omp_get_wtime() - startTime;
+    printf("  mini-batch 4096+full %9.3f ms (%d batches and iterations, cost %.6f)\n", refineTime * 1e3, iters, KMeansCost(&pts, means, numMeans)/numPixels);
+    FreeKMeansPoints(&pts);
+}
+
+static void BenchmarkQuantizers()
+{
+    const int w = 1280;
+    const int h = 720;
+    const long long numPixels = w * h;
+    ColourRGBA8* pixels = MakeSmoothImage(w, h, 9);
+    ColourHistogram hist;
+    hist.Build(pixels, numPixels);
+    delete[] pixels;
+    const long long numUnique = hist.GetNumColours();
+    ColourRGBA8* uniqueCols = new ColourRGBA8[numUnique];
+    long long* counts = new long long[numUnique];
+    hist.GetColours(uniqueCols, counts);
+    KMeansPoints pts;
+    AllocKMeansPoints(&pts, numUnique);
+    float* alpha = new float[numUnique];
+    SRGB8ToOkLabBatch(uniqueCols, pts.L, pts.a, pts.b, alpha, numUnique);
+    for (long long i = 0; i < numUnique; i++)
+    {
+        pts.weights[i] = (unsigned int)counts[i];
+    }
+    delete[] alpha;
+    delete[] uniqueCols;
+    delete[] counts;
+    printf("%lld pixels, %lld unique colours, %d threads\n", numPixels, numUnique, omp_get_max_threads());
+
+    const char* names[] = { "k-means", "Wu", "median cut", "octree" };
+    const int numColoursToTry[] = { 16, 256 };
+    for (int n = 0; n < 2; n++)
+    {
+        const int numColours = numColoursToTry[n];
+        printf("  %d colours\n", numColours);
+        for (int q = QUANTIZER_KMEANS; q <= QUANTIZER_OCTREE; q++)
+        {
+            ColourOkLabA cols[256];
+            std::mt19937_64 rng(1);
+            double startTime = omp_get_wtime();
+            if (q == QUANTIZER_KMEANS) RunKMeans(&pts, cols, numColours, 1.0f, true, rng);
+            else RunQuantizer(q, &pts, cols, numColours, 1.0f);
+            double quantTime = omp_get_wtime() - startTime;
+            double cost = KMeansCost(&pts, cols, numColours)/numPixels;
+            if (q == QUANTIZER_KMEANS)
+            {
+                printf("    %-10s %9.3f ms (cost %.6f)\n", names[q], quantTime * 1e3, cost);
+                continue;
+            }
+            startTime = omp_get_wtime();
+            IterateKMeans(&pts, cols, numColours, 1.0f, true, rng);
+            double refineTime = omp_get_wtime() - startTime;
+            printf("    %-10s %9.3f ms (cost %.6f), refined with k-means %9.3f ms more (cost %.6f)\n", names[q], quantTime * 1e3, cost, refineTime * 1e3, KMeansCost(&pts, cols, numColours)/numPixels);
+        }
+    }
+    FreeKMeansPoints(&pts);
+}
+
+//The search the nearest colour index replaced
+static int LinearNearestColour(const ColourOkLabA* pal, int numColours, ColourOkLabA col, float bright, float contrast, float uvbias, float* outDist)
+{
+    float lowestDistance = 999999999999999999999999.9;
+    int chosenColour = 0;
+    col = ColourAdjust(col, bright, contrast);
+    for (int i = 0; i < numColours; i++)
+    {
+        const float dL = (col.L - pal[i].L) * uvbias;
+        const float da = col.a - pal[i].a;
+        const float db = col.b - pal[i].b;
+        const float dist = (dL * dL) + (da * da) + (db * db);
+        if (dist < lowestDistance)
+        {
+            lowestDistance = dist;
+            chosenColour = i;
+        }
+    }
+    *outDist = lowestDistance;
+    return chosenColour;
+}
+
+static void BenchmarkNearestColour()
+{
+    const int w = 1280;
+    const int h = 720;
+    const long long numPixels = w * h;
+    ColourRGBA8* pixels = MakeSmoothImage(w, h, 10);
+    float* L = new float[numPixels];
+    float* a = new float[numPixels];
+    float* b = new float[numPixels];
+    float* alpha = new float[numPixels];
+    SRGB8ToOkLabBatch(pixels, L, a, b, alpha, numPixels);
+    delete[] pixels;
+    ColourRGBA8* palCols = MakeNoiseImage(256, 11);
+    ColourOkLabA pal[256];
+    for (int i = 0; i < 256; i++)
+    {
+        pal[i] = SRGBToOkLab(SRGB8ToLinearFloat(palCols[i]));
+    }
+    delete[] palCols;
+    printf("%lld pixels, %d threads\n", numPixels, omp_get_max_threads());
+
+    const float bright = 0.02f;
+    const float contrast = 0.1f;
+    const float uvbias = 1.5f;
+    const int numColoursToTry[] = { 4, 16, 64, 256 };
+    NearestColourIndex* index = new NearestColourIndex();
+    int* linearOut = new int[numPixels];
+    int* indexOut = new int[numPixels];
+    for (int n = 0; n < 4; n++)
+    {
+        const int numColours = numColoursToTry[n];
+        double startTime = omp_get_wtime();
+        #pragma omp parallel for
+        for (long long i = 0; i < numPixels; i++)
+        {
+            ColourOkLabA col = { L[i], a[i], b[i], alpha[i] };
+            float dist;
+            linearOut[i] = LinearNearestColour(pal, numColours, col, bright, contrast, uvbias, &dist);
+        }
+        double linearTime = omp_get_wtime() - startTime;
+        startTime = omp_get_wtime();
+        index->Build(pal, numColours, bright, contrast, uvbias);
+        double buildTime = omp_get_wtime() - startTime;
+        startTime = omp_get_wtime();
+        #pragma omp parallel for
+        for (long long i = 0; i < numPixels; i++)
+        {
+            ColourOkLabA col = { L[i], a[i], b[i], alpha[i] };
+            indexOut[i] = index->FindNearest(col);
+        }
+        double indexTime = omp_get_wtime() - startTime;
+
+        //Folding the adjustment into the palette rounds differently, so only count a different choice as wrong if it is actually further away
+        long long numDifferent = 0;
+        long long numWorse = 0;
+        for (long long i = 0; i < numPixels; i++)
+        {
+            if (linearOut[i] == indexOut[i]) continue;
+            numDifferent++;
+            ColourOkLabA col = ColourAdjust({ L[i], a[i], b[i], alpha[i] }, bright, contrast);
+            float linearDist;
+            LinearNearestColour(pal, numColours, { L[i], a[i], b[i], alpha[i] }, bright, contrast, uvbias, &linearDist);
+            const ColourOkLabA p = pal[indexOut[i]];
+            const float dL = (col.L - p.L) * uvbias;
+            const float indexDist = (dL * dL) + ((col.a - p.a) * (col.a - p.a)) + ((col.b - p.b) * (col.b - p.b));
+            if (indexDist > linearDist * 1.0001f + 1e-9f) numWorse++;
+        }
+        printf("  %3d colours  linear %8.2f Mpix/s, index %8.2f Mpix/s (built in %.3f ms), %lld ties broken differently, %s\n", numColours, numPixels/(linearTime * 1e6), numPixels/(indexTime * 1e6), buildTime * 1e3, numDifferent - numWorse, numWorse ? "MISMATCH" : "matches");
+
+        //The vectorised scans on the adjusted colours have to agree exactly with the linear scan
+        ColourOkLabA adjPal[256];
+        memcpy(adjPal, pal, sizeof(adjPal));
+        for (int k = CONVERT_SCALAR; k <= CONVERT_AVX512; k++)
+        {
+            if (!IsConvertKernelSupported(k)) continue;
+            NearestColourSoA* soa = new NearestColourSoA;
+            FillNearestColourSoA(soa, adjPal, numColours, uvbias, k);
+            startTime = omp_get_wtime();
+            #pragma omp parallel for
+            for (long long i = 0; i < numPixels; i++)
+            {
+                ColourOkLabA col = ColourAdjust({ L[i], a[i], b[i], alpha[i] }, bright, contrast);
+                indexOut[i] = FindNearestColourSoA(soa, col);
+            }
+            double scanTime = omp_get_wtime() - startTime;
+            delete soa;
+            bool match = !memcmp(linearOut, indexOut, numPixels * sizeof(int));
+            printf("               %-8s scan %8.2f Mpix/s, %s\n", GetConvertKernelName(k), numPixels/(scanTime * 1e6), match ? "matches" : "MISMATCH");
+        }
+    }
+    delete index;
+    delete[] linearOut;
+    delete[] indexOut;
+    delete[] L;
+    delete[] a;
+    delete[] b;
+    delete[] alpha;
+}
+
+static void BenchmarkInverseColourMap()
+{
+    const int w = 1280;
+    const int h = 720;
+    const long long numPixels = w * h;
+    ColourRGBA8* pixels = MakeSmoothImage(w, h, 12);
+    float* L = new float[numPixels];
+    float* a = new float[numPixels];
+    float* b = new float[numPixels];
+    float* alpha = new float[numPixels];
+    ColourRGBA8* palCols = MakeNoiseImage(256, 13);
+    ColourOkLabA pal[256];
+    for (int i = 0; i < 256; i++)
+    {
+        pal[i] = SRGBToOkLab(SRGB8ToLinearFloat(palCols[i]));
+    }
+    delete[] palCols;
+    printf("%lld pixels, %d threads\n", numPixels, omp_get_max_threads());
+
+    const float preBright = -0.03f;
+    const float preContrast = 0.05f;
+    const float postBright = 0.02f;
+    const float postContrast = 0.1f;
+    const float uvbias = 1.5f;
+    const int numColoursToTry[] = { 16, 256 };
+    int* linearOut = new int[numPixels];
+    int* mapOut = new int[numPixels];
+    InverseColourMap* map = new InverseColourMap();
+    for (int n = 0; n < 2; n++)
+    {
+        const int numColours = numColoursToTry[n];
+        //What the undithered path did before: convert, adjust twice and scan
+        double startTime = omp_get_wtime();
+        SRGB8ToOkLabBatch(pixels, L, a, b, alpha, numPixels);
+        #pragma omp parallel for
+        for (long long i = 0; i < numPixels; i++)
+        {
+            ColourOkLabA col = ColourAdjust({ L[i], a[i], b[i], alpha[i] }, preBright, preContrast);
+            float dist;
+            linearOut[i] = LinearNearestColour(pal, numColours, col, postBright, postContrast, uvbias, &dist);
+        }
+        double linearTime = omp_get_wtime() - startTime;
+
+        startTime = omp_get_wtime();
+        map->Reset(pal, numColours, preBright, preContrast, postBright, postContrast, uvbias);
+        map->Prepare(pixels, numPixels, 0);
+        double buildTime = omp_get_wtime() - startTime;
+        double lookupTime = 0.0;
+        for (int r = 0; r < 2; r++) //The second time round the map is already there
+        {
+            startTime = omp_get_wtime();
+            map->Prepare(pixels, numPixels, 0);
+            #pragma omp parallel for
+            for (long long i = 0; i < numPixels; i++)
+            {
+                mapOut[i] = map->Lookup(pixels[i]);
+            }
+            lookupTime = omp_get_wtime() - startTime;
+        }
+
+        //The map converts colours with the scalar functions rather than the batch kernels, so allow for ties
+        long long numWorse = 0;
+        long long numDifferent = 0;
+        for (long long i = 0; i < numPixels; i++)
+        {
+            if (linearOut[i] == mapOut[i]) continue;
+            numDifferent++;
+            ColourOkLabA col = ColourAdjust(ColourAdjust({ L[i], a[i], b[i], alpha[i] }, preBright, preContrast), postBright, postContrast);
+            const ColourOkLabA p = pal[mapOut[i]];
+            const ColourOkLabA q = pal[linearOut[i]];
+            const float dpL = (col.L - p.L) * uvbias;
+            const float dqL = (col.L - q.L) * uvbias;
+            const float pDist = (dpL * dpL) + ((col.a - p.a) * (col.a - p.a)) + ((col.b - p.b) * (col.b - p.b));
+            const float qDist = (dqL * dqL) + ((col.a - q.a) * (col.a - q.a)) + ((col.b - q.b) * (col.b - q.b));
+            if (pDist > qDist * 1.0001f + 1e-9f) numWorse++;
+        }
+        printf("  %3d colours  convert and scan %8.3f ms, build map %8.3f ms, look up %8.3f ms, %lld ties broken differently, %s\n", numColours, linearTime * 1e3, buildTime * 1e3, lookupTime * 1e3, numDifferent - numWorse, numWorse ? "MISMATCH" : "matches");
+    }
+    delete map;
+    delete[] linearOut;
+    delete[] mapOut;
+    delete[] pixels;
+    delete[] L;
+    delete[] a;
+    delete[] b;
+    delete[] alpha;
+}
+
+//Times an ordered dither with the memo, and checks it gives the same output as searching every pixel, with 1 thread and with all of them
+static void TimeOrderedDither(ImageHandler* ihand, const char* name, ColourRGBA8* refOutput)
+{
+    const int maxThreads = omp_get_max_threads();
+    const long long numPixels = ((long long)ihand->GetEncodedImage()->width) * ihand->GetEncodedImage()->height;
+    omp_set_num_threads(1);
+    ihand->orderedMemo = false;
+    ihand->DitherImage();
+    memcpy(refOutput, ihand->GetEncodedImage()->data, numPixels * sizeof(ColourRGBA8));
+    ihand->orderedMemo = true;
+    ihand->DitherImage();
+    bool match = !memcmp(refOutput, ihand->GetEncodedImage()->data, numPixels * sizeof(ColourRGBA8));
+    omp_set_num_threads(maxThreads);
+    double ditherTime = TimeDitherImage(ihand);
+    match = match && !memcmp(refOutput, ihand->GetEncodedImage()->data, numPixels * sizeof(ColourRGBA8));
+    printf("    %-12s %9.3f ms (memo hit rate %5.1f%%), %s\n", name, ditherTime * 1e3, ihand->GetOrderedDitherHitRate() * 100.0, match ? "same output as without the memo" : "DIFFERENT OUTPUT WITHOUT THE MEMO");
+}
+
+static void BenchmarkOrderedDither()
+{
+    const int w = 1283; //Not a multiple of 8, so the end of each row goes through the scalar dither kernel
+    const int h = 720;
+    const char* imageNames[] = { "32 colour blocks", "photo-like" };
+    const char* methodNames[] = { "Bayer 2x2", "Bayer 4x4", "Bayer 8x8", "Bayer 16x16", "Void 16x16" };
+    const int customSizes[] = { 64, 48 }; //Power of two and not
+    ImageHandler* ihand = new ImageHandler();
+    ColourRGBA8* refOutput = new ColourRGBA8[((long long)w) * h];
+    printf("%dx%d, 256 colour palette, %d threads\n", w, h, omp_get_max_threads());
+    for (int im = 0; im < 2; im++)
+    {
+        ColourRGBA8* pixels = (im == 0) ? MakeBlockImage(w, h, 32, 14) : MakeSmoothImage(w, h, 15);
+        ihand->SetImage(pixels, w, h);
+        delete[] pixels;
+        SetNoisePalette(ihand, 16);
+        printf("  %s\n", imageNames[im]);
+        for (int m = BAYER2X2; m <= VOID16X16; m++)
+        {
+            ihand->ditherMethod = m;
+            TimeOrderedDither(ihand, methodNames[m - BAYER2X2], refOutput);
+        }
+        for (int s = 0; s < 2; s++)
+        {
+            //Any permutation of the cells will do for timing
+            const int size = customSizes[s];
+            const int n = size * size;
+            float* matrix = new float[n];
+            for (int i = 0; i < n; i++)
+            {
+                matrix[i] = ((float)((i * 1031) % n)) / n - 0.5f;
+            }
+            ihand->SetThresholdMatrix(matrix, size);
+            delete[] matrix;
+            ihand->ditherMethod = CUSTOMMATRIX;
+            char name[32];
+            snprintf(name, sizeof(name), "Custom %dx%d", size, size);
+            TimeOrderedDither(ihand, name, refOutput);
+        }
+    }
+    delete[] refOutput;
+    delete ihand;
+}
+
+static void BenchmarkExpandedRows()
+{
+    const int w = 2048;
+    const int h = 2048;
+    const int reps = 5;
+    const int ew = w + 2*EDD_EXPAND_X;
+    const long long numRows = h + EDD_EXPAND_Y_TOP + EDD_EXPAND_Y_BOTTOM;
+    ColourRGBA8* pixels = MakeSpriteSheet(w, h, 64, 23);
+    ColourRGBA8* refRows = new ColourRGBA8[numRows * ew];
+    ColourRGBA8* outRows = new ColourRGBA8[numRows * ew];
+    printf("%dx%d sprite sheet, every expanded row, %d threads for the opacity scan\n", w, h, omp_get_max_threads());
+    for (int k = CONVERT_SCALAR; k <= CONVERT_AVX512; k++)
+    {
+        if (!IsConvertKernelSupported(k))
+        {
+            printf("  %-10s not supported on this machine\n", GetConvertKernelName(k));
+            continue;
+        }
+        ColourRGBA8* rowsOut = (k == CONVERT_SCALAR) ? refRows : outRows;
+        double startTime = omp_get_wtime();
+        for (int r = 0; r < reps; r++)
+        {
+            ExpandedRowSource src;
+            ExpandedRowCache cache;
+            InitExpandedRowSource(&src, pixels, w, h, 0x80, k);
+            InitExpandedRowCache(&cache, w);
+            for (long long i = 0; i < numRows; i++)
+            {
+                GetExpandedRow(&src, &cache, i - EDD_EXPAND_Y_TOP, rowsOut + i * ew);
+            }
+            FreeExpandedRowCache(&cache);
+            FreeExpandedRowSource(&src);
+        }
+        double expandTime = (omp_get_wtime() - startTime)/reps;
+        bool match = !memcmp(refRows, rowsOut, numRows * ew * sizeof(ColourRGBA8));
+        printf("  %-10s %9.3f ms %8.2f Mpix/s, %s\n", GetConvertKernelName(k), expandTime * 1e3, ((numRows * ew)/expandTime) * 1e-6, match ? "same rows" : "DIFFERENT ROWS");
+    }
+    delete[] outRows;
+    delete[] refRows;
+    delete[] pixels;
+}
+
+static void BenchmarkErrorDiffusion()
+{
+    const int w = 1280;
+    const int h = 720;
+    const int methods[] = { FLOYD_STEINBERG, JJN, STUCKI, ATKINSON };
+    const char* methodNames[] = { "Floyd-Steinberg", "JJN", "Stucki", "Atkinson" };
+    const int paletteSizes[] = { 16, 256 };
+    ImageHandler* ihand = new ImageHandler();
+    ColourRGBA8* pixels = MakeSmoothImage(w, h, 17);
+    ihand->SetImage(pixels, w, h);
+    delete[] pixels;
+    printf("%dx%d photo-like image\n", w, h);
+    for (int p = 0; p < 2; p++)
+    {
+        if (paletteSizes[p] == 256)
+        {
+            SetNoisePalette(ihand, 18);
+        }
+        printf("  %d colour palette\n", paletteSizes[p]);
+        for (int m = 0; m < 4; m++)
+        {
+            ihand->ditherMethod = methods[m];
+            double ditherTime = TimeDitherImage(ihand);
+            printf("    %-16s %9.3f ms\n", methodNames[m], ditherTime * 1e3);
+        }
+    }
+    delete ihand;
+}
+
+static void BenchmarkErrorDiffusionThreads()
+{
+    const int w = 1920;
+    const int h = 1080;
+    const int maxThreads = omp_get_max_threads();
+    const int methods[] = { FLOYD_STEINBERG, JJN, STUCKI, ATKINSON, FLOYD_STEINBERG };
+    const char* methodNames[] = { "Floyd-Steinberg", "JJN", "Stucki", "Atkinson", "Floyd-Steinberg, randomised" };
+    const double randomisation[] = { 0.0, 0.0, 0.0, 0.0, 0.02 };
+    ImageHandler* ihand = new ImageHandler();
+    ColourRGBA8* pixels = MakeSmoothImage(w, h, 19);
+    ihand->SetImage(pixels, w, h);
+    delete[] pixels;
+    SetNoisePalette(ihand, 20);
+    const long long numPixels = ((long long)w) * h;
+    ColourRGBA8* output1 = new ColourRGBA8[numPixels];
+    printf("%dx%d photo-like image, 256 colour palette\n", w, h);
+    for (int m = 0; m < 5; m++)
+    {
+        printf("  %s\n", methodNames[m]);
+        ihand->ditherMethod = methods[m];
+        ihand->luminosityRandomisation = randomisation[m];
+        ihand->chromaRandomisation = randomisation[m];
+        double ditherTime1 = 0.0;
+        for (int t = 1; t <= maxThreads; t = (t * 2 > maxThreads && t != maxThreads) ? maxThreads : t * 2)
+        {
+            omp_set_num_threads(t);
+            double ditherTime = TimeDitherImage(ihand);
+            const ColourRGBA8* output = ihand->GetEncodedImage()->data;
+            if (t == 1)
+            {
+                ditherTime1 = ditherTime;
+                memcpy(output1, output, numPixels * sizeof(ColourRGBA8));
+            }
+            bool match = !memcmp(output1, output, numPixels * sizeof(ColourRGBA8));
+            printf("    %3d threads %9.3f ms (x%5.2f), %s\n", t, ditherTime * 1e3, ditherTime1/ditherTime, match ? "same output" : "DIFFERENT OUTPUT");
+        }
+    }
+    omp_set_num_threads(maxThreads);
+    delete[] output1;
+    delete ihand;
+}
+
+//OkLab distance between the mean colours of the 8x8 blocks at (x, y) in two images
+static double BlockMeanDistance(const ColourRGBA8* img1, const ColourRGBA8* img2, int w, int x, int y)
+{
+    double sum[3] = { 0.0, 0.0, 0.0 };
+    for (int j = y; j < y + 8; j++)
+    {
+        for (int i = x; i < x + 8; i++)
+        {
+            ColourOkLabA col1 = SRGBToOkLab(SRGB8ToLinearFloat(img1[((long long)j) * w + i]));
+            ColourOkLabA col2 = SRGBToOkLab(SRGB8ToLinearFloat(img2[((long long)j) * w + i]));
+            sum[0] += col1.L - col2.L;
+            sum[1] += col1.a - col2.a;
+            sum[2] += col1.b - col2.b;
+        }
+    }
+    return sqrt(sum[0] * sum[0] + sum[1] * sum[1] + sum[2] * sum[2])/64.0;
+}
+
+static void BenchmarkErrorDiffusionStrips()
+{
+    const int w = 1920;
+    const int h = 1080;
+    const int methods[] = { FLOYD_STEINBERG, JJN, STUCKI, ATKINSON };
+    const char* methodNames[] = { "Floyd-Steinberg", "JJN", "Stucki", "Atkinson" };
+    ImageHandler* ihand = new ImageHandler();
+    ColourRGBA8* pixels = MakeSmoothImage(w, h, 21);
+    ihand->SetImage(pixels, w, h);
+    delete[] pixels;
+    SetNoisePalette(ihand, 22);
+    const long long numPixels = ((long long)w) * h;
+    ColourRGBA8* serial = new ColourRGBA8[numPixels];
+    printf("%dx%d photo-like image, 256 colour palette, %d threads\n", w, h, omp_get_max_threads());
+    for (int m = 0; m < 4; m++)
+    {
+        ihand->ditherMethod = methods[m];
+        ihand->stripDiffusion = false;
+        double serialTime = TimeDitherImage(ihand);
+        memcpy(serial, ihand->GetEncodedImage()->data, numPixels * sizeof(ColourRGBA8));
+        ihand->stripDiffusion = true;
+        double startTime = omp_get_wtime();
+        ihand->DitherImage();
+        double stripTime = omp_get_wtime() - startTime;
+
+        //The dither pattern can change all the way down a strip once its error differs, so what matters is whether the local average colour,
+        //which is all that's visible, changes any more at the seams than anywhere else
+        const ColourRGBA8* strips = ihand->GetEncodedImage()->data;
+        long long numDiff = 0;
+        for (long long i = 0; i < numPixels; i++)
+        {
+            if (memcmp(&serial[i], &strips[i], sizeof(ColourRGBA8))) numDiff++;
+        }
+        double sumDist = 0.0;
+        double maxDist = 0.0;
+        int numBlocks = 0;
+        for (int y = 0; y + 8 <= h; y += 8)
+        {
+            for (int x = 0; x + 8 <= w; x += 8)
+            {
+                double dist = BlockMeanDistance(serial, strips, w, x, y);
+                sumDist += dist;
+                if (dist > maxDist) maxDist = dist;
+                numBlocks++;
+            }
+        }
+        const int numStrips = GetDiffusionStripCount(h, omp_get_max_threads());
+        double sumSeamDist = 0.0;
+        double maxSeamDist = 0.0;
+        int numSeamBlocks = 0;
+        for (int s = 1; s < numStrips; s++)
+        {
+            const int y = (int)((((long long)h) * s) / numStrips);
+            for (int x = 0; x + 8 <= w; x += 8)
+            {
+                double dist = BlockMeanDistance(serial, strips, w, x, y);
+                sumSeamDist += dist;
+                if (dist > maxSeamDist) maxSeamDist = dist;
+                numSeamBlocks++;
+            }
+        }
+        printf("  %-16s serial %9.3f ms, %d strips %9.3f ms (x%5.2f), %.3f%% of pixels differ\n", methodNames[m], serialTime * 1e3, numStrips, stripTime * 1e3, serialTime/stripTime, (100.0 * numDiff)/numPixels);
+        printf("  %-16s 8x8 block mean OkLab distance: whole image %.5f (max %.5f), below seams %.5f (max %.5f)\n", "", sumDist/numBlocks, maxDist, numSeamBlocks ? sumSeamDist/numSeamBlocks : 0.0, maxSeamDist);
+    }
+    delete[] serial;
+    delete ihand;
+}
+
+static void BenchmarkSparseDiffusion()
+{
+    const int w = 2048;
+    const int h = 2048;
+    const int methods[] = { FLOYD_STEINBERG, JJN, ATKINSON };
+    const char* methodNames[] = { "Floyd-Steinberg", "JJN", "Atkinson" };
+    const int cellSizes[] = { 64, 256 };
+    ImageHandler* ihand = new ImageHandler();
+    SetNoisePalette(ihand, 24);
+    const long long numPixels = ((long long)w) * h;
+    ColourRGBA8* full = new ColourRGBA8[numPixels];
+    for (int c = 0; c < 2; c++)
+    {
+        ColourRGBA8* pixels = MakeSpriteSheet(w, h, cellSizes[c], 25);
+        ihand->SetImage(pixels, w, h);
+        long long numOpaque = 0;
+        for (long long i = 0; i < numPixels; i++)
+        {
+            if (pixels[i].A >= ihand->transparencyThreshold) numOpaque++;
+        }
+        printf("%dx%d sprite sheet of %dx%d cells, %.1f%% opaque, 256 colour palette\n", w, h, cellSizes[c], cellSizes[c], (100.0 * numOpaque)/numPixels);
+        for (int m = 0; m < 3; m++)
+        {
+            ihand->ditherMethod = methods[m];
+            ihand->sparseDiffusion = false;
+            double fullTime = TimeDitherImage(ihand);
+            memcpy(full, ihand->GetEncodedImage()->data, numPixels * sizeof(ColourRGBA8));
+            ihand->sparseDiffusion = true;
+            double startTime = omp_get_wtime();
+            ihand->DitherImage();
+            double sparseTime = omp_get_wtime() - startTime;
+            const ColourRGBA8* sparse = ihand->GetEncodedImage()->data;
+            long long numDiff = 0;
+            for (long long i = 0; i < numPixels; i++)
+            {
+                if (pixels[i].A >= ihand->transparencyThreshold && memcmp(&full[i], &sparse[i], sizeof(ColourRGBA8))) numDiff++;
+            }
+            //As with the strips, the pattern changes but the local average colour shouldn't, so compare 8x8 blocks with anything opaque in them
+            double sumDist = 0.0;
+            double maxDist = 0.0;
+            int numBlocks = 0;
+            for (int y = 0; y + 8 <= h; y += 8)
+            {
+                for (int x = 0; x + 8 <= w; x += 8)
+                {
+                    bool anyOpaque = false;
+                    for (int j = y; j < y + 8 && !anyOpaque; j++)
+                    {
+                        anyOpaque = FindOpaquePixel(pixels + ((long long)j) * w, x, x + 8, ihand->transparencyThreshold) < x + 8;
+                    }
+                    if (!anyOpaque) continue;
+                    double dist = BlockMeanDistance(full, sparse, w, x, y);
+                    sumDist += dist;
+                    if (dist > maxDist) maxDist = dist;
+                    numBlocks++;
+                }
+            }
+            printf("  %-16s every pixel %9.3f ms, skipping %9.3f ms (x%5.2f)\n", methodNames[m], fullTime * 1e3, sparseTime * 1e3, fullTime/sparseTime);
+            printf("  %-16s %.3f%% of opaque pixels differ, 8x8 block mean OkLab distance %.5f (max %.5f)\n", "", (100.0 * numDiff)/numOpaque, numBlocks ? sumDist/numBlocks : 0.0, maxDist);
+        }
+        delete[] pixels;
+    }
+    ihand->sparseDiffusion = false;
+    delete[] full;
+    delete ihand;
+}
+
+//Plane generation one bit at a time, a full pass over the image for each plane
+static void IndicesToPlanarPerBit(const unsigned char* indices, const unsigned char* opaque, int w, int h, int numPlanes, unsigned char** planes)
+{
+    const int pwidth = (w + 0x7)/0x8;
+    for (int i = 0; i < numPlanes + 1; i++)
+    {
+        memset(planes[i], 0, ((long long)pwidth) * h);
+    }
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            if ((opaque[y * pwidth + (x >> 3)] << (x & 0x7)) & 0x80) planes[0][y * pwidth + (x >> 3)] |= (0x01 << (7 - (x & 0x7)));
+        }
+    }
+    for (int p = 0; p < numPlanes; p++)
+    {
+        for (int y = 0; y < h; y++)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                const bool isOpaque = (opaque[y * pwidth + (x >> 3)] << (x & 0x7)) & 0x80;
+                if (isOpaque && (indices[((long long)y) * w + x] & (0x01 << p))) planes[p + 1][y * pwidth + (x >> 3)] |= (0x01 << (7 - (x & 0x7)));
+            }
+        }
+    }
+}
+
+static void BenchmarkPlanarData()
+{
+    const int w = 1920;
+    const int h = 1080;
+    const int reps = 10;
+    const int pwidth = (w + 0x7)/0x8;
+    const long long numPixels = ((long long)w) * h;
+    const long long planeSize = ((long long)pwidth) * h;
+    unsigned int seed = 26;
+    unsigned char* indices = new unsigned char[numPixels];
+    unsigned char* opaque = new unsigned char[planeSize];
+    for (long long i = 0; i < numPixels; i++)
+    {
+        indices[i] = (unsigned char)(BenchmarkRandom(&seed) >> 24);
+    }
+    for (long long i = 0; i < planeSize; i++)
+    {
+        opaque[i] = (unsigned char)(BenchmarkRandom(&seed) >> 24) | 0x81; //Mostly opaque
+    }
+    unsigned char* refPlanes[9];
+    unsigned char* outPlanes[9];
+    for (int i = 0; i < 9; i++)
+    {
+        refPlanes[i] = new unsigned char[planeSize];
+        outPlanes[i] = new unsigned char[planeSize];
+    }
+    printf("%dx%d random 256 colour indices, 8 planes and a mask\n", w, h);
+    double startTime = omp_get_wtime();
+    for (int r = 0; r < reps; r++)
+    {
+        IndicesToPlanarPerBit(indices, opaque, w, h, 8, refPlanes);
+    }
+    double perBitTime = (omp_get_wtime() - startTime)/reps;
+    printf("  %-10s %9.3f ms %8.2f Mpix/s\n", "per bit", perBitTime * 1e3, (numPixels/perBitTime) * 1e-6);
+    for (int k = CONVERT_SCALAR; k <= CONVERT_AVX512; k++)
+    {
+        if (!IsConvertKernelSupported(k))
+        {
+            printf("  %-10s not supported on this machine\n", GetConvertKernelName(k));
+            continue;
+        }
+        startTime = omp_get_wtime();
+        for (int r = 0; r < reps; r++)
+        {
+            for (int y = 0; y < h; y++)
+            {
+                unsigned char* linePlanes[8];
+                for (int p = 0; p < 8; p++)
+                {
+                    linePlanes[p] = outPlanes[p + 1] + y * pwidth;
+                }
+                CopyBitRow(opaque + y * pwidth, 0, w, outPlanes[0] + y * pwidth);
+                IndicesToPlanarRow(indices + ((long long)y) * w, w, linePlanes, 8, outPlanes[0] + y * pwidth, k);
+            }
+        }
+        double kernelTime = (omp_get_wtime() - startTime)/reps;
+        bool match = true;
+        for (int i = 0; i < 9; i++)
+        {
+            if (memcmp(refPlanes[i], outPlanes[i], planeSize)) match = false;
+        }
+        printf("  %-10s %9.3f ms %8.2f Mpix/s (x%6.2f), %s\n", GetConvertKernelName(k), kernelTime * 1e3, (numPixels/kernelTime) * 1e-6, perBitTime/kernelTime, match ? "same planes" : "DIFFERENT PLANES");
+    }
+    for (int i = 0; i < 9; i++)
+    {
+        delete[] outPlanes[i];
+        delete[] refPlanes[i];
+    }
+    delete[] opaque;
+    delete[] indices;
+
+    //The whole of GeneratePlanarData, with tiles that don't line up with whole bytes as well as ones that do
+    const int tileSizes[][2] = { { 0, 0 }, { 8, 8 }, { 16, 16 }, { 13, 7 } };
+    ImageHandler* ihand = new ImageHandler();
+    ColourRGBA8* pixels = MakeSpriteSheet(w, h, 64, 27);
+    ihand->SetImage(pixels, w, h);
+    delete[] pixels;
+    SetNoisePalette(ihand, 28);
+    ihand->AddPlane(PLANENUM_MASK);
+    ihand->DitherImage(NODITHER, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 0.0, false);
+    //Lines of tiles are shared out between threads, so check they all give the same planes
+    const int maxThreads = omp_get_max_threads();
+    printf("%dx%d sprite sheet, 256 colours and a mask, through GeneratePlanarData\n", w, h);
+    for (int t = 0; t < 4; t++)
+    {
+        ihand->isTiled = tileSizes[t][0] != 0;
+        ihand->tileSizeX = tileSizes[t][0];
+        ihand->tileSizeY = tileSizes[t][1];
+        ihand->tileOrdering = ROWMAJOR;
+        PlanarInfo serial = ihand->GeneratePlanarData();
+        double planarTime1 = 0.0;
+        for (int n = 1; n <= maxThreads; n = (n * 2 > maxThreads && n != maxThreads) ? maxThreads : n * 2)
+        {
+            omp_set_num_threads(n);
+            startTime = omp_get_wtime();
+            for (int r = 0; r < reps; r++)
+            {
+                PlanarInfo pinfo = ihand->GeneratePlanarData();
+                ImageHandler::FreePlanarData(&pinfo);
+            }
+            double planarTime = (omp_get_wtime() - startTime)/reps;
+            if (n == 1) planarTime1 = planarTime;
+            PlanarInfo pinfo = ihand->GeneratePlanarData();
+            bool match = true;
+            for (int i = 0; i < pinfo.numPlanes; i++)
+            {
+                if (memcmp(serial.planeData[i], pinfo.planeData[i], pinfo.planeSize)) match = false;
+            }
+            ImageHandler::FreePlanarData(&pinfo);
+            char tiling[32];
+            if (ihand->isTiled) snprintf(tiling, sizeof(tiling), "%dx%d tiles", tileSizes[t][0], tileSizes[t][1]);
+            else snprintf(tiling, sizeof(tiling), "untiled");
+            printf("  %-12s %2d threads %9.3f ms %8.2f Mpix/s (x%5.2f), %s\n", tiling, n, planarTime * 1e3, (numPixels/planarTime) * 1e-6, planarTime1/planarTime, match ? "same planes" : "DIFFERENT PLANES");
+        }
+        omp_set_num_threads(maxThreads);
+        ImageHandler::FreePlanarData(&serial);
+    }
+    ihand->isTiled = false;
+    delete ihand;
+}
+
+static const Benchmark benchmarks[] =
+{
+    { "convert", "Batched sRGB8 <-> OkLab conversion kernels", BenchmarkColourConvert },
+    { "histogram", "Colour histogram against linear palette scans", BenchmarkColourHistogram },
+    { "kmeans", "Palette k-means over every pixel against weighted unique colours", BenchmarkKMeans },
+    { "kmeans-engines", "Lloyd against Hamerly k-means iterations (after seeding)", BenchmarkKMeansEngines },
+    { "kmeans-threads", "K-means seeding and iteration scaling with the number of threads", BenchmarkKMeansThreads },
+    { "kmeans-minibatch", "Mini-batch k-means against full passes on a large image", BenchmarkKMeansMiniBatch },
+    { "quantizers", "Wu, median cut and octree quantizers against k-means", BenchmarkQuantizers },
+    { "nearest", "Nearest palette colour index against a linear scan", BenchmarkNearestColour },
+    { "inversemap", "Undithered output through the inverse colour map against converting and scanning", BenchmarkInverseColourMap },
+    { "expand", "Filling in transparent pixels for error diffusion on a sprite sheet", BenchmarkExpandedRows },
+    { "diffusion", "Error diffusion kernels over a photo-like image", BenchmarkErrorDiffusion },
+    { "diffusion-sparse", "Skipping transparent pixels far from anything opaque on sprite sheets", BenchmarkSparseDiffusion },
+    { "diffusion-threads", "Wavefront error diffusion scaling with the number of threads", BenchmarkErrorDiffusionThreads },
+    { "diffusion-strips", "Approximate strip-parallel error diffusion against the exact result", BenchmarkErrorDiffusionStrips },
+    { "ordered", "Ordered dithers on a few colour and a photo-like image", BenchmarkOrderedDither },
+    { "planar", "Chunky to planar conversion kernels and GeneratePlanarData", BenchmarkPlanarData }
+};
+
+int RunBenchmarks(int argc, char** argv)
+{
+    const int numBenchmarks = sizeof(benchmarks)/sizeof(Benchmark);
+    if (argc > 0 && !strcmp(argv[0], "list"))
+    {
+        for (int i = 0; i < numBenchmarks; i++)
+        {
+            printf("%-12s %s\n", benchmarks[i].name, benchmarks[i].description);
+        }
+        return 0;
+    }
+    int numRun = 0;
+    for (int i = 0; i < numBenchmarks; i++)
+    {
+        bool selected = (argc == 0);
+        for (int j = 0; j < argc; j++)
+        {
+            if (!strcmp(argv[j], benchmarks[i].name)) selected = true;
+        }
+        if (!selected) continue;
+        printf("== %s: %s ==\n", benchmarks[i].name, benchmarks[i].description);
+        benchmarks[i].func();
+        numRun++;
+    }
+    if (numRun == 0)
+    {
+        puts("No matching benchmarks! Use '--benchmark list' to see them all.");
+        return 1;
+    }
+    return 0;
+}
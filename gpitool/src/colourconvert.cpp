@@ -0,0 +1,491 @@
+/* gpitool - Converts images into .GPI format
+ * Copyright (c) 2024 Maxim Hoxha
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Batched colour space conversion
+ */
+
+#include <string.h>
+#include "colourconvert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONVERT_X86
+#include <immintrin.h>
+#endif
+
+//The 8 bit input only has 256 possible values per channel, so the gamma decode is just a table lookup
+struct LinearLUT
+{
+    float values[256];
+
+    LinearLUT()
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            ColourRGBA8 c = { (unsigned char)i, 0, 0, 0xFF };
+            values[i] = SRGB8ToLinearFloat(c).R;
+        }
+    }
+};
+
+static const float* GetLinearLUT()
+{
+    static const LinearLUT lut;
+    return lut.values;
+}
+
+//Every kernel does the same IEEE operations in the same order, so they all give bit-identical results, and the scalar one finishes off the
+//pixels left over by the vector ones. That needs contraction into FMA to be off (-ffp-contract=off), as the vector ones don't use it.
+//They aren't bit-identical to the per-pixel functions, which use the exact cube root.
+
+//Cube roots are done with a bit hack initial guess followed by two Halley iterations, which is enough for full single precision
+//Inputs are clamped to a tiny positive value first, as the LMS values are never negative and zero would produce denormals
+static inline float CbrtScalar(float x)
+{
+    x = (x > 1e-30f) ? x : 1e-30f;
+    int xi;
+    memcpy(&xi, &x, sizeof(float));
+    const int yi = ((int)(((float)xi) * (1.0f/3.0f))) + 0x2A5137A0;
+    float y;
+    memcpy(&y, &yi, sizeof(float));
+    const float twox = x + x;
+    for (int i = 0; i < 2; i++)
+    {
+        const float y3 = (y * y) * y;
+        y = y * ((y3 + twox) / ((y3 + y3) + x));
+    }
+    return y;
+}
+
+static inline float Mat3RowScalar(const float* mat, float x, float y, float z)
+{
+    return ((mat[0] * x) + (mat[1] * y)) + (mat[2] * z);
+}
+
+static inline void LinearToOkLabScalar(float R, float G, float B, float* L, float* a, float* b)
+{
+    const float l = CbrtScalar(Mat3RowScalar(&SRGBtoLMS[0], R, G, B));
+    const float m = CbrtScalar(Mat3RowScalar(&SRGBtoLMS[3], R, G, B));
+    const float s = CbrtScalar(Mat3RowScalar(&SRGBtoLMS[6], R, G, B));
+    const float oL = Mat3RowScalar(&CRLMStoOKLab[0], l, m, s);
+    //Lightness toe
+    const float t = (OkLabK3 * oL) - OkLabK1;
+    const float disc = (t * t) + ((4.0f * OkLabK2 * OkLabK3) * oL);
+    *L = (t + sqrtf(disc)) * 0.5f;
+    *a = Mat3RowScalar(&CRLMStoOKLab[3], l, m, s);
+    *b = Mat3RowScalar(&CRLMStoOKLab[6], l, m, s);
+}
+
+static void SRGB8ToOkLabScalar(const ColourRGBA8* in, float* L, float* a, float* b, float* A, long long n)
+{
+    const float* lut = GetLinearLUT();
+    for (long long i = 0; i < n; i++)
+    {
+        ColourRGBA8 pixcol = in[i];
+        LinearToOkLabScalar(lut[pixcol.R], lut[pixcol.G], lut[pixcol.B], &L[i], &a[i], &b[i]);
+        A[i] = ((float)pixcol.A)/255.0f;
+    }
+}
+
+static void SRGBToOkLabScalar(const float* R, const float* G, const float* B, float* L, float* a, float* b, long long n)
+{
+    for (long long i = 0; i < n; i++)
+    {
+        LinearToOkLabScalar(R[i], G[i], B[i], &L[i], &a[i], &b[i]);
+    }
+}
+
+static void OkLabToSRGBScalar(const float* L, const float* a, const float* b, float* R, float* G, float* B, long long n)
+{
+    for (long long i = 0; i < n; i++)
+    {
+        const float iL = (L[i] * (L[i] + OkLabK1)) / (OkLabK3 * (L[i] + OkLabK2));
+        float l = Mat3RowScalar(&OKLabtoCRLMS[0], iL, a[i], b[i]);
+        float m = Mat3RowScalar(&OKLabtoCRLMS[3], iL, a[i], b[i]);
+        float s = Mat3RowScalar(&OKLabtoCRLMS[6], iL, a[i], b[i]);
+        l = (l * l) * l;
+        m = (m * m) * m;
+        s = (s * s) * s;
+        R[i] = Mat3RowScalar(&LMStoSRGB[0], l, m, s);
+        G[i] = Mat3RowScalar(&LMStoSRGB[3], l, m, s);
+        B[i] = Mat3RowScalar(&LMStoSRGB[6], l, m, s);
+    }
+}
+
+#ifdef CONVERT_X86
+__attribute__((target("sse2"))) static inline __m128 CbrtSSE2(__m128 x)
+{
+    x = _mm_max_ps(x, _mm_set1_ps(1e-30f));
+    __m128i xi = _mm_castps_si128(x);
+    __m128i yi = _mm_add_epi32(_mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(xi), _mm_set1_ps(1.0f/3.0f))), _mm_set1_epi32(0x2A5137A0));
+    __m128 y = _mm_castsi128_ps(yi);
+    __m128 twox = _mm_add_ps(x, x);
+    for (int i = 0; i < 2; i++)
+    {
+        __m128 y3 = _mm_mul_ps(_mm_mul_ps(y, y), y);
+        y = _mm_mul_ps(y, _mm_div_ps(_mm_add_ps(y3, twox), _mm_add_ps(_mm_add_ps(y3, y3), x)));
+    }
+    return y;
+}
+
+__attribute__((target("sse2"))) static inline __m128 Mat3RowSSE2(const float* mat, __m128 x, __m128 y, __m128 z)
+{
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(mat[0]), x), _mm_mul_ps(_mm_set1_ps(mat[1]), y)), _mm_mul_ps(_mm_set1_ps(mat[2]), z));
+}
+
+__attribute__((target("sse2"))) static inline void LinearToOkLabSSE2(__m128 R, __m128 G, __m128 B, float* L, float* a, float* b)
+{
+    __m128 l = CbrtSSE2(Mat3RowSSE2(&SRGBtoLMS[0], R, G, B));
+    __m128 m = CbrtSSE2(Mat3RowSSE2(&SRGBtoLMS[3], R, G, B));
+    __m128 s = CbrtSSE2(Mat3RowSSE2(&SRGBtoLMS[6], R, G, B));
+    __m128 oL = Mat3RowSSE2(&CRLMStoOKLab[0], l, m, s);
+    //Lightness toe
+    __m128 t = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(OkLabK3), oL), _mm_set1_ps(OkLabK1));
+    __m128 disc = _mm_add_ps(_mm_mul_ps(t, t), _mm_mul_ps(_mm_set1_ps(4.0f * OkLabK2 * OkLabK3), oL));
+    _mm_storeu_ps(L, _mm_mul_ps(_mm_add_ps(t, _mm_sqrt_ps(disc)), _mm_set1_ps(0.5f)));
+    _mm_storeu_ps(a, Mat3RowSSE2(&CRLMStoOKLab[3], l, m, s));
+    _mm_storeu_ps(b, Mat3RowSSE2(&CRLMStoOKLab[6], l, m, s));
+}
+
+__attribute__((target("sse2"))) static void SRGB8ToOkLabSSE2(const ColourRGBA8* in, float* L, float* a, float* b, float* A, long long n)
+{
+    const float* lut = GetLinearLUT();
+    long long i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        float rv[4], gv[4], bv[4];
+        for (int k = 0; k < 4; k++)
+        {
+            rv[k] = lut[in[i + k].R];
+            gv[k] = lut[in[i + k].G];
+            bv[k] = lut[in[i + k].B];
+        }
+        __m128 R = _mm_loadu_ps(rv);
+        __m128 G = _mm_loadu_ps(gv);
+        __m128 B = _mm_loadu_ps(bv);
+        __m128i pix = _mm_loadu_si128((const __m128i*)(in + i));
+        __m128 alpha = _mm_div_ps(_mm_cvtepi32_ps(_mm_srli_epi32(pix, 24)), _mm_set1_ps(255.0f));
+
+        LinearToOkLabSSE2(R, G, B, L + i, a + i, b + i);
+        _mm_storeu_ps(A + i, alpha);
+    }
+    SRGB8ToOkLabScalar(in + i, L + i, a + i, b + i, A + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void SRGBToOkLabSSE2(const float* R, const float* G, const float* B, float* L, float* a, float* b, long long n)
+{
+    long long i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        LinearToOkLabSSE2(_mm_loadu_ps(R + i), _mm_loadu_ps(G + i), _mm_loadu_ps(B + i), L + i, a + i, b + i);
+    }
+    SRGBToOkLabScalar(R + i, G + i, B + i, L + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void OkLabToSRGBSSE2(const float* L, const float* a, const float* b, float* R, float* G, float* B, long long n)
+{
+    long long i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 iL = _mm_loadu_ps(L + i);
+        __m128 ia = _mm_loadu_ps(a + i);
+        __m128 ib = _mm_loadu_ps(b + i);
+        iL = _mm_div_ps(_mm_mul_ps(iL, _mm_add_ps(iL, _mm_set1_ps(OkLabK1))), _mm_mul_ps(_mm_set1_ps(OkLabK3), _mm_add_ps(iL, _mm_set1_ps(OkLabK2))));
+        __m128 l = Mat3RowSSE2(&OKLabtoCRLMS[0], iL, ia, ib);
+        __m128 m = Mat3RowSSE2(&OKLabtoCRLMS[3], iL, ia, ib);
+        __m128 s = Mat3RowSSE2(&OKLabtoCRLMS[6], iL, ia, ib);
+        l = _mm_mul_ps(_mm_mul_ps(l, l), l);
+        m = _mm_mul_ps(_mm_mul_ps(m, m), m);
+        s = _mm_mul_ps(_mm_mul_ps(s, s), s);
+        _mm_storeu_ps(R + i, Mat3RowSSE2(&LMStoSRGB[0], l, m, s));
+        _mm_storeu_ps(G + i, Mat3RowSSE2(&LMStoSRGB[3], l, m, s));
+        _mm_storeu_ps(B + i, Mat3RowSSE2(&LMStoSRGB[6], l, m, s));
+    }
+    OkLabToSRGBScalar(L + i, a + i, b + i, R + i, G + i, B + i, n - i);
+}
+
+__attribute__((target("avx2"))) static inline __m256 CbrtAVX2(__m256 x)
+{
+    x = _mm256_max_ps(x, _mm256_set1_ps(1e-30f));
+    __m256i xi = _mm256_castps_si256(x);
+    __m256i yi = _mm256_add_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(xi), _mm256_set1_ps(1.0f/3.0f))), _mm256_set1_epi32(0x2A5137A0));
+    __m256 y = _mm256_castsi256_ps(yi);
+    __m256 twox = _mm256_add_ps(x, x);
+    for (int i = 0; i < 2; i++)
+    {
+        __m256 y3 = _mm256_mul_ps(_mm256_mul_ps(y, y), y);
+        y = _mm256_mul_ps(y, _mm256_div_ps(_mm256_add_ps(y3, twox), _mm256_add_ps(_mm256_add_ps(y3, y3), x)));
+    }
+    return y;
+}
+
+__attribute__((target("avx2"))) static inline __m256 Mat3RowAVX2(const float* mat, __m256 x, __m256 y, __m256 z)
+{
+    return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(mat[0]), x), _mm256_mul_ps(_mm256_set1_ps(mat[1]), y)), _mm256_mul_ps(_mm256_set1_ps(mat[2]), z));
+}
+
+__attribute__((target("avx2"))) static inline void LinearToOkLabAVX2(__m256 R, __m256 G, __m256 B, float* L, float* a, float* b)
+{
+    __m256 l = CbrtAVX2(Mat3RowAVX2(&SRGBtoLMS[0], R, G, B));
+    __m256 m = CbrtAVX2(Mat3RowAVX2(&SRGBtoLMS[3], R, G, B));
+    __m256 s = CbrtAVX2(Mat3RowAVX2(&SRGBtoLMS[6], R, G, B));
+    __m256 oL = Mat3RowAVX2(&CRLMStoOKLab[0], l, m, s);
+    //Lightness toe
+    __m256 t = _mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(OkLabK3), oL), _mm256_set1_ps(OkLabK1));
+    __m256 disc = _mm256_add_ps(_mm256_mul_ps(t, t), _mm256_mul_ps(_mm256_set1_ps(4.0f * OkLabK2 * OkLabK3), oL));
+    _mm256_storeu_ps(L, _mm256_mul_ps(_mm256_add_ps(t, _mm256_sqrt_ps(disc)), _mm256_set1_ps(0.5f)));
+    _mm256_storeu_ps(a, Mat3RowAVX2(&CRLMStoOKLab[3], l, m, s));
+    _mm256_storeu_ps(b, Mat3RowAVX2(&CRLMStoOKLab[6], l, m, s));
+}
+
+__attribute__((target("avx2"))) static void SRGB8ToOkLabAVX2(const ColourRGBA8* in, float* L, float* a, float* b, float* A, long long n)
+{
+    const float* lut = GetLinearLUT();
+    const __m256i bytemask = _mm256_set1_epi32(0xFF);
+    long long i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i pix = _mm256_loadu_si256((const __m256i*)(in + i));
+        __m256 R = _mm256_i32gather_ps(lut, _mm256_and_si256(pix, bytemask), 4);
+        __m256 G = _mm256_i32gather_ps(lut, _mm256_and_si256(_mm256_srli_epi32(pix, 8), bytemask), 4);
+        __m256 B = _mm256_i32gather_ps(lut, _mm256_and_si256(_mm256_srli_epi32(pix, 16), bytemask), 4);
+        __m256 alpha = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(pix, 24)), _mm256_set1_ps(255.0f));
+
+        LinearToOkLabAVX2(R, G, B, L + i, a + i, b + i);
+        _mm256_storeu_ps(A + i, alpha);
+    }
+    SRGB8ToOkLabScalar(in + i, L + i, a + i, b + i, A + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void SRGBToOkLabAVX2(const float* R, const float* G, const float* B, float* L, float* a, float* b, long long n)
+{
+    long long i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        LinearToOkLabAVX2(_mm256_loadu_ps(R + i), _mm256_loadu_ps(G + i), _mm256_loadu_ps(B + i), L + i, a + i, b + i);
+    }
+    SRGBToOkLabScalar(R + i, G + i, B + i, L + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void OkLabToSRGBAVX2(const float* L, const float* a, const float* b, float* R, float* G, float* B, long long n)
+{
+    long long i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 iL = _mm256_loadu_ps(L + i);
+        __m256 ia = _mm256_loadu_ps(a + i);
+        __m256 ib = _mm256_loadu_ps(b + i);
+        iL = _mm256_div_ps(_mm256_mul_ps(iL, _mm256_add_ps(iL, _mm256_set1_ps(OkLabK1))), _mm256_mul_ps(_mm256_set1_ps(OkLabK3), _mm256_add_ps(iL, _mm256_set1_ps(OkLabK2))));
+        __m256 l = Mat3RowAVX2(&OKLabtoCRLMS[0], iL, ia, ib);
+        __m256 m = Mat3RowAVX2(&OKLabtoCRLMS[3], iL, ia, ib);
+        __m256 s = Mat3RowAVX2(&OKLabtoCRLMS[6], iL, ia, ib);
+        l = _mm256_mul_ps(_mm256_mul_ps(l, l), l);
+        m = _mm256_mul_ps(_mm256_mul_ps(m, m), m);
+        s = _mm256_mul_ps(_mm256_mul_ps(s, s), s);
+        _mm256_storeu_ps(R + i, Mat3RowAVX2(&LMStoSRGB[0], l, m, s));
+        _mm256_storeu_ps(G + i, Mat3RowAVX2(&LMStoSRGB[3], l, m, s));
+        _mm256_storeu_ps(B + i, Mat3RowAVX2(&LMStoSRGB[6], l, m, s));
+    }
+    OkLabToSRGBScalar(L + i, a + i, b + i, R + i, G + i, B + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static inline __m512 CbrtAVX512(__m512 x)
+{
+    x = _mm512_max_ps(x, _mm512_set1_ps(1e-30f));
+    __m512i xi = _mm512_castps_si512(x);
+    __m512i yi = _mm512_add_epi32(_mm512_cvttps_epi32(_mm512_mul_ps(_mm512_cvtepi32_ps(xi), _mm512_set1_ps(1.0f/3.0f))), _mm512_set1_epi32(0x2A5137A0));
+    __m512 y = _mm512_castsi512_ps(yi);
+    __m512 twox = _mm512_add_ps(x, x);
+    for (int i = 0; i < 2; i++)
+    {
+        __m512 y3 = _mm512_mul_ps(_mm512_mul_ps(y, y), y);
+        y = _mm512_mul_ps(y, _mm512_div_ps(_mm512_add_ps(y3, twox), _mm512_add_ps(_mm512_add_ps(y3, y3), x)));
+    }
+    return y;
+}
+
+__attribute__((target("avx512f"))) static inline __m512 Mat3RowAVX512(const float* mat, __m512 x, __m512 y, __m512 z)
+{
+    return _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(mat[0]), x), _mm512_mul_ps(_mm512_set1_ps(mat[1]), y)), _mm512_mul_ps(_mm512_set1_ps(mat[2]), z));
+}
+
+__attribute__((target("avx512f"))) static inline void LinearToOkLabAVX512(__m512 R, __m512 G, __m512 B, float* L, float* a, float* b)
+{
+    __m512 l = CbrtAVX512(Mat3RowAVX512(&SRGBtoLMS[0], R, G, B));
+    __m512 m = CbrtAVX512(Mat3RowAVX512(&SRGBtoLMS[3], R, G, B));
+    __m512 s = CbrtAVX512(Mat3RowAVX512(&SRGBtoLMS[6], R, G, B));
+    __m512 oL = Mat3RowAVX512(&CRLMStoOKLab[0], l, m, s);
+    //Lightness toe
+    __m512 t = _mm512_sub_ps(_mm512_mul_ps(_mm512_set1_ps(OkLabK3), oL), _mm512_set1_ps(OkLabK1));
+    __m512 disc = _mm512_add_ps(_mm512_mul_ps(t, t), _mm512_mul_ps(_mm512_set1_ps(4.0f * OkLabK2 * OkLabK3), oL));
+    _mm512_storeu_ps(L, _mm512_mul_ps(_mm512_add_ps(t, _mm512_sqrt_ps(disc)), _mm512_set1_ps(0.5f)));
+    _mm512_storeu_ps(a, Mat3RowAVX512(&CRLMStoOKLab[3], l, m, s));
+    _mm512_storeu_ps(b, Mat3RowAVX512(&CRLMStoOKLab[6], l, m, s));
+}
+
+__attribute__((target("avx512f"))) static void SRGB8ToOkLabAVX512(const ColourRGBA8* in, float* L, float* a, float* b, float* A, long long n)
+{
+    const float* lut = GetLinearLUT();
+    const __m512i bytemask = _mm512_set1_epi32(0xFF);
+    long long i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m512i pix = _mm512_loadu_si512((const void*)(in + i));
+        __m512 R = _mm512_i32gather_ps(_mm512_and_si512(pix, bytemask), lut, 4);
+        __m512 G = _mm512_i32gather_ps(_mm512_and_si512(_mm512_srli_epi32(pix, 8), bytemask), lut, 4);
+        __m512 B = _mm512_i32gather_ps(_mm512_and_si512(_mm512_srli_epi32(pix, 16), bytemask), lut, 4);
+        __m512 alpha = _mm512_div_ps(_mm512_cvtepi32_ps(_mm512_srli_epi32(pix, 24)), _mm512_set1_ps(255.0f));
+
+        LinearToOkLabAVX512(R, G, B, L + i, a + i, b + i);
+        _mm512_storeu_ps(A + i, alpha);
+    }
+    SRGB8ToOkLabScalar(in + i, L + i, a + i, b + i, A + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void SRGBToOkLabAVX512(const float* R, const float* G, const float* B, float* L, float* a, float* b, long long n)
+{
+    long long i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        LinearToOkLabAVX512(_mm512_loadu_ps(R + i), _mm512_loadu_ps(G + i), _mm512_loadu_ps(B + i), L + i, a + i, b + i);
+    }
+    SRGBToOkLabScalar(R + i, G + i, B + i, L + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void OkLabToSRGBAVX512(const float* L, const float* a, const float* b, float* R, float* G, float* B, long long n)
+{
+    long long i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m512 iL = _mm512_loadu_ps(L + i);
+        __m512 ia = _mm512_loadu_ps(a + i);
+        __m512 ib = _mm512_loadu_ps(b + i);
+        iL = _mm512_div_ps(_mm512_mul_ps(iL, _mm512_add_ps(iL, _mm512_set1_ps(OkLabK1))), _mm512_mul_ps(_mm512_set1_ps(OkLabK3), _mm512_add_ps(iL, _mm512_set1_ps(OkLabK2))));
+        __m512 l = Mat3RowAVX512(&OKLabtoCRLMS[0], iL, ia, ib);
+        __m512 m = Mat3RowAVX512(&OKLabtoCRLMS[3], iL, ia, ib);
+        __m512 s = Mat3RowAVX512(&OKLabtoCRLMS[6], iL, ia, ib);
+        l = _mm512_mul_ps(_mm512_mul_ps(l, l), l);
+        m = _mm512_mul_ps(_mm512_mul_ps(m, m), m);
+        s = _mm512_mul_ps(_mm512_mul_ps(s, s), s);
+        _mm512_storeu_ps(R + i, Mat3RowAVX512(&LMStoSRGB[0], l, m, s));
+        _mm512_storeu_ps(G + i, Mat3RowAVX512(&LMStoSRGB[3], l, m, s));
+        _mm512_storeu_ps(B + i, Mat3RowAVX512(&LMStoSRGB[6], l, m, s));
+    }
+    OkLabToSRGBScalar(L + i, a + i, b + i, R + i, G + i, B + i, n - i);
+}
+#endif
+
+bool IsConvertKernelSupported(int kernel)
+{
+    switch (kernel)
+    {
+        case CONVERT_AUTO:
+        case CONVERT_SCALAR:
+            return true;
+#ifdef CONVERT_X86
+        case CONVERT_SSE2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse2");
+        case CONVERT_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+        case CONVERT_AVX512:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx512f");
+#endif
+        default:
+            return false;
+    }
+}
+
+int GetBestConvertKernel()
+{
+    static const int bestKernel = IsConvertKernelSupported(CONVERT_AVX512) ? CONVERT_AVX512 :
+                                  IsConvertKernelSupported(CONVERT_AVX2) ? CONVERT_AVX2 :
+                                  IsConvertKernelSupported(CONVERT_SSE2) ? CONVERT_SSE2 : CONVERT_SCALAR;
+    return bestKernel;
+}
+
+const char* GetConvertKernelName(int kernel)
+{
+    switch (kernel)
+    {
+        case CONVERT_AUTO: return "auto";
+        case CONVERT_SCALAR: return "scalar";
+        case CONVERT_SSE2: return "SSE2";
+        case CONVERT_AVX2: return "AVX2";
+        case CONVERT_AVX512: return "AVX-512";
+        default: return "unknown";
+    }
+}
+
+void SRGB8ToOkLabBatch(const ColourRGBA8* in, float* L, float* a, float* b, float* A, long long n, int kernel)
+{
+    if (kernel == CONVERT_AUTO) kernel = GetBestConvertKernel();
+    switch (kernel)
+    {
+#ifdef CONVERT_X86
+        case CONVERT_SSE2:
+            SRGB8ToOkLabSSE2(in, L, a, b, A, n); break;
+        case CONVERT_AVX2:
+            SRGB8ToOkLabAVX2(in, L, a, b, A, n); break;
+        case CONVERT_AVX512:
+            SRGB8ToOkLabAVX512(in, L, a, b, A, n); break;
+#endif
+        default:
+            SRGB8ToOkLabScalar(in, L, a, b, A, n); break;
+    }
+}
+
+void SRGBToOkLabBatch(const float* R, const float* G, const float* B, float* L, float* a, float* b, long long n, int kernel)
+{
+    if (kernel == CONVERT_AUTO) kernel = GetBestConvertKernel();
+    switch (kernel)
+    {
+#ifdef CONVERT_X86
+        case CONVERT_SSE2:
+            SRGBToOkLabSSE2(R, G, B, L, a, b, n); break;
+        case CONVERT_AVX2:
+            SRGBToOkLabAVX2(R, G, B, L, a, b, n); break;
+        case CONVERT_AVX512:
+            SRGBToOkLabAVX512(R, G, B, L, a, b, n); break;
+#endif
+        default:
+            SRGBToOkLabScalar(R, G, B, L, a, b, n); break;
+    }
+}
+
+void OkLabToSRGBBatch(const float* L, const float* a, const float* b, float* R, float* G, float* B, long long n, int kernel)
+{
+    if (kernel == CONVERT_AUTO) kernel = GetBestConvertKernel();
+    switch (kernel)
+    {
+#ifdef CONVERT_X86
+        case CONVERT_SSE2:
+            OkLabToSRGBSSE2(L, a, b, R, G, B, n); break;
+        case CONVERT_AVX2:
+            OkLabToSRGBAVX2(L, a, b, R, G, B, n); break;
+        case CONVERT_AVX512:
+            OkLabToSRGBAVX512(L, a, b, R, G, B, n); break;
+#endif
+        default:
+            OkLabToSRGBScalar(L, a, b, R, G, B, n); break;
+    }
+}
@@ -0,0 +1,47 @@
+/* gpitool - Converts images into .GPI format
+ * Copyright (c) 2024 Maxim Hoxha
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Batched colour space conversion
+ */
+
+#pragma once
+
+#include "imagehandler.h"
+
+enum convertKernels
+{
+    CONVERT_AUTO,
+    CONVERT_SCALAR,
+    CONVERT_SSE2,
+    CONVERT_AVX2,
+    CONVERT_AVX512
+};
+
+//Converts n sRGB8 pixels into separate L, a, b and alpha arrays (alpha is linear, 0 to 1)
+void SRGB8ToOkLabBatch(const ColourRGBA8* in, float* L, float* a, float* b, float* A, long long n, int kernel = CONVERT_AUTO);
+//Converts n linear sRGB colours into separate L, a and b arrays
+void SRGBToOkLabBatch(const float* R, const float* G, const float* B, float* L, float* a, float* b, long long n, int kernel = CONVERT_AUTO);
+//Converts n OkLab colours into separate linear sRGB arrays (not clamped)
+void OkLabToSRGBBatch(const float* L, const float* a, const float* b, float* R, float* G, float* B, long long n, int kernel = CONVERT_AUTO);
+
+bool IsConvertKernelSupported(int kernel);
+int GetBestConvertKernel();
+const char* GetConvertKernelName(int kernel);
@@ -0,0 +1,252 @@
+/* gpitool - Converts images into .GPI format
+ * Copyright (c) 2024 Maxim Hoxha
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Colour histogram of packed RGBA8 pixels
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <omp.h>
+#include <algorithm>
+#include "colourhistogram.h"
+
+#define HISTOGRAM_MIN_SHIFT 10
+//Images smaller than this aren't worth the per-thread tables
+#define HISTOGRAM_PARALLEL_THRESHOLD 65536
+
+static inline uint32_t PackColour(ColourRGBA8 col)
+{
+    return *((uint32_t*)(&col));
+}
+
+static inline ColourRGBA8 UnpackColour(uint32_t key)
+{
+    return *((ColourRGBA8*)(&key));
+}
+
+static inline long long HashSlot(uint32_t key, int shift)
+{
+    return (long long)((((uint64_t)key) * 0x9E3779B97F4A7C15ULL) >> (64 - shift));
+}
+
+static void InitTable(HistogramTable* t, int shift)
+{
+    t->shift = shift;
+    t->capacity = 1LL << shift;
+    t->numEntries = 0;
+    t->entries = (HistogramEntry*)calloc(t->capacity, sizeof(HistogramEntry));
+}
+
+static void FreeTable(HistogramTable* t)
+{
+    free(t->entries);
+    t->entries = nullptr;
+    t->capacity = 0;
+    t->numEntries = 0;
+}
+
+static void InsertTable(HistogramTable* t, uint32_t key, uint32_t count, long long firstIndex);
+
+static void GrowTable(HistogramTable* t)
+{
+    HistogramTable old = *t;
+    InitTable(t, old.shift + 1);
+    for (long long i = 0; i < old.capacity; i++)
+    {
+        HistogramEntry* e = &old.entries[i];
+        if (e->count != 0) InsertTable(t, e->key, e->count, e->firstIndex);
+    }
+    FreeTable(&old);
+}
+
+static void InsertTable(HistogramTable* t, uint32_t key, uint32_t count, long long firstIndex)
+{
+    long long mask = t->capacity - 1;
+    long long slot = HashSlot(key, t->shift);
+    while (true)
+    {
+        HistogramEntry* e = &t->entries[slot];
+        if (e->count == 0)
+        {
+            e->key = key;
+            e->count = count;
+            e->firstIndex = firstIndex;
+            t->numEntries++;
+            if (2 * t->numEntries > t->capacity) GrowTable(t); //Keep the load factor at or below 0.5
+            return;
+        }
+        else if (e->key == key)
+        {
+            e->count += count;
+            if (firstIndex < e->firstIndex) e->firstIndex = firstIndex;
+            return;
+        }
+        slot = (slot + 1) & mask;
+    }
+}
+
+//Counts runs of identical pixels in one go, flat areas are very common in the kind of art this tool is meant for
+static void CountPixels(HistogramTable* t, const ColourRGBA8* pixels, long long start, long long end, unsigned int transT, uint32_t orMask)
+{
+    const uint32_t* pixui = (const uint32_t*)pixels;
+    uint32_t runKey = 0;
+    uint32_t runCount = 0;
+    long long runFirst = 0;
+    for (long long i = start; i < end; i++)
+    {
+        uint32_t inCol = pixui[i];
+        if (inCol < transT) continue; //Ignore 'transparent' colours
+        inCol |= orMask;
+        if (runCount > 0 && inCol == runKey)
+        {
+            runCount++;
+            continue;
+        }
+        if (runCount > 0) InsertTable(t, runKey, runCount, runFirst);
+        runKey = inCol;
+        runCount = 1;
+        runFirst = i;
+    }
+    if (runCount > 0) InsertTable(t, runKey, runCount, runFirst);
+}
+
+ColourHistogram::ColourHistogram()
+{
+    memset(&table, 0, sizeof(HistogramTable));
+    threshold = 0;
+    forcedOpaque = false;
+    isBuilt = false;
+}
+
+ColourHistogram::~ColourHistogram()
+{
+    Clear();
+}
+
+void ColourHistogram::Build(const ColourRGBA8* pixels, long long numPixels, int alphaThreshold, bool forceOpaque)
+{
+    Clear();
+    threshold = alphaThreshold;
+    forcedOpaque = forceOpaque;
+    if (alphaThreshold < 0) alphaThreshold = 0;
+    else if (alphaThreshold > 0xFF) alphaThreshold = 0xFF;
+    unsigned int transT = ((unsigned int)alphaThreshold) << 24;
+    uint32_t orMask = forceOpaque ? 0xFF000000 : 0x00000000;
+
+    InitTable(&table, HISTOGRAM_MIN_SHIFT);
+    int numThreads = omp_get_max_threads();
+    if (numThreads <= 1 || numPixels < HISTOGRAM_PARALLEL_THRESHOLD)
+    {
+        CountPixels(&table, pixels, 0, numPixels, transT, orMask);
+    }
+    else
+    {
+        //Each thread counts its own contiguous block, then the tables are merged in thread order
+        HistogramTable* local = new HistogramTable[numThreads];
+        #pragma omp parallel num_threads(numThreads)
+        {
+            int t = omp_get_thread_num();
+            int nt = omp_get_num_threads();
+            long long start = (numPixels * t)/nt;
+            long long end = (numPixels * (t + 1))/nt;
+            InitTable(&local[t], HISTOGRAM_MIN_SHIFT);
+            CountPixels(&local[t], pixels, start, end, transT, orMask);
+        }
+        for (int t = 0; t < numThreads; t++)
+        {
+            HistogramTable* lt = &local[t];
+            if (lt->entries == nullptr) continue; //Fewer threads than asked for
+            while (2 * (table.numEntries + lt->numEntries) > table.capacity) GrowTable(&table);
+            for (long long i = 0; i < lt->capacity; i++)
+            {
+                HistogramEntry* e = &lt->entries[i];
+                if (e->count != 0) InsertTable(&table, e->key, e->count, e->firstIndex);
+            }
+            FreeTable(lt);
+        }
+        delete[] local;
+    }
+    isBuilt = true;
+}
+
+void ColourHistogram::Clear()
+{
+    if (table.entries != nullptr) FreeTable(&table);
+    isBuilt = false;
+}
+
+long long ColourHistogram::FindSlot(uint32_t key)
+{
+    if (table.entries == nullptr) return -1;
+    long long mask = table.capacity - 1;
+    long long slot = HashSlot(key, table.shift);
+    while (true)
+    {
+        const HistogramEntry* e = &table.entries[slot];
+        if (e->count == 0) return -1;
+        else if (e->key == key) return slot;
+        slot = (slot + 1) & mask;
+    }
+}
+
+long long ColourHistogram::GetCount(ColourRGBA8 col)
+{
+    long long slot = FindSlot(PackColour(col));
+    if (slot < 0) return 0;
+    return table.entries[slot].count;
+}
+
+long long ColourHistogram::GetFirstIndex(ColourRGBA8 col)
+{
+    long long slot = FindSlot(PackColour(col));
+    if (slot < 0) return -1;
+    return table.entries[slot].firstIndex;
+}
+
+void ColourHistogram::GetColours(ColourRGBA8* outCols, long long* outCounts)
+{
+    long long* order = new long long[table.numEntries];
+    long long n = 0;
+    for (long long i = 0; i < table.capacity; i++)
+    {
+        if (table.entries[i].count != 0) order[n++] = i;
+    }
+    const HistogramEntry* entries = table.entries;
+    std::sort(order, order + n, [entries](long long l, long long r) { return entries[l].firstIndex < entries[r].firstIndex; });
+    for (long long i = 0; i < n; i++)
+    {
+        if (outCols != nullptr) outCols[i] = UnpackColour(entries[order[i]].key);
+        if (outCounts != nullptr) outCounts[i] = entries[order[i]].count;
+    }
+    delete[] order;
+}
+
+bool ColourHistogram::IsSubsetOf(const ColourRGBA8* pal, int numColours)
+{
+    ColourHistogram palHist;
+    palHist.Build(pal, numColours);
+    for (long long i = 0; i < table.capacity; i++)
+    {
+        if (table.entries[i].count == 0) continue;
+        if (palHist.FindSlot(table.entries[i].key) < 0) return false;
+    }
+    return true;
+}
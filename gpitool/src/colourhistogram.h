@@ -0,0 +1,76 @@
+/* gpitool - Converts images into .GPI format
+ * Copyright (c) 2024 Maxim Hoxha
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Colour histogram of packed RGBA8 pixels
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "imagehandler.h"
+
+//Open addressing hash table of packed RGBA8 colours -> count and first occurrence
+//A slot is empty when its count is zero, so every 32 bit colour can be stored
+typedef struct
+{
+    uint32_t key;
+    uint32_t count;
+    long long firstIndex;
+} HistogramEntry;
+
+typedef struct
+{
+    HistogramEntry* entries;
+    long long capacity;
+    long long numEntries;
+    int shift;
+} HistogramTable;
+
+class ColourHistogram
+{
+public:
+    ColourHistogram();
+    ~ColourHistogram();
+
+    //Pixels with alpha below alphaThreshold are skipped, forceOpaque sets the alpha of everything else to 0xFF before counting
+    void Build(const ColourRGBA8* pixels, long long numPixels, int alphaThreshold = 0, bool forceOpaque = false);
+    void Clear();
+
+    inline bool IsBuilt() { return isBuilt; }
+    inline long long GetNumColours() { return table.numEntries; }
+    inline int GetAlphaThreshold() { return threshold; }
+    inline bool IsForcedOpaque() { return forcedOpaque; }
+
+    long long GetCount(ColourRGBA8 col);
+    //Index of the first pixel with this colour, or -1 if it isn't in the histogram
+    long long GetFirstIndex(ColourRGBA8 col);
+    //Fills the arrays (which need GetNumColours() entries) in order of first occurrence
+    void GetColours(ColourRGBA8* outCols, long long* outCounts);
+    bool IsSubsetOf(const ColourRGBA8* pal, int numColours);
+
+private:
+    long long FindSlot(uint32_t key);
+
+    HistogramTable table;
+    int threshold;
+    bool forcedOpaque;
+    bool isBuilt;
+};
@@ -70,6 +70,15 @@ ColourPickerWindow::ColourPickerWindow(ImageHandler* handler, GPITool* parent) :
     adaptivePreContrastControl = new SliderAndDoubleSpinBox();
     QLabel* adaptiveChromaBiasLabel = new QLabel("Adapative Chroma Bias:");
     adaptiveChromaBiasControl = new SliderAndDoubleSpinBox();
+    QLabel* quantizerLabel = new QLabel("Palette search method:");
+    quantizerBox = new QComboBox();
+    quantizerSeedsKMeansCheck = new QCheckBox("Refine with k-means");
+    QLabel* kMeansInputLabel = new QLabel("Palette search input:");
+    kMeansInputBox = new QComboBox();
+    kMeansMiniBatchCheck = new QCheckBox("Mini-batch palette search (for very large images)");
+    QLabel* kMeansBatchSizeLabel = new QLabel("Mini-batch size:");
+    kMeansBatchSizeControl = new SliderAndSpinBox();
+    kMeansRefineCheck = new QCheckBox("Refine mini-batch palette with full passes");
     findBestPaletteButton = new QPushButton("&Find best palette...");
     loadPaletteButton = new QPushButton("&Load palette from file...");
     savePaletteButton = new QPushButton("&Save palette to file...");
@@ -99,6 +108,15 @@ ColourPickerWindow::ColourPickerWindow(ImageHandler* handler, GPITool* parent) :
     mainLayout->addWidget(adaptivePreContrastControl);
     mainLayout->addWidget(adaptiveChromaBiasLabel);
     mainLayout->addWidget(adaptiveChromaBiasControl);
+    mainLayout->addWidget(quantizerLabel);
+    mainLayout->addWidget(quantizerBox);
+    mainLayout->addWidget(quantizerSeedsKMeansCheck);
+    mainLayout->addWidget(kMeansInputLabel);
+    mainLayout->addWidget(kMeansInputBox);
+    mainLayout->addWidget(kMeansMiniBatchCheck);
+    mainLayout->addWidget(kMeansBatchSizeLabel);
+    mainLayout->addWidget(kMeansBatchSizeControl);
+    mainLayout->addWidget(kMeansRefineCheck);
     mainLayout->addWidget(findBestPaletteButton);
     mainLayout->addWidget(loadPaletteButton);
     mainLayout->addWidget(savePaletteButton);
@@ -133,6 +151,15 @@ ColourPickerWindow::ColourPickerWindow(ImageHandler* handler, GPITool* parent) :
     adaptiveChromaBiasControl->SetSingleStep(0.001);
     adaptiveChromaBiasControl->SetDecimals(3);
     adaptiveChromaBiasControl->SetValue(ihand->adaptiveChromaBias);
+    quantizerBox->addItems({ "K-means", "Wu", "Median cut", "Octree" });
+    quantizerBox->setCurrentIndex(ihand->paletteQuantizer);
+    quantizerSeedsKMeansCheck->setChecked(ihand->quantizerSeedsKMeans);
+    kMeansInputBox->addItems({ "Automatic", "Every pixel", "Unique colours", "Colour buckets" });
+    kMeansInputBox->setCurrentIndex(ihand->kMeansInput);
+    kMeansMiniBatchCheck->setChecked(ihand->kMeansMiniBatch);
+    kMeansBatchSizeControl->SetRange(256, 65536);
+    kMeansBatchSizeControl->SetValue(ihand->kMeansBatchSize);
+    kMeansRefineCheck->setChecked(ihand->kMeansRefine);
 
     for (int i = 0; i < 9; i++)
     {
@@ -144,6 +171,12 @@ ColourPickerWindow::ColourPickerWindow(ImageHandler* handler, GPITool* parent) :
     connect(adaptivePreBrightControl, &SliderAndDoubleSpinBox::ValueChanged, this, &ColourPickerWindow::OnSetAdaptivePreBrightness);
     connect(adaptivePreContrastControl, &SliderAndDoubleSpinBox::ValueChanged, this, &ColourPickerWindow::OnSetAdaptivePreContrast);
     connect(adaptiveChromaBiasControl, &SliderAndDoubleSpinBox::ValueChanged, this, &ColourPickerWindow::OnSetAdaptiveChromaBias);
+    connect(quantizerBox, QOverload<int>::of(&QComboBox::currentIndexChanged), this, &ColourPickerWindow::OnSetQuantizer);
+    connect(quantizerSeedsKMeansCheck, &QCheckBox::stateChanged, this, &ColourPickerWindow::OnToggleQuantizerSeedsKMeans);
+    connect(kMeansInputBox, QOverload<int>::of(&QComboBox::currentIndexChanged), this, &ColourPickerWindow::OnSetKMeansInput);
+    connect(kMeansMiniBatchCheck, &QCheckBox::stateChanged, this, &ColourPickerWindow::OnToggleKMeansMiniBatch);
+    connect(kMeansBatchSizeControl, &SliderAndSpinBox::ValueChanged, this, &ColourPickerWindow::OnSetKMeansBatchSize);
+    connect(kMeansRefineCheck, &QCheckBox::stateChanged, this, &ColourPickerWindow::OnToggleKMeansRefine);
     connect(findBestPaletteButton, &QPushButton::clicked, this, &ColourPickerWindow::OnRequestBestPalette);
     connect(loadPaletteButton, &QPushButton::clicked, this, &ColourPickerWindow::OnLoadPaletteFromFile);
     connect(savePaletteButton, &QPushButton::clicked, this, &ColourPickerWindow::OnSavePaletteToFile);
@@ -362,6 +395,36 @@ void ColourPickerWindow::OnSetAdaptiveChromaBias(double val)
     ihand->adaptiveChromaBias = val;
 }
 
+void ColourPickerWindow::OnSetQuantizer(int index)
+{
+    if (index >= 0) ihand->paletteQuantizer = index;
+}
+
+void ColourPickerWindow::OnToggleQuantizerSeedsKMeans(int state)
+{
+    ihand->quantizerSeedsKMeans = (state == Qt::Checked);
+}
+
+void ColourPickerWindow::OnSetKMeansInput(int index)
+{
+    if (index >= 0) ihand->kMeansInput = index;
+}
+
+void ColourPickerWindow::OnToggleKMeansMiniBatch(int state)
+{
+    ihand->kMeansMiniBatch = (state == Qt::Checked);
+}
+
+void ColourPickerWindow::OnSetKMeansBatchSize(int val)
+{
+    ihand->kMeansBatchSize = val;
+}
+
+void ColourPickerWindow::OnToggleKMeansRefine(int state)
+{
+    ihand->kMeansRefine = (state == Qt::Checked);
+}
+
 void ColourPickerWindow::OnRequestBestPalette()
 {
     mwin->UpdateImageThumbnailAfterFindColours();
@@ -29,6 +29,7 @@
 #include <QRadioButton>
 #include <QGridLayout>
 #include <QPushButton>
+#include <QComboBox>
 #include "sliderandspinbox.h"
 #include "imagehandler.h"
 #include "gpitool.h"
@@ -54,6 +55,12 @@ protected:
     SliderAndDoubleSpinBox* adaptivePreBrightControl;
     SliderAndDoubleSpinBox* adaptivePreContrastControl;
     SliderAndDoubleSpinBox* adaptiveChromaBiasControl;
+    QComboBox* quantizerBox;
+    QCheckBox* quantizerSeedsKMeansCheck;
+    QComboBox* kMeansInputBox;
+    QCheckBox* kMeansMiniBatchCheck;
+    SliderAndSpinBox* kMeansBatchSizeControl;
+    QCheckBox* kMeansRefineCheck;
     QPushButton* findBestPaletteButton;
     QPushButton* loadPaletteButton;
     QPushButton* savePaletteButton;
@@ -68,6 +75,12 @@ protected slots:
     void OnSetAdaptivePreBrightness(double val);
     void OnSetAdaptivePreContrast(double val);
     void OnSetAdaptiveChromaBias(double val);
+    void OnSetQuantizer(int index);
+    void OnToggleQuantizerSeedsKMeans(int state);
+    void OnSetKMeansInput(int index);
+    void OnToggleKMeansMiniBatch(int state);
+    void OnSetKMeansBatchSize(int val);
+    void OnToggleKMeansRefine(int state);
     void OnRequestBestPalette();
     void OnLoadPaletteFromFile();
     void OnSavePaletteToFile();
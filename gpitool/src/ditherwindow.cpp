@@ -23,6 +23,7 @@
  */
 
 #include <QFormLayout>
+#include <QFileDialog>
 #include "ditherwindow.h"
 
 DitherWindow::DitherWindow(ImageHandler* handler, GPITool* parent) : QDockWidget((QWidget*)parent, Qt::Window)
@@ -34,6 +35,7 @@ DitherWindow::DitherWindow(ImageHandler* handler, GPITool* parent) : QDockWidget
 
     QFormLayout* mainLayout = new QFormLayout();
     ditherMethodBox = new QComboBox();
+    loadMatrixButton = new QPushButton("Load threshold matrix...");
     lumDitherControl = new SliderAndDoubleSpinBox();
     satDitherControl = new SliderAndDoubleSpinBox();
     hueDitherControl = new SliderAndDoubleSpinBox();
@@ -47,8 +49,11 @@ DitherWindow::DitherWindow(ImageHandler* handler, GPITool* parent) : QDockWidget
     postBrightControl = new SliderAndDoubleSpinBox();
     postContrastControl = new SliderAndDoubleSpinBox();
     boustroCheck = new QCheckBox();
+    stripCheck = new QCheckBox();
+    sparseCheck = new QCheckBox();
 
     mainLayout->addRow("Dither Method", ditherMethodBox);
+    mainLayout->addRow("Custom Threshold Matrix", loadMatrixButton);
     mainLayout->addRow("Luminosity Dither", lumDitherControl);
     mainLayout->addRow("Saturation Dither", satDitherControl);
     mainLayout->addRow("Hue Dither", hueDitherControl);
@@ -62,13 +67,15 @@ DitherWindow::DitherWindow(ImageHandler* handler, GPITool* parent) : QDockWidget
     mainLayout->addRow("Post-brightness", postBrightControl);
     mainLayout->addRow("Post-contrast", postContrastControl);
     mainLayout->addRow("Boustrophedon Scanning", boustroCheck);
+    mainLayout->addRow("Fast Approximate Diffusion", stripCheck);
+    mainLayout->addRow("Skip Distant Transparent Pixels", sparseCheck);
     mainLayout->setAlignment(Qt::AlignTop);
 
     QWidget* mainWidget = new QWidget();
     mainWidget->setLayout(mainLayout);
     setWidget(mainWidget);
 
-    ditherMethodBox->addItems({ "None", "Bayer 2x2", "Bayer 4x4", "Bayer 8x8", "Bayer 16x16", "Void and cluster 16x16", "Floyd-Steinberg", "False Floyd-Steinberg", "Jarvis-Judice-Ninke", "Stucki", "Burkes", "Sierra", "Sierra 2-Row", "Filter Lite", "Atkinson" });
+    ditherMethodBox->addItems({ "None", "Bayer 2x2", "Bayer 4x4", "Bayer 8x8", "Bayer 16x16", "Void and cluster 16x16", "Custom threshold matrix", "Floyd-Steinberg", "False Floyd-Steinberg", "Jarvis-Judice-Ninke", "Stucki", "Burkes", "Sierra", "Sierra 2-Row", "Filter Lite", "Atkinson" });
     ditherMethodBox->setCurrentIndex(ihand->ditherMethod);
     lumDitherControl->SetRange(0.0, 1.0);
     lumDitherControl->SetSingleStep(0.001);
@@ -119,8 +126,11 @@ DitherWindow::DitherWindow(ImageHandler* handler, GPITool* parent) : QDockWidget
     postContrastControl->SetDecimals(3);
     postContrastControl->SetValue(ihand->postContrast);
     boustroCheck->setChecked(ihand->boustrophedon);
+    stripCheck->setChecked(ihand->stripDiffusion);
+    sparseCheck->setChecked(ihand->sparseDiffusion);
 
     connect(ditherMethodBox, QOverload<int>::of(&QComboBox::currentIndexChanged), this, &DitherWindow::OnSetDitherMethod);
+    connect(loadMatrixButton, &QPushButton::clicked, this, &DitherWindow::OnLoadThresholdMatrix);
     connect(lumDitherControl, &SliderAndDoubleSpinBox::ValueChanged, this, &DitherWindow::OnSetLuminosityDither);
     connect(satDitherControl, &SliderAndDoubleSpinBox::ValueChanged, this, &DitherWindow::OnSetSaturationDither);
     connect(hueDitherControl, &SliderAndDoubleSpinBox::ValueChanged, this, &DitherWindow::OnSetHueDither);
@@ -134,6 +144,8 @@ DitherWindow::DitherWindow(ImageHandler* handler, GPITool* parent) : QDockWidget
     connect(postBrightControl, &SliderAndDoubleSpinBox::ValueChanged, this, &DitherWindow::OnSetPostBrightness);
     connect(postContrastControl, &SliderAndDoubleSpinBox::ValueChanged, this, &DitherWindow::OnSetPostContrast);
     connect(boustroCheck, &QCheckBox::stateChanged, this, &DitherWindow::OnToggleBoustrophedon);
+    connect(stripCheck, &QCheckBox::stateChanged, this, &DitherWindow::OnToggleStripDiffusion);
+    connect(sparseCheck, &QCheckBox::stateChanged, this, &DitherWindow::OnToggleSparseDiffusion);
 }
 
 void DitherWindow::OnSetDitherMethod(int index)
@@ -142,6 +154,20 @@ void DitherWindow::OnSetDitherMethod(int index)
     mwin->UpdateImageThumbnailAfterDither();
 }
 
+void DitherWindow::OnLoadThresholdMatrix()
+{
+    QString fileName = QFileDialog::getOpenFileName(this, "Open Threshold Matrix", nullptr, "Image files (*.png *.jpg *.jpeg *.jfif)");
+
+    if (!fileName.isNull())
+    {
+        if (ihand->LoadThresholdMatrixFile(fileName.toUtf8().constData()))
+        {
+            if (ihand->ditherMethod == CUSTOMMATRIX) mwin->UpdateImageThumbnailAfterDither();
+            else ditherMethodBox->setCurrentIndex(CUSTOMMATRIX); //Redoes the dither through OnSetDitherMethod
+        }
+    }
+}
+
 void DitherWindow::OnSetLuminosityDither(double val)
 {
     ihand->luminosityDither = val;
@@ -230,3 +256,37 @@ void DitherWindow::OnToggleBoustrophedon(int state)
     }
     mwin->UpdateImageThumbnailAfterDither();
 }
+
+void DitherWindow::OnToggleStripDiffusion(int state)
+{
+    switch (state)
+    {
+        case Qt::Unchecked:
+            ihand->stripDiffusion = false;
+            break;
+        case Qt::PartiallyChecked:
+            ihand->stripDiffusion = true;
+            break;
+        case Qt::Checked:
+            ihand->stripDiffusion = true;
+            break;
+    }
+    mwin->UpdateImageThumbnailAfterDither();
+}
+
+void DitherWindow::OnToggleSparseDiffusion(int state)
+{
+    switch (state)
+    {
+        case Qt::Unchecked:
+            ihand->sparseDiffusion = false;
+            break;
+        case Qt::PartiallyChecked:
+            ihand->sparseDiffusion = true;
+            break;
+        case Qt::Checked:
+            ihand->sparseDiffusion = true;
+            break;
+    }
+    mwin->UpdateImageThumbnailAfterDither();
+}
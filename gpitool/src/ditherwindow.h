@@ -29,6 +29,7 @@
 #include <QDoubleSpinBox>
 #include <QComboBox>
 #include <QCheckBox>
+#include <QPushButton>
 #include "sliderandspinbox.h"
 #include "imagehandler.h"
 #include "gpitool.h"
@@ -44,6 +45,7 @@ public:
 
 protected:
     QComboBox* ditherMethodBox;
+    QPushButton* loadMatrixButton;
     SliderAndDoubleSpinBox* lumDitherControl;
     SliderAndDoubleSpinBox* satDitherControl;
     SliderAndDoubleSpinBox* hueDitherControl;
@@ -57,9 +59,12 @@ protected:
     SliderAndDoubleSpinBox* postBrightControl;
     SliderAndDoubleSpinBox* postContrastControl;
     QCheckBox* boustroCheck;
+    QCheckBox* stripCheck;
+    QCheckBox* sparseCheck;
 
 private slots:
     void OnSetDitherMethod(int index);
+    void OnLoadThresholdMatrix();
     void OnSetLuminosityDither(double val);
     void OnSetSaturationDither(double val);
     void OnSetHueDither(double val);
@@ -73,6 +78,8 @@ private slots:
     void OnSetPostBrightness(double val);
     void OnSetPostContrast(double val);
     void OnToggleBoustrophedon(int state);
+    void OnToggleStripDiffusion(int state);
+    void OnToggleSparseDiffusion(int state);
 
 private:
     ImageHandler* ihand;
@@ -0,0 +1,451 @@
+/* gpitool - Converts images into .GPI format
+ * Copyright (c) 2024 Maxim Hoxha
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Error diffusion kernels
+ */
+
+#include <string.h>
+#include "errordiffusion.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define EDD_X86
+#include <immintrin.h>
+#endif
+
+//The vectorised blends below do the same float operations in the same order as BlendSRGB8, so they round the same way.
+//None of them are built with FMA for that reason, as a fused multiply-add rounds once where BlendSRGB8 rounds twice.
+
+static int FindOpaquePixelScalar(const ColourRGBA8* line, int start, int w, unsigned int alphaThreshold)
+{
+    for (int j = start; j < w; j++)
+    {
+        if (line[j].A >= alphaThreshold) return j;
+    }
+    return w;
+}
+
+static void BlendTransparentRowsScalar(const ColourRGBA8* top, const ColourRGBA8* bottom, float amt, ColourRGBA8* out, long long start, long long n)
+{
+    for (long long j = start; j < n; j++)
+    {
+        ColourRGBA8 tCol = top[j];
+        ColourRGBA8 bCol = bottom[j];
+        tCol.A = 0x00; //Force full transparency
+        bCol.A = 0x00;
+        out[j] = BlendSRGB8(tCol, bCol, amt);
+    }
+}
+
+static void BlendTransparentGapScalar(ColourRGBA8 l, ColourRGBA8 r, int start, int n, ColourRGBA8* out)
+{
+    l.A = 0x00; //Force full transparency
+    r.A = 0x00;
+    for (int k = start; k < n; k++)
+    {
+        out[k] = BlendSRGB8(l, r, ((float)k)/((float)n));
+    }
+}
+
+#ifdef EDD_X86
+//Alpha is the top byte of each pixel, and it's at least the threshold exactly when the larger of the two is alpha
+__attribute__((target("sse2"))) static int FindOpaquePixelSSE2(const ColourRGBA8* line, int start, int w, unsigned int alphaThreshold)
+{
+    const __m128i threshold = _mm_set1_epi32((int)(alphaThreshold << 24));
+    int j = start;
+    for (; j + 4 <= w; j += 4)
+    {
+        const __m128i pix = _mm_loadu_si128((const __m128i*)(line + j));
+        const int opaque = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(pix, threshold), pix)) & 0x8888;
+        if (opaque) return j + (__builtin_ctz(opaque) >> 2);
+    }
+    return FindOpaquePixelScalar(line, j, w, alphaThreshold);
+}
+
+__attribute__((target("avx2"))) static int FindOpaquePixelAVX2(const ColourRGBA8* line, int start, int w, unsigned int alphaThreshold)
+{
+    const __m256i threshold = _mm256_set1_epi32((int)(alphaThreshold << 24));
+    int j = start;
+    for (; j + 8 <= w; j += 8)
+    {
+        const __m256i pix = _mm256_loadu_si256((const __m256i*)(line + j));
+        const unsigned int opaque = ((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(pix, threshold), pix))) & 0x88888888u;
+        if (opaque) return j + (__builtin_ctz(opaque) >> 2);
+    }
+    return FindOpaquePixelScalar(line, j, w, alphaThreshold);
+}
+
+//One pixel's worth of BlendSRGB8, for 4 channels as floats
+__attribute__((target("sse2"))) static inline __m128i BlendSRGB8SSE2(__m128i l, __m128i r, __m128 amt)
+{
+    const __m128 scale = _mm_set1_ps(255.0f);
+    const __m128 namt = _mm_sub_ps(_mm_set1_ps(1.0f), amt);
+    const __m128 lf = _mm_div_ps(_mm_cvtepi32_ps(l), scale);
+    const __m128 rf = _mm_div_ps(_mm_cvtepi32_ps(r), scale);
+    const __m128 outf = _mm_add_ps(_mm_mul_ps(namt, lf), _mm_mul_ps(amt, rf));
+    return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(outf, scale), _mm_set1_ps(0.5f)));
+}
+
+//Packs 4 pixels of 32 bit channels back down to bytes, clamped as BlendSRGB8 does, with alpha cleared
+__attribute__((target("sse2"))) static inline __m128i PackTransparentSSE2(__m128i p0, __m128i p1, __m128i p2, __m128i p3)
+{
+    const __m128i packed = _mm_packus_epi16(_mm_packs_epi32(p0, p1), _mm_packs_epi32(p2, p3));
+    return _mm_and_si128(packed, _mm_set1_epi32(0x00FFFFFF));
+}
+
+__attribute__((target("sse2"))) static void BlendTransparentRowsSSE2(const ColourRGBA8* top, const ColourRGBA8* bottom, float amt, ColourRGBA8* out, long long n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 vamt = _mm_set1_ps(amt);
+    long long j = 0;
+    for (; j + 4 <= n; j += 4)
+    {
+        const __m128i t = _mm_loadu_si128((const __m128i*)(top + j));
+        const __m128i b = _mm_loadu_si128((const __m128i*)(bottom + j));
+        const __m128i tLo = _mm_unpacklo_epi8(t, zero);
+        const __m128i tHi = _mm_unpackhi_epi8(t, zero);
+        const __m128i bLo = _mm_unpacklo_epi8(b, zero);
+        const __m128i bHi = _mm_unpackhi_epi8(b, zero);
+        const __m128i p0 = BlendSRGB8SSE2(_mm_unpacklo_epi16(tLo, zero), _mm_unpacklo_epi16(bLo, zero), vamt);
+        const __m128i p1 = BlendSRGB8SSE2(_mm_unpackhi_epi16(tLo, zero), _mm_unpackhi_epi16(bLo, zero), vamt);
+        const __m128i p2 = BlendSRGB8SSE2(_mm_unpacklo_epi16(tHi, zero), _mm_unpacklo_epi16(bHi, zero), vamt);
+        const __m128i p3 = BlendSRGB8SSE2(_mm_unpackhi_epi16(tHi, zero), _mm_unpackhi_epi16(bHi, zero), vamt);
+        _mm_storeu_si128((__m128i*)(out + j), PackTransparentSSE2(p0, p1, p2, p3));
+    }
+    BlendTransparentRowsScalar(top, bottom, amt, out, j, n);
+}
+
+__attribute__((target("sse2"))) static void BlendTransparentGapSSE2(ColourRGBA8 l, ColourRGBA8 r, int n, ColourRGBA8* out)
+{
+    const __m128i lv = _mm_set_epi32(0, l.B, l.G, l.R);
+    const __m128i rv = _mm_set_epi32(0, r.B, r.G, r.R);
+    const __m128 fn = _mm_set1_ps((float)n);
+    int k = 1;
+    for (; k + 4 <= n; k += 4)
+    {
+        const __m128 amts = _mm_div_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(k), _mm_set_epi32(3, 2, 1, 0))), fn);
+        const __m128i p0 = BlendSRGB8SSE2(lv, rv, _mm_shuffle_ps(amts, amts, _MM_SHUFFLE(0, 0, 0, 0)));
+        const __m128i p1 = BlendSRGB8SSE2(lv, rv, _mm_shuffle_ps(amts, amts, _MM_SHUFFLE(1, 1, 1, 1)));
+        const __m128i p2 = BlendSRGB8SSE2(lv, rv, _mm_shuffle_ps(amts, amts, _MM_SHUFFLE(2, 2, 2, 2)));
+        const __m128i p3 = BlendSRGB8SSE2(lv, rv, _mm_shuffle_ps(amts, amts, _MM_SHUFFLE(3, 3, 3, 3)));
+        _mm_storeu_si128((__m128i*)(out + k), PackTransparentSSE2(p0, p1, p2, p3));
+    }
+    BlendTransparentGapScalar(l, r, k, n, out);
+}
+
+//Two pixels' worth of BlendSRGB8, the first in the low lane
+__attribute__((target("avx2"))) static inline __m256i BlendSRGB8AVX2(__m256i l, __m256i r, __m256 amt)
+{
+    const __m256 scale = _mm256_set1_ps(255.0f);
+    const __m256 namt = _mm256_sub_ps(_mm256_set1_ps(1.0f), amt);
+    const __m256 lf = _mm256_div_ps(_mm256_cvtepi32_ps(l), scale);
+    const __m256 rf = _mm256_div_ps(_mm256_cvtepi32_ps(r), scale);
+    const __m256 outf = _mm256_add_ps(_mm256_mul_ps(namt, lf), _mm256_mul_ps(amt, rf));
+    return _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(outf, scale), _mm256_set1_ps(0.5f)));
+}
+
+//Packs pixels 0-1, 2-3, 4-5 and 6-7 of 32 bit channels back down to bytes, clamped as BlendSRGB8 does, with alpha cleared
+__attribute__((target("avx2"))) static inline __m256i PackTransparentAVX2(__m256i p01, __m256i p23, __m256i p45, __m256i p67)
+{
+    //Packing works within lanes, which leaves the even pixels in the low lane and the odd ones in the high lane
+    const __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(p01, p23), _mm256_packs_epi32(p45, p67));
+    const __m256i ordered = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+    return _mm256_and_si256(ordered, _mm256_set1_epi32(0x00FFFFFF));
+}
+
+__attribute__((target("avx2"))) static void BlendTransparentRowsAVX2(const ColourRGBA8* top, const ColourRGBA8* bottom, float amt, ColourRGBA8* out, long long n)
+{
+    const __m256 vamt = _mm256_set1_ps(amt);
+    long long j = 0;
+    for (; j + 8 <= n; j += 8)
+    {
+        __m256i p[4];
+        for (int c = 0; c < 4; c++)
+        {
+            const __m256i t = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(top + j + 2*c)));
+            const __m256i b = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(bottom + j + 2*c)));
+            p[c] = BlendSRGB8AVX2(t, b, vamt);
+        }
+        _mm256_storeu_si256((__m256i*)(out + j), PackTransparentAVX2(p[0], p[1], p[2], p[3]));
+    }
+    BlendTransparentRowsScalar(top, bottom, amt, out, j, n);
+}
+
+__attribute__((target("avx2"))) static void BlendTransparentGapAVX2(ColourRGBA8 l, ColourRGBA8 r, int n, ColourRGBA8* out)
+{
+    const __m256i lv = _mm256_setr_epi32(l.R, l.G, l.B, 0, l.R, l.G, l.B, 0);
+    const __m256i rv = _mm256_setr_epi32(r.R, r.G, r.B, 0, r.R, r.G, r.B, 0);
+    const __m256 fn = _mm256_set1_ps((float)n);
+    int k = 1;
+    for (; k + 8 <= n; k += 8)
+    {
+        const __m256 amts = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(k), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))), fn);
+        __m256i p[4];
+        for (int c = 0; c < 4; c++)
+        {
+            const __m256i spread = _mm256_setr_epi32(2*c, 2*c, 2*c, 2*c, 2*c + 1, 2*c + 1, 2*c + 1, 2*c + 1);
+            p[c] = BlendSRGB8AVX2(lv, rv, _mm256_permutevar8x32_ps(amts, spread));
+        }
+        _mm256_storeu_si256((__m256i*)(out + k), PackTransparentAVX2(p[0], p[1], p[2], p[3]));
+    }
+    BlendTransparentGapScalar(l, r, k, n, out);
+}
+#endif
+
+int FindOpaquePixel(const ColourRGBA8* line, int start, int w, unsigned int alphaThreshold, int kernel)
+{
+    if (alphaThreshold > 0xFF) return w;
+    if (start < w && line[start].A >= alphaThreshold) return start; //Most often the very next pixel in an opaque run
+    if (kernel == CONVERT_AUTO) kernel = GetBestConvertKernel();
+    switch (kernel)
+    {
+#ifdef EDD_X86
+        case CONVERT_SSE2: return FindOpaquePixelSSE2(line, start, w, alphaThreshold);
+        case CONVERT_AVX2:
+        case CONVERT_AVX512: return FindOpaquePixelAVX2(line, start, w, alphaThreshold);
+#endif
+        default: return FindOpaquePixelScalar(line, start, w, alphaThreshold);
+    }
+}
+
+void BlendTransparentRows(const ColourRGBA8* top, const ColourRGBA8* bottom, float amt, ColourRGBA8* out, long long n, int kernel)
+{
+    if (kernel == CONVERT_AUTO) kernel = GetBestConvertKernel();
+    switch (kernel)
+    {
+#ifdef EDD_X86
+        case CONVERT_SSE2: BlendTransparentRowsSSE2(top, bottom, amt, out, n); break;
+        case CONVERT_AVX2:
+        case CONVERT_AVX512: BlendTransparentRowsAVX2(top, bottom, amt, out, n); break;
+#endif
+        default: BlendTransparentRowsScalar(top, bottom, amt, out, 0, n); break;
+    }
+}
+
+void BlendTransparentGap(ColourRGBA8 l, ColourRGBA8 r, int n, ColourRGBA8* out, int kernel)
+{
+    if (kernel == CONVERT_AUTO) kernel = GetBestConvertKernel();
+    switch (kernel)
+    {
+#ifdef EDD_X86
+        case CONVERT_SSE2: BlendTransparentGapSSE2(l, r, n, out); break;
+        case CONVERT_AVX2:
+        case CONVERT_AVX512: BlendTransparentGapAVX2(l, r, n, out); break;
+#endif
+        default: BlendTransparentGapScalar(l, r, 1, n, out); break;
+    }
+}
+
+bool InitExpandedRowSource(ExpandedRowSource* src, const ColourRGBA8* pixels, int w, int h, unsigned int alphaThreshold, int kernel)
+{
+    if (kernel == CONVERT_AUTO) kernel = GetBestConvertKernel();
+    src->pixels = pixels;
+    src->w = w;
+    src->h = h;
+    src->alphaThreshold = alphaThreshold;
+    src->kernel = kernel;
+    src->prevOpaqueLine = new int[h];
+    src->nextOpaqueLine = new int[h];
+
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int i = 0; i < h; i++)
+    {
+        const bool opaque = FindOpaquePixel(pixels + ((long long)i) * w, 0, w, alphaThreshold, kernel) < w;
+        src->prevOpaqueLine[i] = opaque ? i : -1;
+    }
+    int lastOpaque = -1;
+    for (int i = 0; i < h; i++)
+    {
+        if (src->prevOpaqueLine[i] == i) lastOpaque = i;
+        src->prevOpaqueLine[i] = lastOpaque;
+    }
+    int nextOpaque = h;
+    for (int i = h - 1; i >= 0; i--)
+    {
+        if (src->prevOpaqueLine[i] == i) nextOpaque = i;
+        src->nextOpaqueLine[i] = nextOpaque;
+    }
+    src->firstLine = (h > 0) ? src->nextOpaqueLine[0] : 0;
+    src->lastLine = lastOpaque;
+    return lastOpaque >= 0;
+}
+
+void FreeExpandedRowSource(ExpandedRowSource* src)
+{
+    delete[] src->prevOpaqueLine;
+    delete[] src->nextOpaqueLine;
+}
+
+//A pixel is inside the horizon if there's an opaque pixel no more than reachX across and reachY down from it (error never goes up).
+//Worked out a line at a time from the bottom up: the distance down to the nearest opaque pixel in each column, then spread across to the columns
+//within reachX of any that are close enough. The distances stop counting past reachY, so a band of lines only needs to start
+//that far below itself, and the bands are done in parallel.
+void BuildDiffusionHorizon(DiffusionHorizon* horizon, const ExpandedRowSource* src, int reachX, int reachY)
+{
+    const int w = src->w;
+    const int h = src->h;
+    const int ew = w + 2*EDD_EXPAND_X;
+    const int numRows = h + EDD_EXPAND_Y_TOP;
+    horizon->ew = ew;
+    horizon->inside = new unsigned char[((long long)numRows) * ew];
+    horizon->rowInside = new bool[numRows];
+
+    const int numBands = (numRows + EDD_HORIZON_BAND - 1) / EDD_HORIZON_BAND;
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int band = 0; band < numBands; band++)
+    {
+        const int firstRow = band * EDD_HORIZON_BAND - EDD_EXPAND_Y_TOP; //As source lines
+        const int lastRow = ((firstRow + EDD_HORIZON_BAND < h) ? firstRow + EDD_HORIZON_BAND : h) - 1;
+        const int startLine = (lastRow + reachY + 1 < h) ? lastRow + reachY + 1 : h - 1;
+        unsigned char* down = new unsigned char[ew];
+        memset(down, reachY + 1, ew);
+        for (int y = startLine; y >= firstRow; y--)
+        {
+            if (y >= 0)
+            {
+                const ColourRGBA8* line = src->pixels + ((long long)y) * w;
+                unsigned char* lineDown = down + EDD_EXPAND_X;
+                for (int x = 0; x < w; x++)
+                {
+                    lineDown[x] = (line[x].A >= src->alphaThreshold) ? 0 : ((lineDown[x] <= reachY) ? lineDown[x] + 1 : reachY + 1);
+                }
+            }
+            else //Nothing above the image is opaque
+            {
+                for (int x = 0; x < ew; x++)
+                {
+                    if (down[x] <= reachY) down[x]++;
+                }
+            }
+            if (y > lastRow) continue;
+
+            unsigned char* inside = horizon->inside + ((long long)(y + EDD_EXPAND_Y_TOP)) * ew;
+            int lastNear = -reachX - 1; //Spread each way from the columns with an opaque pixel close enough below
+            for (int x = 0; x < ew; x++)
+            {
+                if (down[x] <= reachY) lastNear = x;
+                inside[x] = (x - lastNear <= reachX);
+            }
+            bool anyInside = false;
+            lastNear = ew + reachX;
+            for (int x = ew - 1; x >= 0; x--)
+            {
+                if (down[x] <= reachY) lastNear = x;
+                inside[x] |= (lastNear - x <= reachX);
+                anyInside |= inside[x];
+            }
+            horizon->rowInside[y + EDD_EXPAND_Y_TOP] = anyInside;
+        }
+        delete[] down;
+    }
+}
+
+void FreeDiffusionHorizon(DiffusionHorizon* horizon)
+{
+    delete[] horizon->inside;
+    delete[] horizon->rowInside;
+}
+
+void InitExpandedRowCache(ExpandedRowCache* cache, int w)
+{
+    cache->rows[0] = new ColourRGBA8[w + 2*EDD_EXPAND_X];
+    cache->rows[1] = new ColourRGBA8[w + 2*EDD_EXPAND_X];
+    cache->lines[0] = -1;
+    cache->lines[1] = -1;
+}
+
+void FreeExpandedRowCache(ExpandedRowCache* cache)
+{
+    delete[] cache->rows[0];
+    delete[] cache->rows[1];
+}
+
+//Fills in the transparent parts of a line with at least one opaque pixel: clamped to the outermost opaque pixels at the edges, blended between them in gaps
+static void ExtendLine(const ExpandedRowSource* src, int line, ColourRGBA8* outRow)
+{
+    const int w = src->w;
+    const ColourRGBA8* inRow = src->pixels + ((long long)line) * w;
+    ColourRGBA8* outPix = outRow + EDD_EXPAND_X; //So the image starts at 0 and the margins are negative or past w
+    int leftPix = -1;
+    for (int j = FindOpaquePixel(inRow, 0, w, src->alphaThreshold, src->kernel); j < w; j = FindOpaquePixel(inRow, j + 1, w, src->alphaThreshold, src->kernel))
+    {
+        ColourRGBA8 pixcol = inRow[j];
+        pixcol.A = 0x00; //Force full transparency
+        if (leftPix < 0) //Clamp to left edge
+        {
+            for (int k = -EDD_EXPAND_X; k < j; k++)
+            {
+                outPix[k] = pixcol;
+            }
+        }
+        else if (leftPix < j - 1) //Blend between sides
+        {
+            BlendTransparentGap(inRow[leftPix], pixcol, j - leftPix, outPix + leftPix, src->kernel);
+        }
+        pixcol.A = 0xFF; //Force full opacity
+        outPix[j] = pixcol;
+        leftPix = j;
+    }
+    ColourRGBA8 rightCol = inRow[leftPix];
+    rightCol.A = 0x00; //Force full transparency
+    for (int k = leftPix + 1; k < w + EDD_EXPAND_X; k++) //Clamp to right edge
+    {
+        outPix[k] = rightCol;
+    }
+}
+
+//The extended copy of an opaque line, reusing whichever cached line isn't keepLine if it has to be built
+static const ColourRGBA8* GetExtendedLine(const ExpandedRowSource* src, ExpandedRowCache* cache, int line, int keepLine)
+{
+    if (cache->lines[0] == line) return cache->rows[0];
+    if (cache->lines[1] == line) return cache->rows[1];
+    const int slot = (cache->lines[0] == keepLine) ? 1 : 0;
+    ExtendLine(src, line, cache->rows[slot]);
+    cache->lines[slot] = line;
+    return cache->rows[slot];
+}
+
+void GetExpandedRow(const ExpandedRowSource* src, ExpandedRowCache* cache, long long y, ColourRGBA8* outRow)
+{
+    const int ew = src->w + 2*EDD_EXPAND_X;
+    if (y >= src->firstLine && y <= src->lastLine && src->prevOpaqueLine[y] == y)
+    {
+        memcpy(outRow, GetExtendedLine(src, cache, (int)y, -1), ew * sizeof(ColourRGBA8));
+    }
+    else if (y < src->firstLine || y > src->lastLine) //Vertical clamping
+    {
+        const ColourRGBA8* rowPtr = GetExtendedLine(src, cache, (y < src->firstLine) ? src->firstLine : src->lastLine, -1);
+        for (int j = 0; j < ew; j++)
+        {
+            ColourRGBA8 rCol = rowPtr[j];
+            rCol.A = 0x00; //Force full transparency
+            outRow[j] = rCol;
+        }
+    }
+    else //Blend between non-transparent lines
+    {
+        const int topLine = src->prevOpaqueLine[y];
+        const int bottomLine = src->nextOpaqueLine[y];
+        const ColourRGBA8* tPtr = GetExtendedLine(src, cache, topLine, bottomLine);
+        const ColourRGBA8* bPtr = GetExtendedLine(src, cache, bottomLine, topLine);
+        const float blendFac = (((float)y) - ((float)topLine))/(((float)bottomLine) - ((float)topLine));
+        BlendTransparentRows(tPtr, bPtr, blendFac, outRow, ew, src->kernel);
+    }
+}
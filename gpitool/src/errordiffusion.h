@@ -0,0 +1,240 @@
+/* gpitool - Converts images into .GPI format
+ * Copyright (c) 2024 Maxim Hoxha
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Error diffusion kernels
+ */
+
+#pragma once
+
+#include "imagehandler.h"
+#include "colourconvert.h"
+
+//Controls the amount to expand our rectangle of interest in each direction in order to give some "burn in" to error diffusion
+#define EDD_EXPAND_X        19
+#define EDD_EXPAND_Y_TOP    19
+#define EDD_EXPAND_Y_BOTTOM 3
+//No kernel reaches more than this many rows down, so this many rows of error plus the current one are all that need to be kept
+#define EDD_MAX_MARGIN_Y    2
+#define EDD_ERROR_ROWS      (EDD_MAX_MARGIN_Y + 1)
+//Rows dithered in parallel wait on the row above once per this many pixels
+#define EDD_WAVEFRONT_CHUNK 32
+//and give up their time slice after checking this many times without it being far enough ahead
+#define EDD_WAVEFRONT_SPINS 256
+//How far error from a transparent pixel is taken to matter when skipping distant transparent pixels, in multiples of how far the kernel reaches
+//across and down. Each step spreads the error out and shares it with pixels that already have their own, so a few steps is enough
+#define EDD_HORIZON_RADII   3
+//Lines of the horizon map built by each thread at a time, which each look reachY lines further down
+#define EDD_HORIZON_BAND    256
+//Strips for DiffuseErrorStrips are at least this many lines, so the burn-in above each one doesn't cost too much
+#define EDD_STRIP_MIN_LINES 64
+
+//One tap of an error diffusion kernel: dx pixels along the scan direction and dy rows down from the current pixel gets this fraction of its error
+typedef struct
+{
+    int dx;
+    int dy;
+    float weight;
+} DiffusionTap;
+
+//Accumulated error for one row of the expanded image
+typedef struct DiffusionErrorRow
+{
+    float* L;
+    float* a;
+    float* b;
+} DiffusionErrorRow;
+
+//Builds the rows of the expanded image as they're needed, instead of the whole image at once
+//Transparent gaps in a line are blended between the opaque pixels either side, and the margins and fully transparent lines are clamped or blended
+//between the nearest opaque lines, so error diffusion has something sensible to burn in on. Only opaque source pixels come out opaque.
+typedef struct ExpandedRowSource
+{
+    const ColourRGBA8* pixels;
+    int w;
+    int h;
+    unsigned int alphaThreshold;
+    int kernel; //One of convertKernels, for the blends that fill in transparent pixels
+    int firstLine; //The first and last lines with any opaque pixels
+    int lastLine;
+    int* prevOpaqueLine; //The nearest line at or above/below each line with any opaque pixels
+    int* nextOpaqueLine;
+} ExpandedRowSource;
+
+//The last two opaque lines extended, for blending the transparent lines between them, one per thread reading an ExpandedRowSource
+typedef struct
+{
+    ColourRGBA8* rows[2];
+    int lines[2];
+} ExpandedRowCache;
+
+//The first pixel from start on with at least alphaThreshold alpha, or w if there isn't one
+int FindOpaquePixel(const ColourRGBA8* line, int start, int w, unsigned int alphaThreshold, int kernel = CONVERT_AUTO);
+//BlendSRGB8 of each pair of pixels in two rows, by the same amount, with the alpha of the result cleared
+void BlendTransparentRows(const ColourRGBA8* top, const ColourRGBA8* bottom, float amt, ColourRGBA8* out, long long n, int kernel = CONVERT_AUTO);
+//BlendSRGB8 from l to r over a gap of n pixels, with the alpha of the result cleared: out[k] is k/n of the way, for k from 1 to n - 1
+void BlendTransparentGap(ColourRGBA8 l, ColourRGBA8 r, int n, ColourRGBA8* out, int kernel = CONVERT_AUTO);
+
+//How many strips DiffuseErrorStrips cuts h lines into with this many threads, strip s starting at line h*s/numStrips
+inline int GetDiffusionStripCount(int h, int numThreads)
+{
+    const int numStrips = h / EDD_STRIP_MIN_LINES;
+    return (numStrips < numThreads) ? numStrips : numThreads;
+}
+
+//Returns false if there are no opaque pixels at all, in which case there's nothing to stream
+bool InitExpandedRowSource(ExpandedRowSource* src, const ColourRGBA8* pixels, int w, int h, unsigned int alphaThreshold, int kernel = CONVERT_AUTO);
+void FreeExpandedRowSource(ExpandedRowSource* src);
+void InitExpandedRowCache(ExpandedRowCache* cache, int w);
+void FreeExpandedRowCache(ExpandedRowCache* cache);
+//Row y of the expanded image, where y is a source line and so can be up to EDD_EXPAND_Y_TOP above or EDD_EXPAND_Y_BOTTOM below the image
+//outRow is w + 2*EDD_EXPAND_X pixels, the image starting at EDD_EXPAND_X
+void GetExpandedRow(const ExpandedRowSource* src, ExpandedRowCache* cache, long long y, ColourRGBA8* outRow);
+
+//Which pixels of the expanded image are close enough above or beside an opaque pixel for their error to reach it, for the rows that get dithered
+//Rows start EDD_EXPAND_Y_TOP lines above the image, and each is w + 2*EDD_EXPAND_X long like the expanded rows
+typedef struct DiffusionHorizon
+{
+    unsigned char* inside; //Non-zero within the horizon
+    bool* rowInside; //Whether any of each row is
+    int ew;
+} DiffusionHorizon;
+
+//reachX and reachY are how far across and down error from a transparent pixel is taken to matter
+void BuildDiffusionHorizon(DiffusionHorizon* horizon, const ExpandedRowSource* src, int reachX, int reachY);
+void FreeDiffusionHorizon(DiffusionHorizon* horizon);
+inline const unsigned char* GetDiffusionHorizonRow(const DiffusionHorizon* horizon, long long y)
+{
+    return horizon->inside + (y + EDD_EXPAND_Y_TOP) * horizon->ew;
+}
+
+//What DiffuseErrorRow needs besides the kernel, for one run of DitherImage
+typedef struct ErrorDiffusionSettings
+{
+    const OkLabBuffer* labImage;
+    int w;
+    int h;
+    float preB;
+    float preC;
+    float amtL;
+    float amtC;
+    float rngAmtL;
+    float rngAmtC;
+    bool randomise; //Whether either of the above are non-zero, as otherwise there's no need to work out the random numbers
+    const DiffusionHorizon* horizon; //Transparent pixels outside this are skipped and their error dropped, or null to dither every pixel
+} ErrorDiffusionSettings;
+
+//Each kernel is a table of taps known at compile time, so DiffuseErrorRow can be unrolled for it
+//marginX and marginY are how far it reaches sideways and down, which is how much of the expanded image's border it needs
+struct FloydSteinbergKernel
+{
+    static constexpr int marginX = 1;
+    static constexpr int marginY = 1;
+    static constexpr int numTaps = 4;
+    static constexpr DiffusionTap taps[numTaps] = { { 1, 0, 7.0f/16.0f }, { -1, 1, 3.0f/16.0f }, { 0, 1, 5.0f/16.0f }, { 1, 1, 1.0f/16.0f } };
+};
+
+struct FloydFalseKernel
+{
+    static constexpr int marginX = 1;
+    static constexpr int marginY = 1;
+    static constexpr int numTaps = 3;
+    static constexpr DiffusionTap taps[numTaps] = { { 1, 0, 3.0f/8.0f }, { 0, 1, 3.0f/8.0f }, { 1, 1, 2.0f/8.0f } };
+};
+
+struct JJNKernel
+{
+    static constexpr int marginX = 2;
+    static constexpr int marginY = 2;
+    static constexpr int numTaps = 12;
+    static constexpr DiffusionTap taps[numTaps] =
+    {
+        {  1, 0, 7.0f/48.0f }, {  2, 0, 5.0f/48.0f },
+        { -2, 1, 3.0f/48.0f }, { -1, 1, 5.0f/48.0f }, { 0, 1, 7.0f/48.0f }, { 1, 1, 5.0f/48.0f }, { 2, 1, 3.0f/48.0f },
+        { -2, 2, 1.0f/48.0f }, { -1, 2, 3.0f/48.0f }, { 0, 2, 5.0f/48.0f }, { 1, 2, 3.0f/48.0f }, { 2, 2, 1.0f/48.0f }
+    };
+};
+
+struct StuckiKernel
+{
+    static constexpr int marginX = 2;
+    static constexpr int marginY = 2;
+    static constexpr int numTaps = 12;
+    static constexpr DiffusionTap taps[numTaps] =
+    {
+        {  1, 0, 8.0f/42.0f }, {  2, 0, 4.0f/42.0f },
+        { -2, 1, 2.0f/42.0f }, { -1, 1, 4.0f/42.0f }, { 0, 1, 8.0f/42.0f }, { 1, 1, 4.0f/42.0f }, { 2, 1, 2.0f/42.0f },
+        { -2, 2, 1.0f/42.0f }, { -1, 2, 2.0f/42.0f }, { 0, 2, 4.0f/42.0f }, { 1, 2, 2.0f/42.0f }, { 2, 2, 1.0f/42.0f }
+    };
+};
+
+struct BurkesKernel
+{
+    static constexpr int marginX = 2;
+    static constexpr int marginY = 1;
+    static constexpr int numTaps = 7;
+    static constexpr DiffusionTap taps[numTaps] =
+    {
+        {  1, 0, 8.0f/32.0f }, {  2, 0, 4.0f/32.0f },
+        { -2, 1, 2.0f/32.0f }, { -1, 1, 4.0f/32.0f }, { 0, 1, 8.0f/32.0f }, { 1, 1, 4.0f/32.0f }, { 2, 1, 2.0f/32.0f }
+    };
+};
+
+struct SierraKernel
+{
+    static constexpr int marginX = 2;
+    static constexpr int marginY = 2;
+    static constexpr int numTaps = 10;
+    static constexpr DiffusionTap taps[numTaps] =
+    {
+        {  1, 0, 5.0f/32.0f }, {  2, 0, 3.0f/32.0f },
+        { -2, 1, 2.0f/32.0f }, { -1, 1, 4.0f/32.0f }, { 0, 1, 5.0f/32.0f }, { 1, 1, 4.0f/32.0f }, { 2, 1, 2.0f/32.0f },
+        { -1, 2, 2.0f/32.0f }, {  0, 2, 3.0f/32.0f }, { 1, 2, 2.0f/32.0f }
+    };
+};
+
+struct Sierra2RowKernel
+{
+    static constexpr int marginX = 2;
+    static constexpr int marginY = 1;
+    static constexpr int numTaps = 7;
+    static constexpr DiffusionTap taps[numTaps] =
+    {
+        {  1, 0, 4.0f/16.0f }, {  2, 0, 3.0f/16.0f },
+        { -2, 1, 1.0f/16.0f }, { -1, 1, 2.0f/16.0f }, { 0, 1, 3.0f/16.0f }, { 1, 1, 2.0f/16.0f }, { 2, 1, 1.0f/16.0f }
+    };
+};
+
+struct FilterLiteKernel
+{
+    static constexpr int marginX = 1;
+    static constexpr int marginY = 1;
+    static constexpr int numTaps = 3;
+    static constexpr DiffusionTap taps[numTaps] = { { 1, 0, 2.0f/4.0f }, { -1, 1, 1.0f/4.0f }, { 0, 1, 1.0f/4.0f } };
+};
+
+//The canonical Atkinson dither only diffuses 3/4 of the error, but we'll normalise this one anyway
+struct AtkinsonKernel
+{
+    static constexpr int marginX = 2;
+    static constexpr int marginY = 2;
+    static constexpr int numTaps = 6;
+    static constexpr DiffusionTap taps[numTaps] = { { 1, 0, 1.0f/6.0f }, { 2, 0, 1.0f/6.0f }, { -1, 1, 1.0f/6.0f }, { 0, 1, 1.0f/6.0f }, { 1, 1, 1.0f/6.0f }, { 0, 2, 1.0f/6.0f } };
+};
@@ -30,8 +30,10 @@
 #include <QPixmap>
 #include <QImage>
 #include <QBoxLayout>
+#include <string.h>
 #include <omp.h>
 #include "gpitool.h"
+#include "benchmark.h"
 
 static const char* licenseString =
 "Permission is hereby granted, free of charge, to any person obtaining a copy\n"
@@ -466,6 +468,8 @@ int main(int argc, char* argv[])
 {
     omp_set_num_threads(omp_get_max_threads());
 
+    if (argc > 1 && !strcmp(argv[1], "--benchmark")) return RunBenchmarks(argc - 2, argv + 2);
+
     //TODO: put console interface redirect here (avoid Qt related stuff unless we need the GUI)
 
     QApplication app = QApplication(argc, argv);
@@ -29,13 +29,23 @@ extern "C"
 }
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <omp.h>
+#include <thread>
 #include "imagehandler.h"
-
-//Controls the amount to expand our rectangle of interest in each direction in order to give some "burn in" to error diffusion
-#define EDD_EXPAND_X        19
-#define EDD_EXPAND_Y_TOP    19
-#define EDD_EXPAND_Y_BOTTOM 3
+#include "colourconvert.h"
+#include "colourhistogram.h"
+#include "kmeans.h"
+#include "quantizer.h"
+#include "nearestcolour.h"
+#include "ordereddither.h"
+#include "errordiffusion.h"
+#include "planardata.h"
+
+//Ordered dither memo slots hold the packed RGB and matrix cell in the top 48 bits, a valid flag and the palette index in the bottom 16
+#define ORDERED_MEMO_BITS 18
+#define ORDERED_MEMO_KEY_SHIFT 16
+#define ORDERED_MEMO_VALID 0x100ULL
 
 const ColourRGBA8 defaultPalette[16] =
 {
@@ -142,6 +152,16 @@ const float void16x16_3[256] = {  0.48828125f,  0.37890625f,  0.015625f,   -0.31
                                  -0.04296875f, -0.34375f,    -0.1953125f,   0.453125f,   -0.40234375f, -0.25f,       -0.078125f,    0.1875f,     -0.46484375f,  0.109375f,    0.44921875f, -0.3359375f,  -0.06640625f,  0.1484375f,   0.2421875f,  -0.24609375f,
                                   0.1796875f,  -0.47265625f,  0.140625f,    0.26171875f,  0.05078125f, -0.140625f,    0.484375f,    0.24609375f, -0.0390625f,  -0.1640625f,   0.3125f,      0.21484375f, -0.22265625f, -0.4921875f,   0.03515625f, -0.109375f };
 
+//Indexed by ditherMethod - BAYER2X2
+const OrderedDitherPattern orderedPatterns[] =
+{
+    {  2, { bayer2x2,      2, 0, 0 }, { bayer2x2,      2, 0, 1 }, { bayer4x4,     2,  1, 0 } },
+    {  4, { bayer4x4,      4, 0, 0 }, { bayer4x4,      4, 3, 1 }, { bayer4x4,     4,  1, 2 } },
+    {  8, { bayer8x8,      8, 0, 0 }, { bayer8x8,      8, 6, 1 }, { bayer8x8,     8,  3, 4 } },
+    { 16, { bayer16x16,   16, 0, 0 }, { bayer16x16,   16, 7, 4 }, { bayer16x16,  16, 10, 1 } },
+    { 16, { void16x16_1,  16, 0, 0 }, { void16x16_2,  16, 0, 0 }, { void16x16_3, 16,  0, 0 } }
+};
+
 ColourOkLabA SRGBToOkLab(ColourRGBA c)
 {
     float l = SRGBtoLMS[0] * c.R + SRGBtoLMS[1] * c.G + SRGBtoLMS[2] * c.B;
@@ -219,10 +239,37 @@ ColourOkLabA RoundTripLabA8bpc(ColourOkLabA c)
     return SRGBToOkLab(outRGBA);
 }
 
+inline ColourOkLabA OkLabBufferColour(const OkLabBuffer* buf, long long index)
+{
+    ColourOkLabA col = { buf->L[index], buf->a[index], buf->b[index], buf->A[index] };
+    return col;
+}
+
+//Opaque pixels of the expanded error diffusion input are copies of the source, so they can come from the working buffer
+//Everything else was synthesised by the edge extension and has to be converted here
+ColourOkLabA GetExpandedColourOkLab(const OkLabBuffer* buf, ColourRGBA8 pixcol, long long x, long long y, int w, int h, float bright, float contrast)
+{
+    if (pixcol.A == 0xFF && x >= 0 && x < w && y >= 0 && y < h)
+    {
+        ColourOkLabA col = OkLabBufferColour(buf, y * w + x);
+        col.A = 1.0f;
+        return col;
+    }
+    return ColourAdjust(SRGBToOkLab(SRGB8ToLinearFloat(pixcol)), bright, contrast);
+}
+
 ImageHandler::ImageHandler()
 {
     srcImage.data = nullptr;
     encImage.data = nullptr;
+    memset(&encIndexed, 0, sizeof(IndexedImageInfo));
+    memset(&paletteLab, 0, sizeof(OkLabBuffer));
+    memset(&ditherLab, 0, sizeof(OkLabBuffer));
+    srcHistogram = new ColourHistogram();
+    paletteIndex = new NearestColourIndex();
+    inverseMap = new InverseColourMap();
+    thresholdMatrices = nullptr;
+    orderedMemoHitRate = 0.0;
     numColours = 16;
     numColourPlanes = 4;
     planeMask = 0x00F;
@@ -243,10 +290,21 @@ ImageHandler::ImageHandler()
     postBrightness = 0.0;
     postContrast = 0.0;
     boustrophedon = false;
+    stripDiffusion = false;
+    sparseDiffusion = false;
+    orderedMemo = true;
 
     adaptivePreBrightness = 0.0;
     adaptivePreContrast = 0.0;
     adaptiveChromaBias = 1.0;
+    kMeansInput = KMEANS_AUTO;
+    paletteQuantizer = QUANTIZER_KMEANS;
+    quantizerSeedsKMeans = false;
+    kMeansMiniBatch = false;
+    kMeansBatchSize = 4096;
+    kMeansRefine = false;
+    paletteSeed = std::mt19937_64::default_seed;
+    ditherSeed = std::mt19937_64::default_seed;
 
     isTiled = false;
     tileSizeX = 16;
@@ -256,7 +314,12 @@ ImageHandler::ImageHandler()
 
 ImageHandler::~ImageHandler()
 {
-
+    FreeOkLabBuffer(&paletteLab);
+    FreeOkLabBuffer(&ditherLab);
+    delete srcHistogram;
+    delete paletteIndex;
+    delete inverseMap;
+    if (thresholdMatrices != nullptr) delete thresholdMatrices;
 }
 
 #define FORMAT_PNG           0
@@ -271,7 +334,8 @@ int JpegSignatureCheck(unsigned char* inBuf)
     else return 0;
 }
 
-int ImageHandler::OpenImageFile(const char* inFileName)
+//Reads a PNG or JPEG file into a new RGBA8 image
+static int ReadImageFile(const char* inFileName, ImageInfo* outImage)
 {
     FILE* file = fopen(inFileName, "rb");
     if (file == nullptr)
@@ -320,8 +384,8 @@ int ImageHandler::OpenImageFile(const char* inFileName)
             unsigned char bitdepth = png_get_bit_depth(pngPtr, pngInfoPtr);
             unsigned char colourtype = png_get_color_type(pngPtr, pngInfoPtr);
             unsigned char channels = png_get_channels(pngPtr, pngInfoPtr);
-            srcImage.width = w;
-            srcImage.height = h;
+            outImage->width = w;
+            outImage->height = h;
             //Transform to RGBA
             if (colourtype == PNG_COLOR_TYPE_PALETTE)
             {
@@ -358,11 +422,11 @@ int ImageHandler::OpenImageFile(const char* inFileName)
             }
             png_read_update_info(pngPtr, pngInfoPtr);
             //Allocate and read in PNG
-            srcImage.data = new ColourRGBA8[w * h];
+            outImage->data = new ColourRGBA8[w * h];
             unsigned char** rowPtrs = new unsigned char*[h];
             for (int i = 0; i < h; i++)
             {
-                rowPtrs[i] = (unsigned char*)(srcImage.data + i * w);
+                rowPtrs[i] = (unsigned char*)(outImage->data + i * w);
             }
             png_read_image(pngPtr, rowPtrs);
 
@@ -388,13 +452,13 @@ int ImageHandler::OpenImageFile(const char* inFileName)
 
             w = dinfo.output_width;
             h = dinfo.output_height;
-            srcImage.width = w;
-            srcImage.height = h;
-            srcImage.data = new ColourRGBA8[w * h];
+            outImage->width = w;
+            outImage->height = h;
+            outImage->data = new ColourRGBA8[w * h];
             JSAMPROW rowBuf = new JSAMPLE[3 * w];
             while (dinfo.output_scanline < h)
             {
-                ColourRGBA8* rowPtr = srcImage.data + w * dinfo.output_scanline;
+                ColourRGBA8* rowPtr = outImage->data + w * dinfo.output_scanline;
                 jpeg_read_scanlines(&dinfo, &rowBuf, 1);
                 for (int i = 0; i < w; i++)
                 {
@@ -419,10 +483,46 @@ int ImageHandler::OpenImageFile(const char* inFileName)
             return 2;
     }
 
+    return 0;
+}
+
+int ImageHandler::OpenImageFile(const char* inFileName)
+{
+    const int result = ReadImageFile(inFileName, &srcImage);
+    if (result) return result;
+
+    ResetForNewImage();
+    return 0;
+}
+
+void ImageHandler::SetImage(const ColourRGBA8* pixels, int w, int h)
+{
+    CloseImageFile();
+    srcImage.width = w;
+    srcImage.height = h;
+    srcImage.data = new ColourRGBA8[w * h];
+    memcpy(srcImage.data, pixels, w * h * sizeof(ColourRGBA8));
+    ResetForNewImage();
+}
+
+void ImageHandler::ResetForNewImage()
+{
+    const int w = srcImage.width;
+    const int h = srcImage.height;
     encImage.width = w;
     encImage.height = h;
     encImage.data = new ColourRGBA8[w * h];
     memcpy(encImage.data, srcImage.data, w * h * sizeof(ColourRGBA8));
+    encIndexed.width = w;
+    encIndexed.height = h;
+    encIndexed.opaqueStride = (w + 0x7)/0x8;
+    encIndexed.indices = new unsigned char[w * h];
+    memset(encIndexed.indices, 0, w * h);
+    encIndexed.opaque = new unsigned char[encIndexed.opaqueStride * h];
+    memset(encIndexed.opaque, 0, encIndexed.opaqueStride * h);
+    FreeOkLabBuffer(&paletteLab);
+    FreeOkLabBuffer(&ditherLab);
+    srcHistogram->Clear();
 
     numColours = 16;
     numColourPlanes = 4;
@@ -431,51 +531,26 @@ int ImageHandler::OpenImageFile(const char* inFileName)
     transparencyThreshold = 0x80;
     memcpy(palette, defaultPalette, sizeof(defaultPalette));
     GetLabPaletteFromRGBA8Palette();
-
-    return 0;
 }
 
 void ImageHandler::CloseImageFile()
 {
     if (srcImage.data != nullptr) delete[] srcImage.data;
     if (encImage.data != nullptr) delete[] encImage.data;
+    if (encIndexed.indices != nullptr) delete[] encIndexed.indices;
+    if (encIndexed.opaque != nullptr) delete[] encIndexed.opaque;
+    srcImage.data = nullptr;
+    encImage.data = nullptr;
+    encIndexed.indices = nullptr;
+    encIndexed.opaque = nullptr;
+    FreeOkLabBuffer(&paletteLab);
+    FreeOkLabBuffer(&ditherLab);
+    srcHistogram->Clear();
 }
 
 bool ImageHandler::IsPalettePerfect()
 {
-    int w = srcImage.width;
-    int h = srcImage.height;
-    ColourRGBA8* pixels = srcImage.data;
-    long long numPixels = w * h;
-    int tThres = transparencyThreshold;
-    if (tThres < 0) tThres = 0;
-    else if (tThres > 0xFF) tThres = 0xFF;
-    unsigned int transT = (unsigned int)tThres;
-    transT <<= 24;
-
-    //pointer reinterpretations
-    unsigned int* clistui = (unsigned int*)palette;
-    unsigned int* pixui = (unsigned int*)pixels;
-    for (int i = 0; i < numPixels; i++)
-    {
-        unsigned int inCol = pixui[i];
-        bool foundCol = false;
-        if (inCol < transT) continue; //Ignore 'transparent' colours
-        inCol |= 0xFF000000; //Force full opacity for comparison
-        for (int j = 0; j < numColours; j++)
-        {
-            if (clistui[j] == inCol)
-            {
-                foundCol = true;
-                break;
-            }
-        }
-        if (!foundCol)
-        {
-            return false;
-        }
-    }
-    return true;
+    return GetSourceHistogram()->IsSubsetOf(palette, numColours);
 }
 
 bool ImageHandler::LoadPaletteFile(const char* inFileName)
@@ -659,338 +734,159 @@ bool ImageHandler::SavePaletteFile(const char* outFileName)
     return true;
 }
 
-bool ImageHandler::GetBestPalette()
+//Replaces each of one channel's values by its rank among them, so any texture becomes evenly spread over [-0.5, 0.5) like the built in matrices
+static void EqualiseThresholdChannel(const ColourRGBA8* pixels, int n, int channel, float* outMatrix)
 {
-    return GetBestPalette(adaptiveChromaBias, adaptivePreBrightness, adaptivePreContrast);
+    int counts[256];
+    int below[256];
+    memset(counts, 0, sizeof(counts));
+    for (int i = 0; i < n; i++)
+    {
+        counts[((const unsigned char*)&pixels[i])[channel]]++;
+    }
+    int total = 0;
+    for (int i = 0; i < 256; i++)
+    {
+        below[i] = total;
+        total += counts[i];
+    }
+    for (int i = 0; i < n; i++)
+    {
+        const int value = ((const unsigned char*)&pixels[i])[channel];
+        outMatrix[i] = (below[value] + 0.5f * counts[value]) / n - 0.5f; //Ties share the middle of their ranks
+    }
+}
+
+bool ImageHandler::LoadThresholdMatrixFile(const char* inFileName)
+{
+    ImageInfo matrixImage;
+    if (ReadImageFile(inFileName, &matrixImage)) return false;
+    const int size = matrixImage.width;
+    if (size != matrixImage.height || size > ORDERED_MAX_SIZE)
+    {
+        printf("Threshold matrices must be square and no more than %d pixels across!\n", ORDERED_MAX_SIZE);
+        delete[] matrixImage.data;
+        return false;
+    }
+
+    const int n = size * size;
+    bool sameChannels = true;
+    for (int i = 0; i < n; i++)
+    {
+        const ColourRGBA8 col = matrixImage.data[i];
+        if (col.R != col.G || col.R != col.B)
+        {
+            sameChannels = false;
+            break;
+        }
+    }
+    if (thresholdMatrices == nullptr) thresholdMatrices = new ThresholdMatrixSet;
+    EqualiseThresholdChannel(matrixImage.data, n, 0, thresholdMatrices->lightness);
+    if (sameChannels)
+    {
+        FillThresholdMatrixSet(thresholdMatrices, thresholdMatrices->lightness, size);
+    }
+    else
+    {
+        EqualiseThresholdChannel(matrixImage.data, n, 1, thresholdMatrices->saturation);
+        EqualiseThresholdChannel(matrixImage.data, n, 2, thresholdMatrices->hue);
+        thresholdMatrices->size = size;
+    }
+    delete[] matrixImage.data;
+    return true;
 }
 
+bool ImageHandler::SetThresholdMatrix(const float* matrix, int size)
+{
+    if (size < 1 || size > ORDERED_MAX_SIZE) return false;
+    if (thresholdMatrices == nullptr) thresholdMatrices = new ThresholdMatrixSet;
+    FillThresholdMatrixSet(thresholdMatrices, matrix, size);
+    return true;
+}
 
-typedef struct
+bool ImageHandler::GetBestPalette()
 {
-    ColourOkLabA mean;
-    ColourOkLabA lastmean;
-    long long numInCluster;
-    double sumL;
-    double suma;
-    double sumb;
-} KMean;
+    return GetBestPalette(adaptiveChromaBias, adaptivePreBrightness, adaptivePreContrast);
+}
+
 
 bool ImageHandler::GetBestPalette(float uvbias, float bright, float contrast)
 {
     int w = srcImage.width;
     int h = srcImage.height;
-    ColourRGBA8* pixels = srcImage.data;
     long long numPixels = w * h;
     int tThres = transparencyThreshold;
     if (tThres < 0) tThres = 0;
     else if (tThres > 0xFF) tThres = 0xFF;
-    unsigned int transT = (unsigned int)tThres;
-    transT <<= 24;
     float ftThres = ((float)tThres)/255.0f;
 
     //Determine if there are too many unique colours
-    ColourRGBA8 colourList[256];
-    int totalColours = 0;
-    bool tooManyColours = false;
-    //pointer reinterpretations
-    unsigned int* clistui = (unsigned int*)colourList;
-    unsigned int* pixui = (unsigned int*)pixels;
-    for (int i = 0; i < numPixels; i++)
-    {
-        unsigned int inCol = pixui[i];
-        bool newCol = true;
-        if (inCol < transT) continue; //Ignore 'transparent' colours
-        inCol |= 0xFF000000; //Force full opacity for comparison
-        for (int j = 0; j < totalColours; j++)
-        {
-            if (inCol == clistui[j])
-            {
-                newCol = false;
-                break;
-            }
-        }
-        if (newCol)
-        {
-            totalColours++;
-            if (totalColours > numColours)
-            {
-                tooManyColours = true;
-                break;
-            }
-            else
-            {
-                clistui[totalColours-1] = inCol;
-            }
-        }
-    }
-    if (!tooManyColours)
+    ColourHistogram* hist = GetSourceHistogram();
+    if (hist->GetNumColours() <= numColours)
     {
-        numColours = totalColours;
-        memcpy(palette, colourList, numColours * sizeof(ColourRGBA8));
+        numColours = hist->GetNumColours();
+        hist->GetColours(palette, nullptr); //In order of appearance
         GetLabPaletteFromRGBA8Palette();
         return true;
     }
 
-    //Do the k-means algorithm if there are more unique colours in the image than the number of colours in the palette
-    ColourOkLabA* colours = new ColourOkLabA[numPixels];
-    KMean means[256];
-    //Initialise means
-    for (int i = 0; i < numColours; i++)
-    {
-        KMean* m = &means[i];
-        m->numInCluster = 0;
-        m->sumL = 0.0; m->suma = 0.0; m->sumb = 0.0;
-    }
-    //Initialise colour array
-    float imgMaxL = 0.0f;
-    float imgMinL = 1.0f;
-    float imgMaxC = 0.0f;
-    for (long long i = 0; i < numPixels; i++)
+    //Search for a palette if there are more unique colours in the image than the number of colours in the palette
+    //Mini-batch k-means converts the pixels it samples as it goes, so the weighted colours only give the range and the refinement
+    //Over unique colours the refinement is the same as over every pixel, without needing anything per pixel
+    const bool samplePixels = (kMeansInput == KMEANS_PIXELS) && kMeansMiniBatch && (paletteQuantizer == QUANTIZER_KMEANS);
+    int inputMode = kMeansInput;
+    if (inputMode == KMEANS_AUTO || samplePixels) inputMode = (hist->GetNumColours() <= KMEANS_MAX_UNIQUE_POINTS) ? KMEANS_UNIQUE : KMEANS_BUCKETED;
+    KMeansPoints points;
+    if (inputMode == KMEANS_PIXELS)
     {
-        //Without this clamping the k-means clustering would never converge
-        ColourRGBA8 pixcol = pixels[i];
-        float alpha = ((float)pixcol.A)/255.0f; //Avoid loss of precision in alpha value
-        ColourRGBA incol = OkLabToSRGB(ColourAdjust(SRGBToOkLab(SRGB8ToLinearFloat(pixcol)), bright, contrast));
-        if (incol.R > 1.0f) incol.R = 1.0f; else if (incol.R < 0.0f) incol.R = 0.0f;
-        if (incol.G > 1.0f) incol.G = 1.0f; else if (incol.G < 0.0f) incol.G = 0.0f;
-        if (incol.B > 1.0f) incol.B = 1.0f; else if (incol.B < 0.0f) incol.B = 0.0f;
-        ColourOkLabA outcol = SRGBToOkLab(incol);
-        outcol.A = alpha;
-        colours[i] = outcol;
-        if (outcol.L < imgMinL) imgMinL = outcol.L; if (outcol.L > imgMaxL) imgMaxL = outcol.L;
-        float sat = hypotf(outcol.a, outcol.b);
-        if (sat > imgMaxC) imgMaxC = sat;
-    }
-    //Pick some means (k-means||)
-    ColourOkLabA* csamples = new ColourOkLabA[17 * numColours];
-    double* probs = new double[numPixels];
-    unsigned long long rnum = RNGUpdate() % numPixels;
-    csamples[0] = colours[rnum];
-    int totalSamples = 1;
-    int sampPerIter = 2 * numColours;
-    //Pick some initial points
-    for (int i = 0; i < 8; i++)
-    {
-        //Cost calculation
-        double cost = 0.0;
+        //Without the gamut clamping the k-means clustering would never converge
+        //The points borrow the cached buffer, only the weights belong to them
+        const OkLabBuffer* colours = GetOkLabBuffer(&paletteLab, bright, contrast, true);
+        points.L = colours->L;
+        points.a = colours->a;
+        points.b = colours->b;
+        points.numPoints = numPixels;
+        points.weights = new unsigned int[numPixels];
         #pragma omp parallel for
-        for (long long j = 0; j < numPixels; j++)
-        {
-            ColourOkLabA col = colours[j];
-            if (col.A < ftThres) //Ignore 'transparent' colours
-            {
-                probs[j] = 0.0;
-                continue;
-            }
-            float lowestDistance = 999999999999999999999999.9;
-            for (int k = 0; k < totalSamples; k++)
-            {
-                const ColourOkLabA incol = csamples[k];
-                const float dL = (col.L - incol.L) * uvbias;
-                const float da = col.a - incol.a;
-                const float db = col.b - incol.b;
-                const float dist = (dL * dL) + (da * da) + (db * db);
-                if (dist < lowestDistance)
-                {
-                    lowestDistance = dist;
-                }
-            }
-            #pragma omp atomic update
-            cost += (double)lowestDistance;
-            probs[j] = (double)lowestDistance;
-        }
-        double probmod = ((double)sampPerIter)/cost;
-        double cumProb = 0.0; //hee hee
-        for (long long j = 0; j < numPixels; j++)
-        {
-            cumProb += probmod * probs[j];
-            probs[j] = cumProb;
-        }
-        //Pick samples
-        #pragma omp parallel for
-        for (int j = 0; j < sampPerIter; j++)
+        for (long long i = 0; i < numPixels; i++)
         {
-            double p = ((RNGUpdateDouble() * 0.5) + 0.5) * cumProb;
-            long long ind = numPixels/2;
-            long long lBound = 0;
-            long long uBound = numPixels - 1;
-            while (ind != lBound || ind != uBound)
-            {
-                if (p < probs[ind])
-                {
-                    uBound = ind;
-                }
-                else
-                {
-                    lBound = ind + 1;
-                }
-                ind = lBound + ((uBound - lBound)/2);
-            }
-            csamples[totalSamples] = colours[ind];
-            totalSamples++;
+            points.weights[i] = (colours->A[i] < ftThres) ? 0 : 1; //Ignore 'transparent' colours
         }
     }
-    //Weight the points
-    long long* weights = (long long*)calloc(totalSamples, sizeof(long long));
-    for (long long i = 0; i < numPixels; i++)
+    else
     {
-        ColourOkLabA col = colours[i];
-        if (col.A < ftThres) continue; //Ignore 'transparent' colours
-        float lowestDistance = 999999999999999999999999.9;
-        int chosenColour = 0;
-        for (int j = 0; j < totalSamples; j++)
-        {
-            const ColourOkLabA incol = csamples[j];
-            const float dL = (col.L - incol.L) * uvbias;
-            const float da = col.a - incol.a;
-            const float db = col.b - incol.b;
-            const float dist = (dL * dL) + (da * da) + (db * db);
-            if (dist < lowestDistance)
-            {
-                lowestDistance = dist;
-                chosenColour = j;
-            }
-        }
-        weights[chosenColour]++;
+        GetWeightedKMeansPoints(&points, inputMode == KMEANS_BUCKETED, bright, contrast);
     }
-    //Recluster according to k-means++
-    KMean* initM = &means[0];
-    rnum = RNGUpdate() % totalSamples;
-    initM->mean = csamples[rnum];
-    for (int i = 1; i < numColours; i++)
+
+    //Find the range of the image
+    float imgMaxL = 0.0f;
+    float imgMinL = 1.0f;
+    float imgMaxC = 0.0f;
+    #pragma omp parallel for reduction(min:imgMinL) reduction(max:imgMaxL,imgMaxC)
+    for (long long i = 0; i < points.numPoints; i++)
     {
-        //Cost calculation
-        double cost = 0.0;
-        for (int j = 0; j < totalSamples; j++)
-        {
-            ColourOkLabA col = csamples[j];
-            if (col.A < ftThres) //Ignore 'transparent' colours
-            {
-                probs[j] = 0.0;
-                continue;
-            }
-            float lowestDistance = 999999999999999999999999.9;
-            for (int k = 0; k < i; k++)
-            {
-                const ColourOkLabA incol = means[k].mean;
-                const float dL = (col.L - incol.L) * uvbias;
-                const float da = col.a - incol.a;
-                const float db = col.b - incol.b;
-                const float dist = (dL * dL) + (da * da) + (db * db);
-                if (dist < lowestDistance)
-                {
-                    lowestDistance = dist;
-                }
-            }
-            cost += (double)lowestDistance;
-            probs[j] = (double)lowestDistance;
-        }
-        double probmod = ((double)sampPerIter)/cost;
-        double cumProb = 0.0; //hee hee
-        for (long long j = 0; j < totalSamples; j++)
-        {
-            cumProb += probmod * probs[j] * ((double)weights[j]);
-            probs[j] = cumProb;
-        }
-        double p = ((RNGUpdateDouble() * 0.5) + 0.5) * cumProb;
-        int ind = totalSamples/2;
-        int lBound = 0;
-        int uBound = totalSamples - 1;
-        while (ind != lBound || ind != uBound)
-        {
-            if (p < probs[ind])
-            {
-                uBound = ind;
-            }
-            else
-            {
-                lBound = ind + 1;
-            }
-            ind = lBound + ((uBound - lBound)/2);
-        }
-        means[i].mean = csamples[ind];
+        float L = points.L[i];
+        if (L < imgMinL) imgMinL = L; if (L > imgMaxL) imgMaxL = L;
+        float sat = hypotf(points.a[i], points.b[i]);
+        if (sat > imgMaxC) imgMaxC = sat;
     }
 
-    delete[] probs;
-    free(weights);
-    delete[] csamples;
-
-    //Iterate the means
-    int iterationsLeft = 100 + numColours;
-    while (iterationsLeft > 0)
+    ColourOkLabA means[256];
+    std::mt19937_64 paletteRng(paletteSeed);
+    if (paletteQuantizer != QUANTIZER_KMEANS)
     {
-        //Zero out sums and counts
-        for (int i = 0; i < numColours; i++)
-        {
-            KMean* m = &means[i];
-            m->lastmean = m->mean;
-            m->numInCluster = 0;
-            m->sumL = 0.0; m->suma = 0.0; m->sumb = 0.0;
-        }
-
-        //Associate each colour with the closest mean
-        #pragma omp parallel for
-        for (long long i = 0; i < numPixels; i++)
-        {
-            ColourOkLabA col = colours[i];
-            if (col.A < ftThres) continue; //Ignore 'transparent' colours
-            float lowestDistance = 999999999999999999999999.9;
-            int chosenColour = 0;
-            for (int j = 0; j < numColours; j++)
-            {
-                const ColourOkLabA incol = means[j].mean;
-                const float dL = (col.L - incol.L) * uvbias;
-                const float da = col.a - incol.a;
-                const float db = col.b - incol.b;
-                const float dist = (dL * dL) + (da * da) + (db * db);
-                if (dist < lowestDistance)
-                {
-                    lowestDistance = dist;
-                    chosenColour = j;
-                }
-            }
-            KMean* m = &means[chosenColour];
-            #pragma omp atomic update
-            m->sumL += col.L;
-            #pragma omp atomic update
-            m->suma += col.a;
-            #pragma omp atomic update
-            m->sumb += col.b;
-            #pragma omp atomic update
-            m->numInCluster++;
-        }
-
-        //Calculate means
-        double meandiff = 0.0;
-        for (int i = 0; i < numColours; i++)
-        {
-            KMean* m = &means[i];
-            ColourOkLabA meancol;
-            if (m->numInCluster <= 0) //Fallback because of suspected division by zero errors;
-            {
-                meancol.L = (RNGUpdateFloat() * 0.5f) + 0.5f;
-                meancol.a = RNGUpdateFloat() * 0.5f;
-                meancol.b = RNGUpdateFloat() * 0.5f;
-            }
-            else
-            {
-                meancol.L = m->sumL/((double)m->numInCluster);
-                meancol.a = m->suma/((double)m->numInCluster);
-                meancol.b = m->sumb/((double)m->numInCluster);
-            }
-            meancol.A = 1.0f;
-            if (is8BitColour) meancol = RoundTripLabA8bpc(meancol);
-            else meancol = RoundTripLabA4bpc(meancol);
-            m->mean = meancol;
-            const double dL = (((double)m->mean.L) - ((double)m->lastmean.L)) * ((double)uvbias);
-            const double da = ((double)m->mean.a) - ((double)m->lastmean.a);
-            const double db = ((double)m->mean.b) - ((double)m->lastmean.b);
-            const double dist = (dL * dL) + (da * da) + (db * db);
-            meandiff += sqrt(dist);
-        }
-        if (meandiff == 0.0) iterationsLeft = 0; //Break out if convergence has been reached
-        iterationsLeft--;
+        RunQuantizer(paletteQuantizer, &points, means, numColours, uvbias);
+        if (quantizerSeedsKMeans) IterateKMeans(&points, means, numColours, uvbias, is8BitColour, paletteRng);
+    }
+    else if (samplePixels)
+    {
+        RunMiniBatchKMeansOnPixels(means, uvbias, bright, contrast, paletteRng);
+        if (kMeansRefine) IterateKMeans(&points, means, numColours, uvbias, is8BitColour, paletteRng);
     }
+    else if (kMeansMiniBatch) RunMiniBatchKMeans(&points, means, numColours, uvbias, is8BitColour, paletteRng, kMeansBatchSize, kMeansRefine);
+    else RunKMeans(&points, means, numColours, uvbias, is8BitColour, paletteRng);
+    if (inputMode == KMEANS_PIXELS) delete[] points.weights;
+    else FreeKMeansPoints(&points);
 
     //Adjust colours to prevent low dynamic range when the number of colours is low
     float meanMaxL = 0.0f;
@@ -998,7 +894,7 @@ bool ImageHandler::GetBestPalette(float uvbias, float bright, float contrast)
     float meanMaxC = 0.0f;
     for (int i = 0; i < numColours; i++)
     {
-        ColourOkLabA meancol = means[i].mean;
+        ColourOkLabA meancol = means[i];
         if (meancol.L < meanMinL) meanMinL = meancol.L; if (meancol.L > meanMaxL) meanMaxL = meancol.L;
         float sat = hypotf(meancol.a, meancol.b);
         if (sat > meanMaxC) meanMaxC = sat;
@@ -1008,13 +904,13 @@ bool ImageHandler::GetBestPalette(float uvbias, float bright, float contrast)
     float CRatio = imgMaxC/meanMaxC;
     for (int i = 0; i < numColours; i++)
     {
-        ColourOkLabA meancol = means[i].mean;
+        ColourOkLabA meancol = means[i];
         float normL = (meancol.L - meanMinL)/meanLRange;
         meancol.L = normL * imgLRange + imgMinL;
         meancol.a *= CRatio;
         meancol.b *= CRatio;
-        if (is8BitColour) means[i].mean = RoundTripLabA8bpc(meancol);
-        else means[i].mean = RoundTripLabA4bpc(meancol);
+        if (is8BitColour) means[i] = RoundTripLabA8bpc(meancol);
+        else means[i] = RoundTripLabA4bpc(meancol);
     }
 
     //Confirm colours
@@ -1022,7 +918,7 @@ bool ImageHandler::GetBestPalette(float uvbias, float bright, float contrast)
     {
         for (int i = 0; i < numColours; i++)
         {
-            ColourOkLabA incol = means[i].mean;
+            ColourOkLabA incol = means[i];
             ColourRGBA midcol = OkLabToSRGB(incol);
             palette[i] = LinearFloatToSRGB8(midcol);
         }
@@ -1031,7 +927,7 @@ bool ImageHandler::GetBestPalette(float uvbias, float bright, float contrast)
     {
         for (int i = 0; i < numColours; i++)
         {
-            ColourOkLabA incol = means[i].mean;
+            ColourOkLabA incol = means[i];
             ColourRGBA midcol = OkLabToSRGB(incol);
             palette[i] = LinearFloatToSRGB4(midcol);
         }
@@ -1039,40 +935,38 @@ bool ImageHandler::GetBestPalette(float uvbias, float bright, float contrast)
 
     GetLabPaletteFromRGBA8Palette();
 
-    delete[] colours;
-
     return false;
 }
 
 void ImageHandler::ShufflePaletteBasedOnOccurrence()
 {
-    int w = encImage.width;
-    int h = encImage.height;
+    int w = encIndexed.width;
+    int h = encIndexed.height;
     long long imgsize = ((long long)w) * ((long long)h);
-    uint32_t* pixels = (uint32_t*)encImage.data;
+    const unsigned char* indices = encIndexed.indices;
+    const bool transparency = (planeMask & 0x0100) > 0; //Otherwise transparent pixels come out as colour 0, so they count towards it
     uint32_t* pal = (uint32_t*)palette;
-    int occurrence[256];
+    long long occurrence[256];
     memset(occurrence, 0, sizeof(occurrence));
-    for (long long i = 0; i < imgsize; i++)
+    #pragma omp parallel for reduction(+:occurrence[:256])
+    for (long long i = 0; i < h; i++)
     {
-        uint32_t pix = pixels[i];
-        for (int j = 0; j < numColours; j++)
+        for (long long j = 0; j < w; j++)
         {
-            if (pix == pal[j])
-            {
-                occurrence[j]++;
-            }
+            if (!transparency || IsIndexedPixelOpaque(&encIndexed, j, i)) occurrence[indices[i * w + j]]++;
         }
     }
     uint32_t tempPal[256];
+    unsigned char order[256]; //Which old index ends up at each new one
     memcpy(tempPal, pal, sizeof(tempPal));
+    for (int i = 0; i < 256; i++) order[i] = (unsigned char)i;
     for (int i = 0; i < numColours-1; i++)
     {
-        int highestOcc = occurrence[i];
+        long long highestOcc = occurrence[i];
         int chosenColour = i;
         for (int j = i + 1; j < numColours; j++)
         {
-            int occ = occurrence[j];
+            long long occ = occurrence[j];
             if (occ > highestOcc)
             {
                 highestOcc = occ;
@@ -1083,9 +977,42 @@ void ImageHandler::ShufflePaletteBasedOnOccurrence()
         uint32_t swapColour = tempPal[chosenColour];
         tempPal[chosenColour] = currentColour;
         tempPal[i] = swapColour;
+        unsigned char currentOrder = order[i];
+        order[i] = order[chosenColour];
+        order[chosenColour] = currentOrder;
     }
     memcpy(pal, tempPal, sizeof(tempPal));
     GetLabPaletteFromRGBA8Palette();
+
+    //The colours haven't changed, so the preview stays as it is, but the indices have to follow them
+    unsigned char remap[256];
+    for (int i = 0; i < 256; i++) remap[order[i]] = (unsigned char)i;
+    #pragma omp parallel for
+    for (long long i = 0; i < imgsize; i++)
+    {
+        encIndexed.indices[i] = remap[indices[i]];
+    }
+}
+
+//Each line is a whole number of bytes, so lines can be done in parallel
+static void GetOpaqueBits(const ColourRGBA8* pixels, int w, int h, unsigned int alphaThreshold, unsigned char* opaque, int stride)
+{
+    #pragma omp parallel for
+    for (long long i = 0; i < h; i++)
+    {
+        const ColourRGBA8* line = pixels + i * w;
+        unsigned char* bits = opaque + i * stride;
+        for (int j = 0; j < w; j += 8)
+        {
+            const int n = (w - j < 8) ? (w - j) : 8;
+            unsigned char byte = 0;
+            for (int k = 0; k < n; k++)
+            {
+                byte |= (line[j + k].A >= alphaThreshold) << (7 - k);
+            }
+            bits[j >> 3] = byte;
+        }
+    }
 }
 
 void ImageHandler::DitherImage()
@@ -1095,13 +1022,10 @@ void ImageHandler::DitherImage()
 
 void ImageHandler::DitherImage(int ditherMethod, double ditAmtL, double ditAmtS, double ditAmtH, double ditAmtEL, double ditAmtEC, double rngAmtL, double rngAmtC, double cbias, double preB, double preC, double postB, double postC, bool globBoustro)
 {
-    ColourRGBA8 (ImageHandler::*odfunc)(ColourOkLabA, int, int, float, float, float, float, float, float);
-    ColourRGBA8 (ImageHandler::*eddfunc)(ColourOkLabA, int, int, int, float, float, float, float, float, ColourOkLabA*, int, float, float);
-    int eddMarginX, eddMarginY;
     int w = srcImage.width;
     int h = srcImage.height;
     ColourRGBA8* pixels = srcImage.data;
-    ColourRGBA8* outpix = encImage.data;
+    unsigned char* outIndices = encIndexed.indices;
     int tThres = transparencyThreshold;
     if (tThres < 0) tThres = 0;
     else if (tThres > 0xFF) tThres = 0xFF;
@@ -1112,313 +1036,140 @@ void ImageHandler::DitherImage(int ditherMethod, double ditAmtL, double ditAmtS,
         zeroCol.R = 0; zeroCol.G = 0; zeroCol.B = 0; zeroCol.A = 0;
     }
     else zeroCol = palette[0]; //No mask plane -> fill 'transparent' colours with colour 0
-
-    //Select function and set parameters
-    switch (ditherMethod)
-    {
-        case NODITHER:
-            for (long long i = 0; i < h; i++)
-            {
-                for (long long j = 0; j < w; j++)
-                {
-                    const long long index = i * w + j;
-                    ColourRGBA8 pixcol = pixels[index];
-                    if (pixcol.A < transT)
-                    {
-                        outpix[index] = zeroCol;
-                        continue;
-                    }
-                    ColourOkLabA incol = SRGBToOkLab(SRGB8ToLinearFloat(pixcol));
-                    incol = ColourAdjust(incol, preB, preC);
-                    outpix[index] = GetClosestColourOkLab(incol, postB, postC, cbias);
-                }
-            }
-            return;
-        case BAYER2X2:
-            odfunc = &ImageHandler::OrderedDitherBayer2x2; break;
-        case BAYER4X4:
-            odfunc = &ImageHandler::OrderedDitherBayer4x4; break;
-        case BAYER8X8:
-            odfunc = &ImageHandler::OrderedDitherBayer8x8; break;
-        case BAYER16X16:
-            odfunc = &ImageHandler::OrderedDitherBayer16x16; break;
-        case VOID16X16:
-            odfunc = &ImageHandler::OrderedDitherVoid16x16; break;
-        case FLOYD_STEINBERG:
-            eddfunc = &ImageHandler::DitherFloydSteinberg;
-            eddMarginX = 1; eddMarginY = 1;
-            break;
-        case FLOYD_FALSE:
-            eddfunc = &ImageHandler::DitherFloydFalse;
-            eddMarginX = 1; eddMarginY = 1;
-            break;
-        case JJN:
-            eddfunc = &ImageHandler::DitherJJN;
-            eddMarginX = 2; eddMarginY = 2;
-            break;
-        case STUCKI:
-            eddfunc = &ImageHandler::DitherStucki;
-            eddMarginX = 2; eddMarginY = 2;
-            break;
-        case BURKES:
-            eddfunc = &ImageHandler::DitherBurkes;
-            eddMarginX = 2; eddMarginY = 1;
-            break;
-        case SIERRA:
-            eddfunc = &ImageHandler::DitherSierra;
-            eddMarginX = 2; eddMarginY = 2;
-            break;
-        case SIERRA2ROW:
-            eddfunc = &ImageHandler::DitherSierra2Row;
-            eddMarginX = 2; eddMarginY = 1;
-            break;
-        case FILTERLITE:
-            eddfunc = &ImageHandler::DitherFilterLite;
-            eddMarginX = 1; eddMarginY = 1;
-            break;
-        case ATKINSON:
-            eddfunc = &ImageHandler::DitherAtkinson;
-            eddMarginX = 2; eddMarginY = 2;
-            break;
-    }
-
-    //Carry out operation
-    if (ditherMethod < FLOYD_STEINBERG) //Ordered dithering
+    GetOpaqueBits(pixels, w, h, transT, encIndexed.opaque, encIndexed.opaqueStride);
+    if (ditherMethod == NODITHER) //Only depends on the source colour, so doesn't need the working buffer
     {
+        if (!inverseMap->IsBuiltFor(preB, preC, postB, postC, cbias)) inverseMap->Reset(labPalette, numColours, preB, preC, postB, postC, cbias);
+        const long long numPixels = ((long long)w) * h;
+        inverseMap->Prepare(pixels, numPixels, transT);
         #pragma omp parallel for
-        for (long long i = 0; i < h; i++)
+        for (long long i = 0; i < numPixels; i++)
         {
-            for (long long j = 0; j < w; j++)
-            {
-                const long long index = i * w + j;
-                ColourRGBA8 pixcol = pixels[index];
-                if (pixcol.A < transT)
-                {
-                    outpix[index] = zeroCol;
-                    continue;
-                }
-                ColourOkLabA incol = SRGBToOkLab(SRGB8ToLinearFloat(pixcol));
-                incol = ColourAdjust(incol, preB, preC);
-                outpix[index] = (this->*odfunc)(incol, j, i, ditAmtL, ditAmtS, ditAmtH, postB, postC, cbias);
-            }
+            ColourRGBA8 pixcol = pixels[i];
+            outIndices[i] = (pixcol.A < transT) ? 0 : (unsigned char)inverseMap->Lookup(pixcol);
         }
+        UpdateEncodedImage(zeroCol);
+        return;
     }
-    else //Error diffusion
-    {
-        int ew = w + 2*EDD_EXPAND_X;
-        int eh = h + EDD_EXPAND_Y_TOP + EDD_EXPAND_Y_BOTTOM; //Expand image to ease in error diffusion
-        ColourRGBA8* expandedInput = new ColourRGBA8[ew * eh];
-        ColourOkLabA* diffusedError = (ColourOkLabA*)calloc(ew * eh, sizeof(ColourOkLabA));
-
-        long long firstLine;
-        long long lastLine;
-        for (long long i = 0; i < h; i++) //Find first line with non-transparent colours
-        {
-            bool foundLine = false;
-            for (long long j = 0; j < w; j++)
-            {
-                const long long index = i * w + j;
-                if (pixels[index].A < transT)
-                {
-                    continue;
-                }
-                else
-                {
-                    foundLine = true;
-                    break;
-                }
-            }
-            if (foundLine)
-            {
-                firstLine = i;
-                break;
-            }
-        }
-        lastLine = firstLine;
-        for (long long i = firstLine + 1; i < h; i++) //Find last line with non-transparent colours
-        {
-            bool foundLine = false;
-            for (long long j = 0; j < w; j++)
-            {
-                const long long index = i * w + j;
-                if (pixels[index].A < transT)
-                {
-                    continue;
-                }
-                else
-                {
-                    foundLine = true;
-                    break;
-                }
-            }
-            if (foundLine)
-            {
-                lastLine = i;
-            }
-        }
+    const OkLabBuffer* labImage = GetOkLabBuffer(&ditherLab, preB, preC, false);
+    UpdatePaletteIndex(postB, postC, cbias);
 
-        long long topBlendLine = firstLine;
-        long long bottomBlendLine = firstLine;
-        for (long long i = firstLine; i <= lastLine; i++) //Iterate clamping algorithm over all lines with non-transparent colours
+    //Carry out operation
+    if (ditherMethod < FLOYD_STEINBERG) //Ordered dithering
+    {
+        OrderedDitherPattern pattern;
+        if (ditherMethod != CUSTOMMATRIX) pattern = orderedPatterns[ditherMethod - BAYER2X2];
+        else if (thresholdMatrices != nullptr) pattern = GetThresholdMatrixSetPattern(thresholdMatrices);
+        else pattern = orderedPatterns[VOID16X16 - BAYER2X2]; //Nothing loaded yet
+        OrderedDitherTables* tables = new OrderedDitherTables;
+        BuildOrderedDitherTables(tables, &pattern, ditAmtL, ditAmtS, ditAmtH);
+        const int period = tables->period; //The output only depends on the colour and the position modulo this
+
+        //Shared memo of (colour, matrix cell) -> palette index, which pays off on sources with few colours
+        //Each slot is one 64 bit word holding both the key and the answer, so a racing overwrite can only lose an entry
+        //Whichever thread fills a slot gets the same answer, as the conversion and dither kernels are bit-identical wherever a pixel falls in a row
+        unsigned long long* memo = orderedMemo ? (unsigned long long*)calloc(1 << ORDERED_MEMO_BITS, sizeof(unsigned long long)) : nullptr;
+        long long hits = 0;
+        long long misses = 0;
+        #pragma omp parallel reduction(+:hits,misses)
         {
-            int lineState = 0;
-            long long outLine = i + EDD_EXPAND_Y_TOP;
-            long long leftPix = 0;
-            for (long long j = 0; j < w; j++)
+            float* rowL = new float[3 * w];
+            float* rowa = rowL + w;
+            float* rowb = rowa + w;
+            #pragma omp for
+            for (long long i = 0; i < h; i++)
             {
-                const long long index = i * w + j;
-                ColourRGBA8 pixcol = pixels[index];
-                if (pixcol.A < transT)
-                {
-                    switch (lineState)
-                    {
-                        case 0: //In left edge, searching for right pixel
-                            break;
-                        case 1: //In non-transparent, searching for left pixel
-                            leftPix = j - 1;
-                            lineState = 2;
-                            break;
-                        case 2: //In transparent, searching for right pixel
-                            break;
-                    }
-                }
-                else
+                OrderedDitherRow(tables, i, labImage->L + i * w, labImage->a + i * w, labImage->b + i * w, w, rowL, rowa, rowb);
+                const unsigned int rowCell = (unsigned int)(i % period) * period;
+                for (long long j = 0, column = 0; j < w; j++, column = (column + 1 == period) ? 0 : column + 1)
                 {
-                    switch (lineState)
+                    const long long index = i * w + j;
+                    ColourRGBA8 pixcol = pixels[index];
+                    if (pixcol.A < transT)
                     {
-                        case 0: //In left edge, searching for right pixel
-                            pixcol.A = 0x00; //Force full transparency
-                            for (long long k = 0; k < j + EDD_EXPAND_X; k++) //Clamp to left edge
-                            {
-                                expandedInput[outLine * ew + k] = pixcol;
-                            }
-                            lineState = 1;
-                        case 1: //In non-transparent, searching for left pixel
-                            pixcol.A = 0xFF; //Force full opacity
-                            expandedInput[outLine * ew + j + EDD_EXPAND_X] = pixcol;
-                            break;
-                        case 2: //In transparent, searching for right pixel
-                        {
-                            ColourRGBA8 leftCol = pixels[i * w + leftPix];
-                            pixcol.A = 0x00; //Force full transparency
-                            leftCol.A = 0x00; //Force full transparency
-                            for (long long k = leftPix + 1; k < j; k++) //Blend between sides
-                            {
-                                expandedInput[outLine * ew + k + EDD_EXPAND_X] = BlendSRGB8(leftCol, pixcol, (((float)k) - ((float)leftPix))/(((float)j) - ((float)leftPix)));
-                            }
-                        }
-                            pixcol.A = 0xFF; //Force full opacity
-                            expandedInput[outLine * ew + j + EDD_EXPAND_X] = pixcol;
-                            lineState = 1;
-                            break;
+                        outIndices[index] = 0;
+                        continue;
                     }
-                }
-            }
-            switch (lineState)
-            {
-                case 0: //In left edge, searching for right pixel -> all transparent line
-                    continue;
-                case 1: //In non-transparent, searching for left pixel -> clamp to right edge
-                    leftPix = w - 1;
-                case 2: //In transparent, searching for right pixel -> clamp to right edge
-                {
-                    ColourRGBA8 leftCol = pixels[i * w + leftPix];
-                    leftCol.A = 0x00; //Force full transparency
-                    for (long long k = leftPix + 1; k < w; k++)
+                    if (memo == nullptr)
                     {
-                        expandedInput[outLine * ew + k + EDD_EXPAND_X] = leftCol;
+                        outIndices[index] = (unsigned char)GetClosestColourIndexOkLab({ rowL[j], rowa[j], rowb[j], 1.0f });
+                        continue;
                     }
-                }
-                    bottomBlendLine = i;
-                    break;
-            }
-            if (bottomBlendLine - 1 > topBlendLine) //Blend between non-transparent lines
-            {
-                ColourRGBA8* tPtr = &expandedInput[(topBlendLine + EDD_EXPAND_Y_TOP) * ew];
-                ColourRGBA8* bPtr = &expandedInput[(bottomBlendLine + EDD_EXPAND_Y_TOP) * ew];
-                for (long long j = topBlendLine + 1; j < bottomBlendLine; j++)
-                {
-                    float blendFac = (((float)j) - ((float)topBlendLine))/(((float)bottomBlendLine) - ((float)topBlendLine));
-                    for (long long k = 0; k < ew; k++)
+                    const unsigned int cell = rowCell + (unsigned int)column;
+                    const unsigned long long key = (((unsigned long long)pixcol.R << 16) | ((unsigned long long)pixcol.G << 8) | pixcol.B) << ORDERED_CELL_BITS | cell;
+                    unsigned long long* slot = &memo[(key * 0x9E3779B97F4A7C15ULL) >> (64 - ORDERED_MEMO_BITS)];
+                    unsigned long long entry;
+                    #pragma omp atomic read
+                    entry = *slot;
+                    if ((entry >> ORDERED_MEMO_KEY_SHIFT) == key && (entry & ORDERED_MEMO_VALID))
                     {
-                        ColourRGBA8 tCol = tPtr[k];
-                        ColourRGBA8 bCol = bPtr[k];
-                        tCol.A = 0x00; //Force full transparency
-                        bCol.A = 0x00; //Force full transparency
-                        expandedInput[(j + EDD_EXPAND_Y_TOP) * ew + k] = BlendSRGB8(tCol, bCol, blendFac);
+                        outIndices[index] = (unsigned char)(entry & 0xFF);
+                        hits++;
+                        continue;
                     }
+                    ColourOkLabA col = { rowL[j], rowa[j], rowb[j], 1.0f };
+                    const int chosen = GetClosestColourIndexOkLab(col);
+                    entry = (key << ORDERED_MEMO_KEY_SHIFT) | ORDERED_MEMO_VALID | (unsigned long long)chosen;
+                    #pragma omp atomic write
+                    *slot = entry;
+                    outIndices[index] = (unsigned char)chosen;
+                    misses++;
                 }
             }
-            topBlendLine = i;
+            delete[] rowL;
         }
-
-        //Vertical clamping
-        ColourRGBA8* rowptr = &expandedInput[(firstLine + EDD_EXPAND_Y_TOP) * ew];
-        for (long long i = 0; i < firstLine + EDD_EXPAND_Y_TOP; i++)
+        delete tables;
+        free(memo);
+        orderedMemoHitRate = (hits + misses) ? ((double)hits)/(hits + misses) : 0.0;
+    }
+    else //Error diffusion
+    {
+        ExpandedRowSource rows;
+        if (!InitExpandedRowSource(&rows, pixels, w, h, transT)) //Nothing opaque to dither
         {
-            for (long long j = 0; j < ew; j++)
-            {
-                ColourRGBA8 rCol = rowptr[j];
-                rCol.A = 0x00; //Force full transparency
-                expandedInput[i * ew + j] = rCol;
-            }
+            memset(outIndices, 0, ((long long)w) * h);
         }
-        rowptr = &expandedInput[(lastLine + EDD_EXPAND_Y_TOP) * ew];
-        for (long long i = lastLine + EDD_EXPAND_Y_TOP + 1; i < eh; i++)
+        else
         {
-            for (long long j = 0; j < ew; j++)
+            ErrorDiffusionSettings settings = { labImage, w, h, (float)preB, (float)preC, (float)ditAmtEL, (float)ditAmtEC, (float)rngAmtL, (float)rngAmtC, rngAmtL != 0.0 || rngAmtC != 0.0, nullptr };
+            switch (ditherMethod)
             {
-                ColourRGBA8 rCol = rowptr[j];
-                rCol.A = 0x00; //Force full transparency
-                expandedInput[i * ew + j] = rCol;
+                case FLOYD_STEINBERG: DiffuseError<FloydSteinbergKernel>(&settings, &rows, outIndices, globBoustro); break;
+                case FLOYD_FALSE: DiffuseError<FloydFalseKernel>(&settings, &rows, outIndices, globBoustro); break;
+                case JJN: DiffuseError<JJNKernel>(&settings, &rows, outIndices, globBoustro); break;
+                case STUCKI: DiffuseError<StuckiKernel>(&settings, &rows, outIndices, globBoustro); break;
+                case BURKES: DiffuseError<BurkesKernel>(&settings, &rows, outIndices, globBoustro); break;
+                case SIERRA: DiffuseError<SierraKernel>(&settings, &rows, outIndices, globBoustro); break;
+                case SIERRA2ROW: DiffuseError<Sierra2RowKernel>(&settings, &rows, outIndices, globBoustro); break;
+                case FILTERLITE: DiffuseError<FilterLiteKernel>(&settings, &rows, outIndices, globBoustro); break;
+                case ATKINSON: DiffuseError<AtkinsonKernel>(&settings, &rows, outIndices, globBoustro); break;
             }
         }
+        FreeExpandedRowSource(&rows);
+    }
+    UpdateEncodedImage(zeroCol);
+}
 
-        for (long long i = 0; i < eh-eddMarginY; i++)
+//Fills in the preview from the palette indices
+void ImageHandler::UpdateEncodedImage(ColourRGBA8 zeroCol)
+{
+    const int w = encIndexed.width;
+    const int h = encIndexed.height;
+    #pragma omp parallel for
+    for (long long i = 0; i < h; i++)
+    {
+        const unsigned char* indices = encIndexed.indices + i * w;
+        const unsigned char* bits = encIndexed.opaque + i * encIndexed.opaqueStride;
+        ColourRGBA8* line = encImage.data + i * w;
+        for (int j = 0; j < w; j += 8)
         {
-            const int boustro = i % 2;
-            if (globBoustro && boustro)
+            const int n = (w - j < 8) ? (w - j) : 8;
+            const unsigned char byte = bits[j >> 3];
+            for (int k = 0; k < n; k++)
             {
-                for (long long j = ew-1-eddMarginX; j >= eddMarginX; j--)
-                {
-                    const long long index = i * ew + j;
-                    ColourRGBA8 pixcol = expandedInput[index];
-                    ColourOkLabA incol = SRGBToOkLab(SRGB8ToLinearFloat(pixcol));
-                    incol = ColourAdjust(incol, preB, preC);
-                    ColourRGBA8 outcol = (this->*eddfunc)(incol, j, i, ew, ditAmtEL, ditAmtEC, postB, postC, cbias, diffusedError, -1, rngAmtL, rngAmtC);
-                    if (pixcol.A < 0.5f)
-                    {
-                        expandedInput[index] = zeroCol;
-                        continue;
-                    }
-                    else expandedInput[index] = outcol;
-                }
-            }
-            else
-            {
-                for (long long j = eddMarginX; j < ew-eddMarginX; j++)
-                {
-                    const long long index = i * ew + j;
-                    ColourRGBA8 pixcol = expandedInput[index];
-                    ColourOkLabA incol = SRGBToOkLab(SRGB8ToLinearFloat(pixcol));
-                    incol = ColourAdjust(incol, preB, preC);
-                    ColourRGBA8 outcol = (this->*eddfunc)(incol, j, i, ew, ditAmtEL, ditAmtEC, postB, postC, cbias, diffusedError, 1, rngAmtL, rngAmtC);
-                    if (pixcol.A < 0.5f)
-                    {
-                        expandedInput[index] = zeroCol;
-                        continue;
-                    }
-                    else expandedInput[index] = outcol;
-                }
+                line[j + k] = ((byte << k) & 0x80) ? palette[indices[j + k]] : zeroCol;
             }
         }
-        //Copy back
-        for (int i = 0; i < h; i++)
-        {
-            memcpy(&outpix[i * w], &expandedInput[(i + EDD_EXPAND_Y_TOP) * ew + EDD_EXPAND_X], w * sizeof(ColourRGBA8));
-        }
-        free(diffusedError);
-        delete[] expandedInput;
     }
 }
 
@@ -1430,6 +1181,7 @@ PlanarInfo ImageHandler::GeneratePlanarData()
     {
         puts("Too many colours!!");
         outinf.planeData = nullptr;
+        outinf.planeSlab = nullptr;
         return outinf;
     }
 
@@ -1437,16 +1189,15 @@ PlanarInfo ImageHandler::GeneratePlanarData()
     outinf.is8BitColour = is8BitColour;
     outinf.numColours = 1 << numColourPlanes;
     outinf.planeMask = planeMask;
+    outinf.planeSlab = nullptr;
     outinf.numPlanes = numColourPlanes;
     if (transparency) outinf.numPlanes++;
 
-    //Convert to indexed colour representation
-    int w = encImage.width;
-    int h = encImage.height;
-    long long imgsize = ((long long)w) * ((long long)h);
+    //DitherImage has already chosen the palette index of every pixel
+    int w = encIndexed.width;
+    int h = encIndexed.height;
     int scw, sch;
     int tMajor, tMinor;
-    int strideMajor, strideMinor;
     int finalW, finalH;
     if (isTiled)
     {
@@ -1455,14 +1206,10 @@ PlanarInfo ImageHandler::GeneratePlanarData()
         switch (tileOrdering)
         {
             case ROWMAJOR:
-                strideMinor = scw;
-                strideMajor = w * sch;
                 tMinor = ((w + (scw - 1))/scw);
                 tMajor = ((h + (sch - 1))/sch);
                 break;
             case COLUMNMAJOR:
-                strideMinor = w * sch;
-                strideMajor = scw;
                 tMinor = ((h + (sch - 1))/sch);
                 tMajor = ((w + (scw - 1))/scw);
                 break;
@@ -1480,8 +1227,6 @@ PlanarInfo ImageHandler::GeneratePlanarData()
         outinf.numTiles = 1;
         tMajor = 1;
         tMinor = 1;
-        strideMinor = w * h;
-        strideMajor = w * h;
         finalH = h;
         finalW = w;
     }
@@ -1491,611 +1236,563 @@ PlanarInfo ImageHandler::GeneratePlanarData()
     outinf.planew = pwidth;
     outinf.planeh = sch;
     outinf.planeSize = psize;
-    short* indices = new short[imgsize];
-    uint32_t* img = (uint32_t*)encImage.data;
-    uint32_t* pal = (uint32_t*)palette;
-    int nc = outinf.numColours;
-    for (int i = 0; i < imgsize; i++)
-    {
-        uint32_t pix = img[i];
-        bool foundcol = false;
-        for (int j = 0; j < nc; j++)
-        {
-            if (pix == pal[j])
-            {
-                indices[i] = j;
-                foundcol = true;
-                break;
-            }
-        }
-        if (!foundcol)
-        {
-            if (transparency) indices[i] = -1;
-            else indices[i] = 0;
-        }
-    }
+    const unsigned char* indices = encIndexed.indices;
 
-    //Make planar data
+    //All the planes go in one zeroed slab, each starting on a cache line
     unsigned char** pData = new unsigned char*[outinf.numPlanes];
     outinf.planeData = pData;
-    int splane = 0;
+    outinf.planeStride = (((long long)psize) + (PLANAR_ALIGN - 1)) & ~((long long)(PLANAR_ALIGN - 1));
+    outinf.planeSlab = (unsigned char*)calloc(outinf.planeStride * outinf.numPlanes + (PLANAR_ALIGN - 1), 1);
+    unsigned char* firstPlane = (unsigned char*)((((uintptr_t)outinf.planeSlab) + (PLANAR_ALIGN - 1)) & ~((uintptr_t)(PLANAR_ALIGN - 1)));
     for (int i = 0; i < outinf.numPlanes; i++)
     {
-        pData[i] = (unsigned char*)calloc(psize, 1);
+        pData[i] = firstPlane + i * outinf.planeStride;
     }
-    if (transparency) //Generate mask plane
+
+    //Make planar data, all the planes of a line of a tile at once
+    //Every line of every tile goes to its own bytes of each plane, so they're shared out between threads in the order they're stored
+    const int splane = transparency ? 1 : 0;
+    const bool columnMajor = isTiled && (tileOrdering == COLUMNMAJOR);
+    const int tilesX = columnMajor ? tMajor : tMinor;
+    const int tilesY = columnMajor ? tMinor : tMajor;
+    const int numTiles = outinf.numTiles;
+    #pragma omp parallel for collapse(2) schedule(static)
+    for (int tile = 0; tile < numTiles; tile++)
     {
-        splane++;
-        unsigned char* curPlane = pData[0];
-        for (int i = 0; i < tMajor; i++)
+        for (int k = 0; k < sch; k++)
         {
-            for (int j = 0; j < tMinor; j++)
+            const int tMaj = tile / tMinor;
+            const int tMin = tile % tMinor;
+            const int tx = columnMajor ? tMaj : tMin;
+            const int ty = columnMajor ? tMin : tMaj;
+            const int maxy = (ty == tilesY - 1) ? finalH : sch;
+            if (k >= maxy) continue; //Past the bottom of the image, so left as 0
+            const int maxx = (tx == tilesX - 1) ? finalW : scw;
+            const int tileX = tx * scw;
+            const long long y = ((long long)ty) * sch + k;
+            const long long lineOffset = ((long long)tile) * tsize + k * pwidth;
+            const unsigned char* mask = nullptr;
+            if (transparency) //Generate mask plane, which transparent pixels' colour bits are then cleared with
             {
-                short* tileIndices = indices + i * strideMajor + j * strideMinor;
-                int maxx, maxy;
-                switch (tileOrdering)
-                {
-                    case ROWMAJOR:
-                        if (j == (tMinor - 1))
-                        {
-                            maxx = finalW;
-                        }
-                        else maxx = scw;
-                        if (i == (tMajor - 1))
-                        {
-                            maxy = finalH;
-                        }
-                        else maxy = sch;
-                        break;
-                    case COLUMNMAJOR:
-                        if (j == (tMinor - 1))
-                        {
-                            maxy = finalH;
-                        }
-                        else maxy = sch;
-                        if (i == (tMajor - 1))
-                        {
-                            maxx = finalW;
-                        }
-                        else maxx = scw;
-                        break;
-                }
-                for (int k = 0; k < maxy; k++)
-                {
-                    for (int n = 0; n < maxx; n++)
-                    {
-                        short ind = tileIndices[k * w + n];
-                        if (ind >= 0) curPlane[(i * tMinor + j) * tsize + k * pwidth + (n >> 3)] |= (0x01 << (7 - (n & 0x7)));
-                    }
-                }
+                CopyBitRow(encIndexed.opaque + y * encIndexed.opaqueStride, tileX, maxx, pData[0] + lineOffset);
+                mask = pData[0] + lineOffset;
             }
-        }
-    }
-
-    for (int i = splane; i < outinf.numPlanes; i++)
-    {
-        unsigned char* curPlane = pData[i];
-        short curMask = 0x0001 << (i - splane);
-        for (int j = 0; j < tMajor; j++)
-        {
-            for (int k = 0; k < tMinor; k++)
+            unsigned char* linePlanes[8];
+            for (int p = splane; p < outinf.numPlanes; p++)
             {
-                short* tileIndices = indices + j * strideMajor + k * strideMinor;
-                int maxx, maxy;
-                switch (tileOrdering)
-                {
-                    case ROWMAJOR:
-                        if (k == (tMinor - 1))
-                        {
-                            maxx = finalW;
-                        }
-                        else maxx = scw;
-                        if (j == (tMajor - 1))
-                        {
-                            maxy = finalH;
-                        }
-                        else maxy = sch;
-                        break;
-                    case COLUMNMAJOR:
-                        if (k == (tMinor - 1))
-                        {
-                            maxy = finalH;
-                        }
-                        else maxy = sch;
-                        if (j == (tMajor - 1))
-                        {
-                            maxx = finalW;
-                        }
-                        else maxx = scw;
-                        break;
-                }
-                for (int n = 0; n < maxy; n++)
-                {
-                    for (int m = 0; m < maxx; m++)
-                    {
-                        short ind = tileIndices[n * w + m];
-                        if ((ind >= 0) && (ind & curMask))
-                        {
-                            curPlane[(j * tMinor + k) * tsize + n * pwidth + (m >> 3)] |= (0x01 << (7 - (m & 0x7)));
-                        }
-                    }
-                }
+                linePlanes[p - splane] = pData[p] + lineOffset;
             }
+            IndicesToPlanarRow(indices + y * w + tileX, maxx, linePlanes, outinf.numPlanes - splane, mask);
         }
     }
 
-    delete[] indices;
     return outinf;
 }
 
 void ImageHandler::FreePlanarData(PlanarInfo* pinfo)
 {
-    for (int i = 0; i < pinfo->numPlanes; i++)
-    {
-        free(pinfo->planeData[i]);
-    }
+    free(pinfo->planeSlab);
     delete[] pinfo->planeData;
 }
 
 
-void ImageHandler::GetLabPaletteFromRGBA8Palette()
+//Converts in chunks small enough for the temporaries to stay in cache
+#define OKLAB_CHUNK_SIZE 4096
+
+//Converts to OkLab and applies the pre-adjustment, optionally clamping the result back into the sRGB gamut
+//One chunk of at most OKLAB_CHUNK_SIZE pixels
+//The batch kernels are all bit-identical, so the result (and the palette, dither and .gpi built from it) doesn't depend on which one the CPU supports
+static void ConvertChunkToWorkingOkLab(const ColourRGBA8* in, float* L, float* a, float* b, float* A, long long n, float bright, float contrast, bool clampToGamut)
 {
-    minL = 1.0f; maxL = 0.0f;
-    maxC = 0.0f;
-    for (int i = 0; i < numColours; i++)
+    SRGB8ToOkLabBatch(in, L, a, b, A, n);
+    for (long long i = 0; i < n; i++)
     {
-        ColourOkLabA labcol = SRGBToOkLab(SRGB8ToLinearFloat(palette[i]));
-        labPalette[i] = labcol;
-        if (labcol.L < minL) minL = labcol.L; if (labcol.L > maxL) maxL = labcol.L;
-        float sat = hypotf(labcol.a, labcol.b);
-        if (sat > maxC) maxC = sat;
+        ColourOkLabA col = { L[i], a[i], b[i], 1.0f };
+        col = ColourAdjust(col, bright, contrast);
+        L[i] = col.L; a[i] = col.a; b[i] = col.b;
+    }
+    if (clampToGamut)
+    {
+        float R[OKLAB_CHUNK_SIZE];
+        float G[OKLAB_CHUNK_SIZE];
+        float B[OKLAB_CHUNK_SIZE];
+        OkLabToSRGBBatch(L, a, b, R, G, B, n);
+        for (long long i = 0; i < n; i++)
+        {
+            if (R[i] > 1.0f) R[i] = 1.0f; else if (R[i] < 0.0f) R[i] = 0.0f;
+            if (G[i] > 1.0f) G[i] = 1.0f; else if (G[i] < 0.0f) G[i] = 0.0f;
+            if (B[i] > 1.0f) B[i] = 1.0f; else if (B[i] < 0.0f) B[i] = 0.0f;
+        }
+        SRGBToOkLabBatch(R, G, B, L, a, b, n);
     }
 }
 
-ColourRGBA8 ImageHandler::GetClosestColourOkLab(ColourOkLabA col, float bright, float contrast, float uvbias)
+static void ConvertToWorkingOkLab(const ColourRGBA8* in, float* outL, float* outa, float* outb, float* outA, long long numPixels, float bright, float contrast, bool clampToGamut)
 {
-    float lowestDistance = 999999999999999999999999.9;
-    int chosenColour = 0;
-    col = ColourAdjust(col, bright, contrast);
-    for (int i = 0; i < numColours; i++)
+    long long numChunks = (numPixels + OKLAB_CHUNK_SIZE - 1)/OKLAB_CHUNK_SIZE;
+    #pragma omp parallel for
+    for (long long c = 0; c < numChunks; c++)
     {
-        const ColourOkLabA incol = labPalette[i];
-        const float dL = (col.L - incol.L) * uvbias;
-        const float da = col.a - incol.a;
-        const float db = col.b - incol.b;
-        const float dist = (dL * dL) + (da * da) + (db * db);
-        if (dist < lowestDistance)
+        const long long start = c * OKLAB_CHUNK_SIZE;
+        const long long n = (numPixels - start < OKLAB_CHUNK_SIZE) ? (numPixels - start) : OKLAB_CHUNK_SIZE;
+        ConvertChunkToWorkingOkLab(in + start, outL + start, outa + start, outb + start, outA + start, n, bright, contrast, clampToGamut);
+    }
+}
+
+//Source pixels for mini-batch k-means, converted as they're drawn instead of all up front
+typedef struct
+{
+    const ColourRGBA8* pixels;
+    float bright;
+    float contrast;
+    unsigned int alphaThreshold;
+} KMeansPixelSource;
+
+static void GatherKMeansPixels(const void* context, const long long* indices, int n, KMeansPoints* out)
+{
+    const KMeansPixelSource* src = (const KMeansPixelSource*)context;
+    int numChunks = (n + OKLAB_CHUNK_SIZE - 1)/OKLAB_CHUNK_SIZE;
+    #pragma omp parallel for
+    for (int c = 0; c < numChunks; c++)
+    {
+        const int start = c * OKLAB_CHUNK_SIZE;
+        const int count = (n - start < OKLAB_CHUNK_SIZE) ? (n - start) : OKLAB_CHUNK_SIZE;
+        ColourRGBA8 pixels[OKLAB_CHUNK_SIZE];
+        float A[OKLAB_CHUNK_SIZE];
+        for (int i = 0; i < count; i++)
+        {
+            pixels[i] = src->pixels[indices[start + i]];
+        }
+        //Without the gamut clamping the k-means clustering would never converge
+        ConvertChunkToWorkingOkLab(pixels, out->L + start, out->a + start, out->b + start, A, count, src->bright, src->contrast, true);
+        for (int i = 0; i < count; i++)
         {
-            lowestDistance = dist;
-            chosenColour = i;
+            out->weights[start + i] = (pixels[i].A < src->alphaThreshold) ? 0 : 1; //Ignore 'transparent' colours
         }
     }
-    return palette[chosenColour];
 }
 
-ColourOkLabA ImageHandler::GetClosestColourOkLabWithError(ColourOkLabA col, ColourOkLabA* error, float bright, float contrast, float uvbias, float rngAmtL, float rngAmtC)
+int ImageHandler::RunMiniBatchKMeansOnPixels(ColourOkLabA* means, float uvbias, float bright, float contrast, std::mt19937_64& rng)
 {
-    float lowestDistance = 999999999999999999999999.9;
-    int chosenColour = 0;
-    ColourOkLabA postcol = ColourAdjust(col, bright, contrast);
-    for (int i = 0; i < numColours; i++)
+    int tThres = transparencyThreshold;
+    if (tThres < 0) tThres = 0;
+    else if (tThres > 0xFF) tThres = 0xFF;
+    const KMeansPixelSource pixels = { srcImage.data, bright, contrast, (unsigned int)tThres };
+    const KMeansPointSource src = { ((long long)srcImage.width) * ((long long)srcImage.height), GatherKMeansPixels, &pixels };
+    return RunMiniBatchKMeans(&src, means, numColours, uvbias, is8BitColour, rng, kMeansBatchSize);
+}
+
+//Bucket grid for photos, fine enough that the bucket means sit well within the palette quantisation step
+#define KMEANS_GRID_SIZE 64
+#define KMEANS_GRID_MIN_AB -0.35f
+#define KMEANS_GRID_MAX_AB 0.35f
+
+static inline int KMeansGridCoord(float v, float minv, float maxv)
+{
+    int c = (int)((v - minv) * (((float)KMEANS_GRID_SIZE)/(maxv - minv)));
+    if (c < 0) c = 0; else if (c >= KMEANS_GRID_SIZE) c = KMEANS_GRID_SIZE - 1;
+    return c;
+}
+
+void ImageHandler::GetWeightedKMeansPoints(KMeansPoints* pts, bool bucketed, float bright, float contrast)
+{
+    ColourHistogram* hist = GetSourceHistogram();
+    long long numUnique = hist->GetNumColours();
+    ColourRGBA8* uniqueCols = new ColourRGBA8[numUnique];
+    long long* counts = new long long[numUnique];
+    hist->GetColours(uniqueCols, counts); //Order of appearance keeps the result independent of the thread count
+    float* uniqueLab = new float[4 * numUnique];
+    float* L = uniqueLab;
+    float* a = L + numUnique;
+    float* b = a + numUnique;
+    ConvertToWorkingOkLab(uniqueCols, L, a, b, b + numUnique, numUnique, bright, contrast, true);
+    delete[] uniqueCols;
+
+    if (!bucketed)
     {
-        const ColourOkLabA incol = labPalette[i];
-        const float dL = (postcol.L - incol.L) * uvbias;
-        const float da = postcol.a - incol.a;
-        const float db = postcol.b - incol.b;
-        const float dist = (dL * dL) + (da * da) + (db * db);
-        if (dist < lowestDistance)
+        AllocKMeansPoints(pts, numUnique);
+        memcpy(pts->L, L, numUnique * sizeof(float));
+        memcpy(pts->a, a, numUnique * sizeof(float));
+        memcpy(pts->b, b, numUnique * sizeof(float));
+        for (long long i = 0; i < numUnique; i++)
         {
-            lowestDistance = dist;
-            chosenColour = i;
+            pts->weights[i] = (unsigned int)counts[i];
         }
     }
-    ColourOkLabA outcol = labPalette[chosenColour];
-    error->L = col.L - outcol.L + RNGUpdateFloat()*rngAmtL;
-    error->a = col.a - outcol.a + RNGUpdateFloat()*rngAmtC;
-    error->b = col.b - outcol.b + RNGUpdateFloat()*rngAmtC;
-    error->A = 0.0f;
-    return outcol;
+    else
+    {
+        //Each occupied bucket becomes one point at the weighted mean of its colours
+        const int numCells = KMEANS_GRID_SIZE * KMEANS_GRID_SIZE * KMEANS_GRID_SIZE;
+        double* sums = (double*)calloc(3 * numCells, sizeof(double));
+        unsigned int* cellWeights = (unsigned int*)calloc(numCells, sizeof(unsigned int));
+        for (long long i = 0; i < numUnique; i++)
+        {
+            int cL = KMeansGridCoord(L[i], 0.0f, 1.0f);
+            int ca = KMeansGridCoord(a[i], KMEANS_GRID_MIN_AB, KMEANS_GRID_MAX_AB);
+            int cb = KMeansGridCoord(b[i], KMEANS_GRID_MIN_AB, KMEANS_GRID_MAX_AB);
+            int cell = (cL * KMEANS_GRID_SIZE + ca) * KMEANS_GRID_SIZE + cb;
+            double weight = (double)counts[i];
+            sums[3 * cell] += weight * L[i];
+            sums[3 * cell + 1] += weight * a[i];
+            sums[3 * cell + 2] += weight * b[i];
+            cellWeights[cell] += (unsigned int)counts[i];
+        }
+        long long numOccupied = 0;
+        for (int i = 0; i < numCells; i++)
+        {
+            if (cellWeights[i] != 0) numOccupied++;
+        }
+        AllocKMeansPoints(pts, numOccupied);
+        long long n = 0;
+        for (int i = 0; i < numCells; i++)
+        {
+            if (cellWeights[i] == 0) continue;
+            double weight = (double)cellWeights[i];
+            pts->L[n] = sums[3 * i]/weight;
+            pts->a[n] = sums[3 * i + 1]/weight;
+            pts->b[n] = sums[3 * i + 2]/weight;
+            pts->weights[n] = cellWeights[i];
+            n++;
+        }
+        free(sums);
+        free(cellWeights);
+    }
+    delete[] uniqueLab;
+    delete[] counts;
 }
 
-ColourOkLabA ImageHandler::ClampColourOkLab(ColourOkLabA col)
+ColourHistogram* ImageHandler::GetSourceHistogram()
 {
-    if (col.L < minL) col.L = minL; else if (col.L > maxL) col.L = maxL;
-    float sat = hypotf(col.a, col.b);
-    if (sat > maxC)
+    if (!srcHistogram->IsBuilt() || srcHistogram->GetAlphaThreshold() != transparencyThreshold)
     {
-        col.a *= maxC/sat;
-        col.b *= maxC/sat;
+        long long numPixels = ((long long)srcImage.width) * ((long long)srcImage.height);
+        srcHistogram->Build(srcImage.data, numPixels, transparencyThreshold, true);
     }
-    return col;
+    return srcHistogram;
 }
 
-
-ColourRGBA8 ImageHandler::OrderedDitherBayer2x2(ColourOkLabA col, int x, int y, float amtL, float amtS, float amtH, float bright, float contrast, float uvbias)
+const OkLabBuffer* ImageHandler::GetOkLabBuffer(OkLabBuffer* buf, float bright, float contrast, bool clampToGamut)
 {
-    col.L += bayer2x2[(y % 2) * 2 + (x % 2)] * amtL;
-    float sat = hypotf(col.a, col.b);
-    float hue = atan2f(col.b, col.a);
-    const float midsat = -amtS * bayer2x2[(y % 2) * 2 + ((x + 1) % 2)];
-    sat *= 1.0f + midsat;
-    sat += midsat * 0.5f;
-    hue += amtH * bayer4x4[((y + 1) % 2) * 2 + (x % 2)];
-    col.a = sat * cosf(hue);
-    col.b = sat * sinf(hue);
-    return GetClosestColourOkLab(col, bright, contrast, uvbias);
+    long long numPixels = ((long long)srcImage.width) * ((long long)srcImage.height);
+    if (!buf->valid || buf->size != numPixels || buf->bright != bright || buf->contrast != contrast || buf->clampToGamut != clampToGamut)
+    {
+        FreeOkLabBuffer(buf);
+        buf->L = new float[4 * numPixels];
+        buf->a = buf->L + numPixels;
+        buf->b = buf->a + numPixels;
+        buf->A = buf->b + numPixels;
+        buf->size = numPixels;
+        buf->bright = bright;
+        buf->contrast = contrast;
+        buf->clampToGamut = clampToGamut;
+
+        ConvertToWorkingOkLab(srcImage.data, buf->L, buf->a, buf->b, buf->A, numPixels, bright, contrast, clampToGamut);
+        buf->valid = true;
+    }
+    return buf;
 }
 
-ColourRGBA8 ImageHandler::OrderedDitherBayer4x4(ColourOkLabA col, int x, int y, float amtL, float amtS, float amtH, float bright, float contrast, float uvbias)
+void ImageHandler::FreeOkLabBuffer(OkLabBuffer* buf)
 {
-    col.L += bayer4x4[(y % 4) * 4 + (x % 4)] * amtL;
-    float sat = hypotf(col.a, col.b);
-    float hue = atan2f(col.b, col.a);
-    const float midsat = -amtS * bayer4x4[((y + 3) % 4) * 4 + ((x + 1) % 4)];
-    sat *= 1.0f + midsat;
-    sat += midsat * 0.5f;
-    hue += amtH * bayer4x4[((y + 1) % 4) * 4 + ((x + 2) % 4)];
-    col.a = sat * cosf(hue);
-    col.b = sat * sinf(hue);
-    return GetClosestColourOkLab(col, bright, contrast, uvbias);
+    if (buf->L != nullptr) delete[] buf->L;
+    buf->L = nullptr; buf->a = nullptr; buf->b = nullptr; buf->A = nullptr;
+    buf->size = 0;
+    buf->valid = false;
 }
 
-ColourRGBA8 ImageHandler::OrderedDitherBayer8x8(ColourOkLabA col, int x, int y, float amtL, float amtS, float amtH, float bright, float contrast, float uvbias)
+void ImageHandler::GetLabPaletteFromRGBA8Palette()
 {
-    col.L += bayer8x8[(y % 8) * 8 + (x % 8)] * amtL;
-    float sat = hypotf(col.a, col.b);
-    float hue = atan2f(col.b, col.a);
-    const float midsat = -amtS * bayer8x8[((y + 6) % 8) * 8 + ((x + 1) % 8)];
-    sat *= 1.0f + midsat;
-    sat += midsat * 0.5f;
-    hue += amtH * bayer8x8[((y + 3) % 8) * 8 + ((x + 4) % 8)];
-    col.a = sat * cosf(hue);
-    col.b = sat * sinf(hue);
-    return GetClosestColourOkLab(col, bright, contrast, uvbias);
+    paletteIndex->Invalidate();
+    inverseMap->Invalidate();
+    minL = 1.0f; maxL = 0.0f;
+    maxC = 0.0f;
+    for (int i = 0; i < numColours; i++)
+    {
+        ColourOkLabA labcol = SRGBToOkLab(SRGB8ToLinearFloat(palette[i]));
+        labPalette[i] = labcol;
+        if (labcol.L < minL) minL = labcol.L; if (labcol.L > maxL) maxL = labcol.L;
+        float sat = hypotf(labcol.a, labcol.b);
+        if (sat > maxC) maxC = sat;
+    }
 }
 
-ColourRGBA8 ImageHandler::OrderedDitherBayer16x16(ColourOkLabA col, int x, int y, float amtL, float amtS, float amtH, float bright, float contrast, float uvbias)
+void ImageHandler::InvalidatePaletteIndex()
 {
-    col.L += bayer16x16[(y % 16) * 16 + (x % 16)] * amtL;
-    float sat = hypotf(col.a, col.b);
-    float hue = atan2f(col.b, col.a);
-    const float midsat = -amtS * bayer16x16[((y + 7) % 16) * 16 + ((x + 4) % 16)];
-    sat *= 1.0f + midsat;
-    sat += midsat * 0.5f;
-    hue += amtH * bayer16x16[((y + 10) % 16) * 16 + ((x + 1) % 16)];
-    col.a = sat * cosf(hue);
-    col.b = sat * sinf(hue);
-    return GetClosestColourOkLab(col, bright, contrast, uvbias);
+    paletteIndex->Invalidate();
+    inverseMap->Invalidate();
 }
 
-ColourRGBA8 ImageHandler::OrderedDitherVoid16x16(ColourOkLabA col, int x, int y, float amtL, float amtS, float amtH, float bright, float contrast, float uvbias)
+void ImageHandler::UpdatePaletteIndex(float bright, float contrast, float uvbias)
 {
-    int matind = (y % 16) * 16 + (x % 16);
-    col.L += void16x16_1[matind] * amtL;
-    float sat = hypotf(col.a, col.b);
-    float hue = atan2f(col.b, col.a);
-    const float midsat = -amtS * void16x16_2[matind];
-    sat *= 1.0f + midsat;
-    sat += midsat * 0.5f;
-    hue += amtH * void16x16_3[matind];
-    col.a = sat * cosf(hue);
-    col.b = sat * sinf(hue);
-    return GetClosestColourOkLab(col, bright, contrast, uvbias);
+    if (!paletteIndex->IsBuiltFor(bright, contrast, uvbias)) paletteIndex->Build(labPalette, numColours, bright, contrast, uvbias);
 }
 
-ColourRGBA8 ImageHandler::DitherFloydSteinberg(ColourOkLabA col, int x, int y, int w, float amtL, float amtC, float bright, float contrast, float uvbias, ColourOkLabA* diffErr, int boustro, float rngAmtL, float rngAmtC)
+int ImageHandler::GetClosestColourIndexOkLab(ColourOkLabA col)
 {
-    ColourOkLabA outerr;
-    ColourOkLabA* diffCol = &diffErr[x +  y * w];
-    float inalpha = col.A;
-    col = ColourOkLabAAddAccumulate(col, *diffCol);
-    col = ClampColourOkLab(col);
-    ColourOkLabA outcol = GetClosestColourOkLabWithError(col, &outerr, bright, contrast, uvbias, rngAmtL, rngAmtC);
-
-    diffCol = &diffErr[(x + boustro) +  y * w];
-    const ColourOkLabA coeff1 = { 0.4375f * amtL,  0.4375f * amtC, 0.4375f * amtC, 1.0f };
-    *diffCol = ColourOkLabAFMAAccumulate(*diffCol, outerr, coeff1);
-    diffCol = &diffErr[(x - boustro) + (y + 1) * w];
-    const ColourOkLabA coeff2 = { 0.1875f * amtL,  0.1875f * amtC, 0.1875f * amtC, 1.0f };
-    *diffCol = ColourOkLabAFMAAccumulate(*diffCol, outerr, coeff2);
-    diffCol = &diffErr[ x            + (y + 1) * w];
-    const ColourOkLabA coeff3 = { 0.3125f * amtL,  0.3125f * amtC, 0.3125f * amtC, 1.0f };
-    *diffCol = ColourOkLabAFMAAccumulate(*diffCol, outerr, coeff3);
-    diffCol = &diffErr[(x + boustro) + (y + 1) * w];
-    const ColourOkLabA coeff4 = { 0.0625f * amtL,  0.0625f * amtC, 0.0625f * amtC, 1.0f };
-    *diffCol = ColourOkLabAFMAAccumulate(*diffCol, outerr, coeff4);
-
-    outcol.A = inalpha;
-    return LinearFloatToSRGB8(OkLabToSRGB(outcol));
+    return paletteIndex->FindNearest(col);
 }
 
-ColourRGBA8 ImageHandler::DitherFloydFalse(ColourOkLabA col, int x, int y, int w, float amtL, float amtC, float bright, float contrast, float uvbias, ColourOkLabA* diffErr, int boustro, float rngAmtL, float rngAmtC)
+int ImageHandler::GetClosestColourIndexOkLabWithError(ColourOkLabA col, ColourOkLabA* error, float rngAmtL, float rngAmtC, long long x, long long y)
 {
-    ColourOkLabA outerr;
-    ColourOkLabA* diffCol = &diffErr[x +  y * w];
-    float inalpha = col.A;
-    col = ColourOkLabAAddAccumulate(col, *diffCol);
-    col = ClampColourOkLab(col);
-    ColourOkLabA outcol = GetClosestColourOkLabWithError(col, &outerr, bright, contrast, uvbias, rngAmtL, rngAmtC);
-
-    const ColourOkLabA coeff1 = { 0.375f * amtL, 0.375f * amtC, 0.375f * amtC, 1.0f };
-    const ColourOkLabA errc = ColourOkLabAMultiply(outerr, coeff1);
-    diffCol = &diffErr[(x + boustro) +  y * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[ x            + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    const ColourOkLabA coeff2 = { 0.25f * amtL, 0.25f * amtC, 0.25f * amtC, 1.0f };
-    diffCol = &diffErr[(x + boustro) + (y + 1) * w];
-    *diffCol = ColourOkLabAFMAAccumulate(*diffCol, outerr, coeff2);
-
-    outcol.A = inalpha;
-    return LinearFloatToSRGB8(OkLabToSRGB(outcol));
+    const int index = paletteIndex->FindNearest(col);
+    ColourOkLabA outcol = labPalette[index];
+    error->L = col.L - outcol.L + RNGFloat(x, y, 0)*rngAmtL;
+    error->a = col.a - outcol.a + RNGFloat(x, y, 1)*rngAmtC;
+    error->b = col.b - outcol.b + RNGFloat(x, y, 2)*rngAmtC;
+    error->A = 0.0f;
+    return index;
 }
 
-ColourRGBA8 ImageHandler::DitherJJN(ColourOkLabA col, int x, int y, int w, float amtL, float amtC, float bright, float contrast, float uvbias, ColourOkLabA* diffErr, int boustro, float rngAmtL, float rngAmtC)
+ColourOkLabA ImageHandler::ClampColourOkLab(ColourOkLabA col)
 {
-    ColourOkLabA outerr;
-    ColourOkLabA* diffCol = &diffErr[x +  y * w];
-    float inalpha = col.A;
-    col = ColourOkLabAAddAccumulate(col, *diffCol);
-    col = ClampColourOkLab(col);
-    ColourOkLabA outcol = GetClosestColourOkLabWithError(col, &outerr, bright, contrast, uvbias, rngAmtL, rngAmtC);
-
-    const ColourOkLabA coeff1 = { (7.0f/48.0f) * amtL, (7.0f/48.0f) * amtC, (7.0f/48.0f) * amtC, 1.0f };
-    ColourOkLabA errc = ColourOkLabAMultiply(outerr, coeff1);
-    diffCol = &diffErr[(x + boustro) +  y * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[ x            + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-
-    const ColourOkLabA coeff2 = { (5.0f/48.0f) * amtL, (5.0f/48.0f) * amtC, (5.0f/48.0f) * amtC, 1.0f };
-    errc = ColourOkLabAMultiply(outerr, coeff2);
-    diffCol = &diffErr[(x + 2 * boustro) +  y * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x + boustro)     + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[ x                + (y + 2) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x - boustro)     + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-
-    const ColourOkLabA coeff3 = { (3.0f/48.0f) * amtL, (3.0f/48.0f) * amtC, (3.0f/48.0f) * amtC, 1.0f };
-    errc = ColourOkLabAMultiply(outerr, coeff3);
-    diffCol = &diffErr[(x + 2 * boustro) + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x + boustro)     + (y + 2) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x - boustro)     + (y + 2) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x - 2 * boustro) + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-
-    const ColourOkLabA coeff4 = { (1.0f/48.0f) * amtL, (1.0f/48.0f) * amtC, (1.0f/48.0f) * amtC, 1.0f };
-    errc = ColourOkLabAMultiply(outerr, coeff4);
-    diffCol = &diffErr[(x + 2 * boustro) + (y + 2) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x - 2 * boustro) + (y + 2) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-
-    outcol.A = inalpha;
-    return LinearFloatToSRGB8(OkLabToSRGB(outcol));
+    if (col.L < minL) col.L = minL; else if (col.L > maxL) col.L = maxL;
+    float sat = hypotf(col.a, col.b);
+    if (sat > maxC)
+    {
+        col.a *= maxC/sat;
+        col.b *= maxC/sat;
+    }
+    return col;
 }
 
-ColourRGBA8 ImageHandler::DitherStucki(ColourOkLabA col, int x, int y, int w, float amtL, float amtC, float bright, float contrast, float uvbias, ColourOkLabA* diffErr, int boustro, float rngAmtL, float rngAmtC)
+
+//The fraction of the error each tap gets, scaled by the diffusion amounts
+template <typename KERNEL> static void GetDiffusionWeights(const ErrorDiffusionSettings* settings, float* weightL, float* weightC)
 {
-    ColourOkLabA outerr;
-    ColourOkLabA* diffCol = &diffErr[x +  y * w];
-    float inalpha = col.A;
-    col = ColourOkLabAAddAccumulate(col, *diffCol);
-    col = ClampColourOkLab(col);
-    ColourOkLabA outcol = GetClosestColourOkLabWithError(col, &outerr, bright, contrast, uvbias, rngAmtL, rngAmtC);
-
-    const ColourOkLabA coeff1 = { (8.0f/42.0f) * amtL, (8.0f/42.0f) * amtC, (8.0f/42.0f) * amtC, 1.0f };
-    ColourOkLabA errc = ColourOkLabAMultiply(outerr, coeff1);
-    diffCol = &diffErr[(x + boustro) +  y * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[ x            + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-
-    const ColourOkLabA coeff2 = { (4.0f/42.0f) * amtL, (4.0f/42.0f) * amtC, (4.0f/42.0f) * amtC, 1.0f };
-    errc = ColourOkLabAMultiply(outerr, coeff2);
-    diffCol = &diffErr[(x + 2 * boustro) +  y * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x + boustro)     + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[ x                + (y + 2) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x - boustro)     + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-
-    const ColourOkLabA coeff3 = { (2.0f/42.0f) * amtL, (2.0f/42.0f) * amtC, (2.0f/42.0f) * amtC, 1.0f };
-    errc = ColourOkLabAMultiply(outerr, coeff3);
-    diffCol = &diffErr[(x + 2 * boustro) + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x + boustro)     + (y + 2) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x - boustro)     + (y + 2) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x - 2 * boustro) + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-
-    const ColourOkLabA coeff4 = { (1.0f/42.0f) * amtL, (1.0f/42.0f) * amtC, (1.0f/42.0f) * amtC, 1.0f };
-    errc = ColourOkLabAMultiply(outerr, coeff4);
-    diffCol = &diffErr[(x + 2 * boustro) + (y + 2) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x - 2 * boustro) + (y + 2) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-
-    outcol.A = inalpha;
-    return LinearFloatToSRGB8(OkLabToSRGB(outcol));
+    for (int t = 0; t < KERNEL::numTaps; t++)
+    {
+        weightL[t] = KERNEL::taps[t].weight * settings->amtL;
+        weightC[t] = KERNEL::taps[t].weight * settings->amtC;
+    }
 }
 
-ColourRGBA8 ImageHandler::DitherBurkes(ColourOkLabA col, int x, int y, int w, float amtL, float amtC, float bright, float contrast, float uvbias, ColourOkLabA* diffErr, int boustro, float rngAmtL, float rngAmtC)
+//Dithers pixels xBegin up to but not including xEnd of one row, xBegin being the first in scan order, putting the chosen palette indices in outRow
+template <typename KERNEL, int DIRECTION> void ImageHandler::DiffuseErrorRow(const ErrorDiffusionSettings* settings, const float* weightL, const float* weightC, const ColourRGBA8* row, unsigned char* outRow, const DiffusionErrorRow* errRows, long long y, long long xBegin, long long xEnd)
 {
-    ColourOkLabA outerr;
-    ColourOkLabA* diffCol = &diffErr[x +  y * w];
-    float inalpha = col.A;
-    col = ColourOkLabAAddAccumulate(col, *diffCol);
-    col = ClampColourOkLab(col);
-    ColourOkLabA outcol = GetClosestColourOkLabWithError(col, &outerr, bright, contrast, uvbias, rngAmtL, rngAmtC);
-
-    const ColourOkLabA coeff1 = { (8.0f/32.0f) * amtL, (8.0f/32.0f) * amtC, (8.0f/32.0f) * amtC, 1.0f };
-    ColourOkLabA errc = ColourOkLabAMultiply(outerr, coeff1);
-    diffCol = &diffErr[(x + boustro) +  y * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[ x            + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-
-    const ColourOkLabA coeff2 = { (4.0f/32.0f) * amtL, (4.0f/32.0f) * amtC, (4.0f/32.0f) * amtC, 1.0f };
-    errc = ColourOkLabAMultiply(outerr, coeff2);
-    diffCol = &diffErr[(x + 2 * boustro) +  y * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x + boustro)     + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x - boustro)     + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-
-    const ColourOkLabA coeff3 = { (2.0f/32.0f) * amtL, (2.0f/32.0f) * amtC, (2.0f/32.0f) * amtC, 1.0f };
-    errc = ColourOkLabAMultiply(outerr, coeff3);
-    diffCol = &diffErr[(x + 2 * boustro) + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x - 2 * boustro) + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-
-    outcol.A = inalpha;
-    return LinearFloatToSRGB8(OkLabToSRGB(outcol));
+    const unsigned char* inside = settings->horizon ? GetDiffusionHorizonRow(settings->horizon, y) : nullptr;
+    for (long long x = xBegin; x != xEnd; x += DIRECTION)
+    {
+        if (inside && !inside[x]) //Transparent and too far from anything opaque for its error to matter, so it's dropped
+        {
+            outRow[x] = 0;
+            continue;
+        }
+        const ColourRGBA8 pixcol = row[x];
+        ColourOkLabA col = GetExpandedColourOkLab(settings->labImage, pixcol, x - EDD_EXPAND_X, y, settings->w, settings->h, settings->preB, settings->preC);
+        col.L += errRows[0].L[x];
+        col.a += errRows[0].a[x];
+        col.b += errRows[0].b[x];
+        col = ClampColourOkLab(col);
+        ColourOkLabA outerr;
+        int outIndex;
+        if (settings->randomise)
+        {
+            outIndex = GetClosestColourIndexOkLabWithError(col, &outerr, settings->rngAmtL, settings->rngAmtC, x, y);
+        }
+        else //Same as the above without working out the random numbers
+        {
+            outIndex = paletteIndex->FindNearest(col);
+            const ColourOkLabA outcol = labPalette[outIndex];
+            outerr.L = col.L - outcol.L;
+            outerr.a = col.a - outcol.a;
+            outerr.b = col.b - outcol.b;
+        }
+
+        for (int t = 0; t < KERNEL::numTaps; t++)
+        {
+            const DiffusionErrorRow* errRow = &errRows[KERNEL::taps[t].dy];
+            const long long tx = x + DIRECTION * KERNEL::taps[t].dx;
+            errRow->L[tx] += outerr.L * weightL[t];
+            errRow->a[tx] += outerr.a * weightC[t];
+            errRow->b[tx] += outerr.b * weightC[t];
+        }
+
+        //Transparent pixels still take part, so the error carries across them, but their colour is thrown away
+        outRow[x] = (pixcol.A == 0) ? 0 : (unsigned char)outIndex;
+    }
 }
 
-ColourRGBA8 ImageHandler::DitherSierra(ColourOkLabA col, int x, int y, int w, float amtL, float amtC, float bright, float contrast, float uvbias, ColourOkLabA* diffErr, int boustro, float rngAmtL, float rngAmtC)
+//Builds the horizon for the sparse option from how far this kernel reaches, then dithers the whole image or strips of it
+template <typename KERNEL> void ImageHandler::DiffuseError(ErrorDiffusionSettings* settings, const ExpandedRowSource* rows, unsigned char* outIndices, bool globBoustro)
 {
-    ColourOkLabA outerr;
-    ColourOkLabA* diffCol = &diffErr[x +  y * w];
-    float inalpha = col.A;
-    col = ColourOkLabAAddAccumulate(col, *diffCol);
-    col = ClampColourOkLab(col);
-    ColourOkLabA outcol = GetClosestColourOkLabWithError(col, &outerr, bright, contrast, uvbias, rngAmtL, rngAmtC);
-
-    const ColourOkLabA coeff1 = { (5.0f/32.0f) * amtL, (5.0f/32.0f) * amtC, (5.0f/32.0f) * amtC, 1.0f };
-    ColourOkLabA errc = ColourOkLabAMultiply(outerr, coeff1);
-    diffCol = &diffErr[(x + boustro) +  y * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[ x            + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-
-    const ColourOkLabA coeff2 = { (4.0f/32.0f) * amtL, (4.0f/32.0f) * amtC, (4.0f/32.0f) * amtC, 1.0f };
-    errc = ColourOkLabAMultiply(outerr, coeff2);
-    diffCol = &diffErr[(x + boustro)     + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x - boustro)     + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-
-    const ColourOkLabA coeff3 = { (3.0f/32.0f) * amtL, (3.0f/32.0f) * amtC, (3.0f/32.0f) * amtC, 1.0f };
-    errc = ColourOkLabAMultiply(outerr, coeff3);
-    diffCol = &diffErr[(x + 2 * boustro) +  y * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[ x                + (y + 2) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-
-    const ColourOkLabA coeff4 = { (2.0f/32.0f) * amtL, (2.0f/32.0f) * amtC, (2.0f/32.0f) * amtC, 1.0f };
-    errc = ColourOkLabAMultiply(outerr, coeff4);
-    diffCol = &diffErr[(x + 2 * boustro) + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x + boustro)     + (y + 2) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x - boustro)     + (y + 2) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x - 2 * boustro) + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-
-    outcol.A = inalpha;
-    return LinearFloatToSRGB8(OkLabToSRGB(outcol));
+    DiffusionHorizon horizon;
+    if (sparseDiffusion)
+    {
+        BuildDiffusionHorizon(&horizon, rows, EDD_HORIZON_RADII * KERNEL::marginX, EDD_HORIZON_RADII * KERNEL::marginY);
+        settings->horizon = &horizon;
+    }
+    if (stripDiffusion) DiffuseErrorStrips<KERNEL>(settings, rows, outIndices, globBoustro);
+    else DiffuseErrorImage<KERNEL>(settings, rows, outIndices, globBoustro);
+    if (sparseDiffusion)
+    {
+        FreeDiffusionHorizon(&horizon);
+        settings->horizon = nullptr;
+    }
 }
 
-ColourRGBA8 ImageHandler::DitherSierra2Row(ColourOkLabA col, int x, int y, int w, float amtL, float amtC, float bright, float contrast, float uvbias, ColourOkLabA* diffErr, int boustro, float rngAmtL, float rngAmtC)
+//Streams the expanded image through a ring of error rows, so the working memory only depends on the width and the number of threads
+//Rows are dithered as a wavefront: thread t of T takes rows t, t + T, t + 2T, ... and keeps at least 2*marginX pixels behind the row above,
+//so every error cell gets added to in the same order as a serial scan and the result is identical whatever the number of threads.
+//Boustrophedon scanning stays on one thread, as each reversed row starts where the one above finishes.
+template <typename KERNEL> void ImageHandler::DiffuseErrorImage(const ErrorDiffusionSettings* settings, const ExpandedRowSource* rows, unsigned char* outIndices, bool globBoustro)
 {
-    ColourOkLabA outerr;
-    ColourOkLabA* diffCol = &diffErr[x +  y * w];
-    float inalpha = col.A;
-    col = ColourOkLabAAddAccumulate(col, *diffCol);
-    col = ClampColourOkLab(col);
-    ColourOkLabA outcol = GetClosestColourOkLabWithError(col, &outerr, bright, contrast, uvbias, rngAmtL, rngAmtC);
-
-    const ColourOkLabA coeff1 = { (4.0f/16.0f) * amtL, (4.0f/16.0f) * amtC, (4.0f/16.0f) * amtC, 1.0f };
-    diffCol = &diffErr[(x + boustro) +  y * w];
-    *diffCol = ColourOkLabAFMAAccumulate(*diffCol, outerr, coeff1);
-
-    const ColourOkLabA coeff2 = { (3.0f/16.0f) * amtL, (3.0f/16.0f) * amtC, (3.0f/16.0f) * amtC, 1.0f };
-    ColourOkLabA errc = ColourOkLabAMultiply(outerr, coeff2);
-    diffCol = &diffErr[(x + 2 * boustro) +  y * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[ x                + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-
-    const ColourOkLabA coeff3 = { (2.0f/16.0f) * amtL, (2.0f/16.0f) * amtC, (2.0f/16.0f) * amtC, 1.0f };
-    errc = ColourOkLabAMultiply(outerr, coeff3);
-    diffCol = &diffErr[(x + boustro)     + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x - boustro)     + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-
-    const ColourOkLabA coeff4 = { (1.0f/16.0f) * amtL, (1.0f/16.0f) * amtC, (1.0f/16.0f) * amtC, 1.0f };
-    errc = ColourOkLabAMultiply(outerr, coeff4);
-    diffCol = &diffErr[(x + 2 * boustro) + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x - 2 * boustro) + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-
-    outcol.A = inalpha;
-    return LinearFloatToSRGB8(OkLabToSRGB(outcol));
+    static_assert(KERNEL::marginY <= EDD_MAX_MARGIN_Y, "Error diffusion kernel reaches further down than the error ring");
+    const int w = settings->w;
+    const int h = settings->h;
+    const int ew = w + 2*EDD_EXPAND_X;
+    const long long numRows = h + EDD_EXPAND_Y_TOP;
+    const int rowLength = ew - 2*KERNEL::marginX;
+    float weightL[KERNEL::numTaps];
+    float weightC[KERNEL::numTaps];
+    GetDiffusionWeights<KERNEL>(settings, weightL, weightC);
+
+    int numThreads = globBoustro ? 1 : omp_get_max_threads();
+    if (numThreads > numRows) numThreads = numRows;
+    //Each thread has one row on the go and the lowest of them adds error up to marginY rows further down
+    const int ringRows = numThreads + KERNEL::marginY;
+    float* errorStore = (float*)calloc(((long long)ew) * 3 * ringRows, sizeof(float));
+    DiffusionErrorRow* ring = new DiffusionErrorRow[ringRows];
+    for (int i = 0; i < ringRows; i++)
+    {
+        ring[i].L = errorStore + ((long long)ew) * 3 * i;
+        ring[i].a = ring[i].L + ew;
+        ring[i].b = ring[i].a + ew;
+    }
+    int* rowProgress = (int*)calloc(numRows, sizeof(int)); //How many pixels of each row have been dithered
+
+    #pragma omp parallel num_threads(numThreads)
+    {
+        const int thread = omp_get_thread_num();
+        const int stride = omp_get_num_threads();
+        ColourRGBA8* row = new ColourRGBA8[ew];
+        unsigned char* outRow = new unsigned char[ew];
+        ExpandedRowCache cache;
+        InitExpandedRowCache(&cache, w);
+
+        //Rows are numbered from the top of the expanded image, so the parity for boustrophedon scanning matches the whole image being expanded
+        DiffusionErrorRow errRows[KERNEL::marginY + 1];
+        for (long long i = thread; i < numRows; i += stride)
+        {
+            const long long y = i - EDD_EXPAND_Y_TOP;
+            if (!settings->horizon || settings->horizon->rowInside[i]) GetExpandedRow(rows, &cache, y, row);
+            for (int k = 0; k <= KERNEL::marginY; k++)
+            {
+                errRows[k] = ring[(i + k) % ringRows];
+            }
+            if (globBoustro && (i % 2))
+            {
+                DiffuseErrorRow<KERNEL, -1>(settings, weightL, weightC, row, outRow, errRows, y, ew - 1 - KERNEL::marginX, KERNEL::marginX - 1);
+            }
+            else if (stride == 1)
+            {
+                DiffuseErrorRow<KERNEL, 1>(settings, weightL, weightC, row, outRow, errRows, y, KERNEL::marginX, ew - KERNEL::marginX);
+            }
+            else
+            {
+                for (int done = 0; done < rowLength;)
+                {
+                    const int next = (done + EDD_WAVEFRONT_CHUNK < rowLength) ? done + EDD_WAVEFRONT_CHUNK : rowLength;
+                    if (i > 0)
+                    {
+                        //The row above has to have finished adding to anything this chunk reads or adds to
+                        const int needed = (next + 2*KERNEL::marginX < rowLength) ? next + 2*KERNEL::marginX : rowLength;
+                        //Let other threads have the core rather than spinning, in case there are more threads than cores
+                        for (int spins = 0;; spins++)
+                        {
+                            int above;
+                            #pragma omp atomic read seq_cst
+                            above = rowProgress[i - 1];
+                            if (above >= needed) break;
+                            if (spins >= EDD_WAVEFRONT_SPINS) std::this_thread::yield();
+                        }
+                    }
+                    DiffuseErrorRow<KERNEL, 1>(settings, weightL, weightC, row, outRow, errRows, y, KERNEL::marginX + done, KERNEL::marginX + next);
+                    done = next;
+                    if (done < rowLength)
+                    {
+                        #pragma omp atomic write seq_cst
+                        rowProgress[i] = done;
+                    }
+                }
+            }
+            if (y >= 0) memcpy(&outIndices[y * w], &outRow[EDD_EXPAND_X], w);
+            //Done with this row's error, so it becomes the furthest row down, which has to happen before the rows below can finish and reuse it
+            memset(errRows[0].L, 0, ew * 3 * sizeof(float));
+            #pragma omp atomic write seq_cst
+            rowProgress[i] = rowLength;
+        }
+
+        FreeExpandedRowCache(&cache);
+        delete[] outRow;
+        delete[] row;
+    }
+
+    free(rowProgress);
+    delete[] ring;
+    free(errorStore);
 }
 
-ColourRGBA8 ImageHandler::DitherFilterLite(ColourOkLabA col, int x, int y, int w, float amtL, float amtC, float bright, float contrast, float uvbias, ColourOkLabA* diffErr, int boustro, float rngAmtL, float rngAmtC)
+//Dithers source lines firstLine up to but not including endLine on the calling thread, through its own ring of EDD_ERROR_ROWS error rows,
+//only writing out the lines from outLine on
+template <typename KERNEL> void ImageHandler::DiffuseErrorLines(const ErrorDiffusionSettings* settings, const float* weightL, const float* weightC, const ExpandedRowSource* rows, unsigned char* outIndices, bool globBoustro, long long firstLine, long long outLine, long long endLine)
 {
-    ColourOkLabA outerr;
-    ColourOkLabA* diffCol = &diffErr[x +  y * w];
-    float inalpha = col.A;
-    col = ColourOkLabAAddAccumulate(col, *diffCol);
-    col = ClampColourOkLab(col);
-    ColourOkLabA outcol = GetClosestColourOkLabWithError(col, &outerr, bright, contrast, uvbias, rngAmtL, rngAmtC);
-
-    const ColourOkLabA coeff1 = { 0.5f * amtL, 0.5f * amtC, 0.5f * amtC, 1.0f };
-    diffCol = &diffErr[(x + boustro) +  y * w];
-    *diffCol = ColourOkLabAFMAAccumulate(*diffCol, outerr, coeff1);
-    const ColourOkLabA coeff2 = { 0.25f * amtL, 0.25f * amtC, 0.25f * amtC, 1.0f };
-    const ColourOkLabA errc = ColourOkLabAMultiply(outerr, coeff2);
-    diffCol = &diffErr[ x            + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x - boustro) + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-
-    outcol.A = inalpha;
-    return LinearFloatToSRGB8(OkLabToSRGB(outcol));
+    const int w = settings->w;
+    const int ew = w + 2*EDD_EXPAND_X;
+    ColourRGBA8* row = new ColourRGBA8[ew];
+    unsigned char* outRow = new unsigned char[ew];
+    ExpandedRowCache cache;
+    InitExpandedRowCache(&cache, w);
+    float* errorStore = (float*)calloc(((long long)ew) * 3 * EDD_ERROR_ROWS, sizeof(float));
+    DiffusionErrorRow ring[EDD_ERROR_ROWS];
+    for (int i = 0; i < EDD_ERROR_ROWS; i++)
+    {
+        ring[i].L = errorStore + ((long long)ew) * 3 * i;
+        ring[i].a = ring[i].L + ew;
+        ring[i].b = ring[i].a + ew;
+    }
+
+    DiffusionErrorRow errRows[KERNEL::marginY + 1];
+    for (long long y = firstLine; y < endLine; y++)
+    {
+        const long long i = y + EDD_EXPAND_Y_TOP; //Same row numbering as DiffuseErrorImage, so boustrophedon scanning goes the same way
+        if (!settings->horizon || settings->horizon->rowInside[i]) GetExpandedRow(rows, &cache, y, row);
+        for (int k = 0; k <= KERNEL::marginY; k++)
+        {
+            errRows[k] = ring[(i + k) % EDD_ERROR_ROWS];
+        }
+        if (globBoustro && (i % 2)) DiffuseErrorRow<KERNEL, -1>(settings, weightL, weightC, row, outRow, errRows, y, ew - 1 - KERNEL::marginX, KERNEL::marginX - 1);
+        else DiffuseErrorRow<KERNEL, 1>(settings, weightL, weightC, row, outRow, errRows, y, KERNEL::marginX, ew - KERNEL::marginX);
+        if (y >= outLine) memcpy(&outIndices[y * w], &outRow[EDD_EXPAND_X], w);
+        memset(errRows[0].L, 0, ew * 3 * sizeof(float));
+    }
+
+    free(errorStore);
+    FreeExpandedRowCache(&cache);
+    delete[] outRow;
+    delete[] row;
 }
 
-ColourRGBA8 ImageHandler::DitherAtkinson(ColourOkLabA col, int x, int y, int w, float amtL, float amtC, float bright, float contrast, float uvbias, ColourOkLabA* diffErr, int boustro, float rngAmtL, float rngAmtC)
+//Approximate, but with no waiting between threads: the image is cut into one horizontal strip per thread and each is dithered on its own,
+//starting EDD_EXPAND_Y_TOP lines above its first line so the error has settled by the time it's visible, the same as above the top of the image.
+//The first strip comes out exactly as DiffuseErrorImage would give, and the rest only differ where the error from above the seam would have carried on.
+template <typename KERNEL> void ImageHandler::DiffuseErrorStrips(const ErrorDiffusionSettings* settings, const ExpandedRowSource* rows, unsigned char* outIndices, bool globBoustro)
 {
-    ColourOkLabA outerr;
-    ColourOkLabA* diffCol = &diffErr[x +  y * w];
-    float inalpha = col.A;
-    col = ColourOkLabAAddAccumulate(col, *diffCol);
-    col = ClampColourOkLab(col);
-    ColourOkLabA outcol = GetClosestColourOkLabWithError(col, &outerr, bright, contrast, uvbias, rngAmtL, rngAmtC);
-
-    const ColourOkLabA coeff = { amtL/6.0f, amtC/6.0f, amtC/6.0f, 1.0f }; //Note: the canonical Atkinson dither only diffuses 3/4 of the error, but we'll normalise this one anyway
-    const ColourOkLabA errc = ColourOkLabAMultiply(outerr, coeff);
-    diffCol = &diffErr[(x + boustro)     +  y * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x + 2 * boustro) +  y * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x - boustro)     + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[ x                + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[(x + boustro)     + (y + 1) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-    diffCol = &diffErr[ x                + (y + 2) * w];
-    *diffCol = ColourOkLabAAddAccumulate(*diffCol, errc);
-
-    outcol.A = inalpha;
-    return LinearFloatToSRGB8(OkLabToSRGB(outcol));
+    const int h = settings->h;
+    const int numStrips = GetDiffusionStripCount(h, omp_get_max_threads());
+    if (numStrips <= 1)
+    {
+        DiffuseErrorImage<KERNEL>(settings, rows, outIndices, globBoustro);
+        return;
+    }
+    float weightL[KERNEL::numTaps];
+    float weightC[KERNEL::numTaps];
+    GetDiffusionWeights<KERNEL>(settings, weightL, weightC);
+
+    #pragma omp parallel for schedule(static, 1) num_threads(numStrips)
+    for (int s = 0; s < numStrips; s++)
+    {
+        const long long firstLine = (((long long)h) * s) / numStrips;
+        const long long endLine = (((long long)h) * (s + 1)) / numStrips;
+        DiffuseErrorLines<KERNEL>(settings, weightL, weightC, rows, outIndices, globBoustro, firstLine - EDD_EXPAND_Y_TOP, firstLine, endLine);
+    }
 }
@@ -61,19 +61,59 @@ typedef struct
     ColourRGBA8* data;
 } ImageInfo;
 
+//What DitherImage chooses for each pixel, which GeneratePlanarData works from directly
 typedef struct
 {
-    unsigned char** planeData;
+    int width;
+    int height;
+    unsigned char* indices; //Palette index, 0 for transparent pixels
+    unsigned char* opaque; //One bit per pixel, most significant first, with each line padded to a whole byte like a mask plane
+    int opaqueStride;
+} IndexedImageInfo;
+
+inline bool IsIndexedPixelOpaque(const IndexedImageInfo* img, long long x, long long y)
+{
+    return (img->opaque[y * img->opaqueStride + (x >> 3)] >> (7 - (x & 0x7))) & 0x1;
+}
+
+typedef struct
+{
+    unsigned char** planeData; //Each plane starts on a cache line, planeStride after the one before
+    unsigned char* planeSlab; //The one allocation all the planes are in
     unsigned short planeMask;
     int planew;
     int planeh;
     int numTiles;
     int planeSize;
+    long long planeStride;
     int numPlanes;
     int numColours;
     bool is8BitColour;
 } PlanarInfo;
 
+//Structure of arrays OkLab copy of an image, with the pre-adjustment already applied
+typedef struct
+{
+    float* L;
+    float* a;
+    float* b;
+    float* A;
+    long long size;
+    float bright;
+    float contrast;
+    bool clampToGamut;
+    bool valid;
+} OkLabBuffer;
+
+class ColourHistogram;
+class NearestColourIndex;
+class InverseColourMap;
+struct ThresholdMatrixSet;
+struct ErrorDiffusionSettings;
+struct DiffusionErrorRow;
+struct ExpandedRowSource;
+struct KMeansPoints;
+
 const float OkLabK1 = 0.206f;
 const float OkLabK2 = 0.03f;
 const float OkLabK3 = 1.17087378640776f;
@@ -246,9 +286,20 @@ inline ColourOkLabA ColourAdjust(ColourOkLabA c, float bright, float contrast)
     return c;
 }
 
+//Counter based random numbers (the SplitMix64 finaliser): the same key and counter always give the same number, whichever thread asks and in whatever order
+inline unsigned long long CounterRandom(unsigned long long key, unsigned long long counter)
+{
+    unsigned long long z = key + ((counter + 1) * 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
 ColourOkLabA SRGBToOkLab(ColourRGBA c);
 ColourRGBA OkLabToSRGB(ColourOkLabA c);
 ColourRGBA8 BlendSRGB8(ColourRGBA8 l, ColourRGBA8 r, float amt);
+ColourOkLabA RoundTripLabA4bpc(ColourOkLabA c);
+ColourOkLabA RoundTripLabA8bpc(ColourOkLabA c);
 
 enum ditherMethods
 {
@@ -258,6 +309,7 @@ enum ditherMethods
     BAYER8X8,
     BAYER16X16,
     VOID16X16,
+    CUSTOMMATRIX, //Whatever was last loaded with LoadThresholdMatrixFile or SetThresholdMatrix
     FLOYD_STEINBERG,
     FLOYD_FALSE,
     JJN,
@@ -269,6 +321,17 @@ enum ditherMethods
     ATKINSON
 };
 
+//What the palette search in GetBestPalette runs over
+enum kMeansInputs
+{
+    KMEANS_AUTO, //Unique colours, or the bucket grid if there are too many of them
+    KMEANS_PIXELS,
+    KMEANS_UNIQUE,
+    KMEANS_BUCKETED
+};
+
+#define KMEANS_MAX_UNIQUE_POINTS 65536
+
 enum tileOrderings
 {
     ROWMAJOR,
@@ -283,27 +346,39 @@ public:
 
     int OpenImageFile(const char* inFileName);
     void CloseImageFile();
+    //Same as opening an image file, but from pixels already in memory
+    void SetImage(const ColourRGBA8* pixels, int w, int h);
     bool IsPalettePerfect();
     bool GetBestPalette();
     bool GetBestPalette(float uvbias, float bright, float contrast);
     bool LoadPaletteFile(const char* inFileName);
     bool SavePaletteFile(const char* outFileName);
+    //Loads a square image, up to ORDERED_MAX_SIZE across, as the threshold matrix for CUSTOMMATRIX
+    //If its channels differ they're used for lightness, saturation and hue in turn, otherwise it's one matrix offset for each
+    bool LoadThresholdMatrixFile(const char* inFileName);
+    //Same, for a matrix already in memory with entries in [-0.5, 0.5)
+    bool SetThresholdMatrix(const float* matrix, int size);
     void ShufflePaletteBasedOnOccurrence();
     void DitherImage();
     void DitherImage(int ditherMethod, double ditAmtL, double ditAmtS, double ditAmtH, double ditAmtEL, double ditAmtEC, double rngAmtL, double rngAmtC, double cbias, double preB, double preC, double postB, double postC, bool globBoustro);
     PlanarInfo GeneratePlanarData();
     static void FreePlanarData(PlanarInfo* pinfo);
 
+    //Only for showing, the dithered image itself is GetIndexedImage
     inline ImageInfo* GetEncodedImage() { return &encImage; }
+    inline IndexedImageInfo* GetIndexedImage() { return &encIndexed; }
     inline ColourRGBA8* GetCurrentPalette() { return palette; }
     inline int GetPlaneMask() { return planeMask; }
     inline int GetNumColours() { return numColours; }
     inline int GetNumColourPlanes() { return numColourPlanes; }
+    //Fraction of opaque pixels the last ordered dither found in its memo
+    inline double GetOrderedDitherHitRate() { return orderedMemoHitRate; }
 
     inline void SetPaletteColour(int index, ColourRGBA8 col)
     {
         palette[index] = col;
         labPalette[index] = SRGBToOkLab(SRGB8ToLinearFloat(col));
+        InvalidatePaletteIndex();
     }
 
     inline void AddPlane(int planeNum)
@@ -355,10 +430,21 @@ public:
     double postBrightness;
     double postContrast;
     bool boustrophedon;
+    bool stripDiffusion; //Error diffuse in independent strips for faster previews, see DiffuseErrorStrips
+    bool sparseDiffusion; //Skip transparent pixels too far from anything opaque for their error to matter, see BuildDiffusionHorizon
+    bool orderedMemo; //Remember the palette index for each (colour, matrix cell) an ordered dither searches, which gives the same output
 
     double adaptivePreBrightness;
     double adaptivePreContrast;
     double adaptiveChromaBias;
+    int kMeansInput;
+    int paletteQuantizer;
+    bool quantizerSeedsKMeans; //Refine the palette from one of the fast quantizers with k-means
+    bool kMeansMiniBatch; //For very large inputs, see RunMiniBatchKMeans
+    int kMeansBatchSize;
+    bool kMeansRefine;
+    unsigned long long paletteSeed; //The palette search always starts from this, so the same image and settings give the same palette
+    unsigned long long ditherSeed; //Likewise for the noise added by error diffusion randomisation
 
     bool isTiled;
     int tileSizeX;
@@ -366,51 +452,51 @@ public:
     int tileOrdering;
 
 private:
-    inline unsigned long long RNGUpdate()
-    {
-        return rng();
-    }
-
-    inline float RNGUpdateFloat()
+    //Between -1 and ~1, for one channel of the pixel at x (in the expanded image) and y (a source line), so randomised error diffusion
+    //comes out the same whichever order or thread the pixels are dithered in. Lines above the image wrap round, which still gives each pixel its own counter.
+    inline float RNGFloat(long long x, long long y, int channel)
     {
-        unsigned long long r = RNGUpdate();
+        const unsigned long long counter = (((unsigned long long)y) << 34) | (((unsigned long long)x) << 2) | channel;
+        unsigned long long r = CounterRandom(ditherSeed, counter);
         unsigned int o = 0x3F800000; //1.0
         o |= r >> 41;
         float f = *((float*)(&o)); //Should be between 1 and ~2
         return 2.0f * (f - 1.5f); //Should be between -1 and ~1
     }
 
-    inline double RNGUpdateDouble()
-    {
-        unsigned long long r = RNGUpdate();
-        unsigned long long o = 0x3FF0000000000000; //1.0
-        o |= r >> 12;
-        double f = *((double*)(&o)); //Should be between 1 and ~2
-        return 2.0 * (f - 1.5); //Should be between -1 and ~1
-    }
-
+    void ResetForNewImage();
+    void UpdateEncodedImage(ColourRGBA8 zeroCol);
     void GetLabPaletteFromRGBA8Palette();
-    ColourRGBA8 GetClosestColourOkLab(ColourOkLabA col, float bright, float contrast, float uvbias);
-    ColourOkLabA GetClosestColourOkLabWithError(ColourOkLabA col, ColourOkLabA* error, float bright, float contrast, float uvbias, float rngAmtL, float rngAmtC);
+    void InvalidatePaletteIndex();
+    void UpdatePaletteIndex(float bright, float contrast, float uvbias);
+    //These search paletteIndex as it is, so UpdatePaletteIndex has to have been called for the post-adjustment and chroma bias being dithered with
+    int GetClosestColourIndexOkLab(ColourOkLabA col);
+    int GetClosestColourIndexOkLabWithError(ColourOkLabA col, ColourOkLabA* error, float rngAmtL, float rngAmtC, long long x, long long y);
     ColourOkLabA ClampColourOkLab(ColourOkLabA col);
-    ColourRGBA8 OrderedDitherBayer2x2(ColourOkLabA col, int x, int y, float amtL, float amtS, float amtH, float bright, float contrast, float uvbias);
-    ColourRGBA8 OrderedDitherBayer4x4(ColourOkLabA col, int x, int y, float amtL, float amtS, float amtH, float bright, float contrast, float uvbias);
-    ColourRGBA8 OrderedDitherBayer8x8(ColourOkLabA col, int x, int y, float amtL, float amtS, float amtH, float bright, float contrast, float uvbias);
-    ColourRGBA8 OrderedDitherBayer16x16(ColourOkLabA col, int x, int y, float amtL, float amtS, float amtH, float bright, float contrast, float uvbias);
-    ColourRGBA8 OrderedDitherVoid16x16(ColourOkLabA col, int x, int y, float amtL, float amtS, float amtH, float bright, float contrast, float uvbias);
-    ColourRGBA8 DitherFloydSteinberg(ColourOkLabA col, int x, int y, int w, float amtL, float amtC, float bright, float contrast, float uvbias, ColourOkLabA* diffErr, int boustro, float rngAmtL, float rngAmtC);
-    ColourRGBA8 DitherFloydFalse(ColourOkLabA col, int x, int y, int w, float amtL, float amtC, float bright, float contrast, float uvbias, ColourOkLabA* diffErr, int boustro, float rngAmtL, float rngAmtC);
-    ColourRGBA8 DitherJJN(ColourOkLabA col, int x, int y, int w, float amtL, float amtC, float bright, float contrast, float uvbias, ColourOkLabA* diffErr, int boustro, float rngAmtL, float rngAmtC);
-    ColourRGBA8 DitherStucki(ColourOkLabA col, int x, int y, int w, float amtL, float amtC, float bright, float contrast, float uvbias, ColourOkLabA* diffErr, int boustro, float rngAmtL, float rngAmtC);
-    ColourRGBA8 DitherBurkes(ColourOkLabA col, int x, int y, int w, float amtL, float amtC, float bright, float contrast, float uvbias, ColourOkLabA* diffErr, int boustro, float rngAmtL, float rngAmtC);
-    ColourRGBA8 DitherSierra(ColourOkLabA col, int x, int y, int w, float amtL, float amtC, float bright, float contrast, float uvbias, ColourOkLabA* diffErr, int boustro, float rngAmtL, float rngAmtC);
-    ColourRGBA8 DitherSierra2Row(ColourOkLabA col, int x, int y, int w, float amtL, float amtC, float bright, float contrast, float uvbias, ColourOkLabA* diffErr, int boustro, float rngAmtL, float rngAmtC);
-    ColourRGBA8 DitherFilterLite(ColourOkLabA col, int x, int y, int w, float amtL, float amtC, float bright, float contrast, float uvbias, ColourOkLabA* diffErr, int boustro, float rngAmtL, float rngAmtC);
-    ColourRGBA8 DitherAtkinson(ColourOkLabA col, int x, int y, int w, float amtL, float amtC, float bright, float contrast, float uvbias, ColourOkLabA* diffErr, int boustro, float rngAmtL, float rngAmtC);
-
-    std::mt19937_64 rng;
+    ColourHistogram* GetSourceHistogram();
+    void GetWeightedKMeansPoints(KMeansPoints* pts, bool bucketed, float bright, float contrast);
+    //Mini-batch k-means over every pixel, converting only the pixels it samples, so that nothing per pixel has to be kept
+    int RunMiniBatchKMeansOnPixels(ColourOkLabA* means, float uvbias, float bright, float contrast, std::mt19937_64& rng);
+    const OkLabBuffer* GetOkLabBuffer(OkLabBuffer* buf, float bright, float contrast, bool clampToGamut);
+    static void FreeOkLabBuffer(OkLabBuffer* buf);
+    //Runs an error diffusion kernel over one row of the expanded image, in the scan direction DIRECTION (1 or -1)
+    //errRows are that row's accumulated error and the next KERNEL::marginY rows'
+    template <typename KERNEL, int DIRECTION> void DiffuseErrorRow(const ErrorDiffusionSettings* settings, const float* weightL, const float* weightC, const ColourRGBA8* row, unsigned char* outRow, const DiffusionErrorRow* errRows, long long y, long long xBegin, long long xEnd);
+    template <typename KERNEL> void DiffuseError(ErrorDiffusionSettings* settings, const ExpandedRowSource* rows, unsigned char* outIndices, bool globBoustro);
+    template <typename KERNEL> void DiffuseErrorImage(const ErrorDiffusionSettings* settings, const ExpandedRowSource* rows, unsigned char* outIndices, bool globBoustro);
+    template <typename KERNEL> void DiffuseErrorLines(const ErrorDiffusionSettings* settings, const float* weightL, const float* weightC, const ExpandedRowSource* rows, unsigned char* outIndices, bool globBoustro, long long firstLine, long long outLine, long long endLine);
+    template <typename KERNEL> void DiffuseErrorStrips(const ErrorDiffusionSettings* settings, const ExpandedRowSource* rows, unsigned char* outIndices, bool globBoustro);
+
     ImageInfo srcImage;
     ImageInfo encImage;
+    IndexedImageInfo encIndexed;
+    OkLabBuffer paletteLab; //Working copies of srcImage, kept until the image or the pre-adjustment changes
+    OkLabBuffer ditherLab;
+    ColourHistogram* srcHistogram; //Opaque colours of srcImage, kept until the image or the transparency threshold changes
+    NearestColourIndex* paletteIndex; //Kept until the palette or the post-adjustment changes
+    InverseColourMap* inverseMap; //For undithered output, kept until the palette or any adjustment changes
+    ThresholdMatrixSet* thresholdMatrices; //For CUSTOMMATRIX, nullptr until one is loaded
+    double orderedMemoHitRate;
     ColourRGBA8 palette[256];
     ColourOkLabA labPalette[256];
     int numColours;
@@ -0,0 +1,693 @@
+/* gpitool - Converts images into .GPI format
+ * Copyright (c) 2024 Maxim Hoxha
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * K-means clustering for palette generation
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+#include "kmeans.h"
+#include "nearestcolour.h"
+
+//The sums are fixed point, so that adding them up in any order (and so with any number of threads) gives exactly the same result
+#define KMEANS_FIXED_ONE 16777216.0f
+
+typedef struct
+{
+    ColourOkLabA mean;
+    ColourOkLabA lastmean;
+    long long numInCluster;
+    long long sumL;
+    long long suma;
+    long long sumb;
+} KMean;
+
+//One thread's running sums for one mean, each on its own cache line so that the threads never share one
+typedef struct alignas(64)
+{
+    long long sumL;
+    long long suma;
+    long long sumb;
+    long long numInCluster;
+} KMeanPartialSum;
+
+static inline float KMeansRandomFloat(std::mt19937_64& rng)
+{
+    unsigned long long r = rng();
+    unsigned int o = 0x3F800000; //1.0
+    o |= r >> 41;
+    float f = *((float*)(&o)); //Should be between 1 and ~2
+    return 2.0f * (f - 1.5f); //Should be between -1 and ~1
+}
+
+//Between 0 and ~1
+static inline double KMeansUnitDouble(unsigned long long r)
+{
+    unsigned long long o = 0x3FF0000000000000; //1.0
+    o |= r >> 12;
+    double f;
+    memcpy(&f, &o, sizeof(double)); //Should be between 1 and ~2
+    return f - 1.0;
+}
+
+//Ignored points get zero alpha, so that they can still be told apart once they have been copied into the samples
+static inline ColourOkLabA KMeansPoint(const KMeansPoints* pts, long long index)
+{
+    ColourOkLabA col = { pts->L[index], pts->a[index], pts->b[index], pts->weights[index] ? 1.0f : 0.0f };
+    return col;
+}
+
+//The means in the form the vectorised nearest colour search takes
+static void FillKMeansSoA(NearestColourSoA* soa, const KMean* means, int numMeans, float uvbias)
+{
+    ColourOkLabA cols[256];
+    for (int i = 0; i < numMeans; i++)
+    {
+        cols[i] = means[i].mean;
+    }
+    FillNearestColourSoA(soa, cols, numMeans, uvbias);
+}
+
+//Squared distance between a point and a mean, with lightness scaled by uvbias
+static inline float KMeansDistSq(ColourOkLabA col, ColourOkLabA incol, float uvbias)
+{
+    const float dL = (col.L - incol.L) * uvbias;
+    const float da = col.a - incol.a;
+    const float db = col.b - incol.b;
+    return (dL * dL) + (da * da) + (db * db);
+}
+
+void AllocKMeansPoints(KMeansPoints* pts, long long numPoints)
+{
+    pts->L = new float[3 * numPoints];
+    pts->a = pts->L + numPoints;
+    pts->b = pts->a + numPoints;
+    pts->weights = new unsigned int[numPoints];
+    pts->numPoints = numPoints;
+}
+
+void FreeKMeansPoints(KMeansPoints* pts)
+{
+    if (pts->L != nullptr) delete[] pts->L;
+    if (pts->weights != nullptr) delete[] pts->weights;
+    pts->L = nullptr; pts->a = nullptr; pts->b = nullptr;
+    pts->weights = nullptr;
+    pts->numPoints = 0;
+}
+
+void SeedKMeans(const KMeansPoints* pts, ColourOkLabA* outMeans, int numMeans, float uvbias, std::mt19937_64& rng)
+{
+    KMean means[256];
+    const long long numPoints = pts->numPoints;
+    const unsigned int* pweights = pts->weights;
+    //Pick some means (k-means||)
+    //Everything here is either done per point or serially, so the samples only depend on the state of rng, never on the number of threads
+    ColourOkLabA* csamples = new ColourOkLabA[17 * numMeans];
+    double* probs = new double[(numPoints > 17 * numMeans) ? numPoints : 17 * numMeans]; //Reused for the samples later
+    float* lowestDistances = new float[numPoints]; //To the closest sample so far, so that each round only has to look at the new ones
+    unsigned long long rnum = rng() % numPoints;
+    csamples[0] = KMeansPoint(pts, rnum);
+    int totalSamples = 1;
+    int firstNewSample = 0;
+    int sampPerIter = 2 * numMeans;
+    #pragma omp parallel for
+    for (long long j = 0; j < numPoints; j++)
+    {
+        lowestDistances[j] = 999999999999999999999999.9;
+    }
+    //Pick some initial points
+    for (int i = 0; i < 8; i++)
+    {
+        //Cost calculation
+        #pragma omp parallel for
+        for (long long j = 0; j < numPoints; j++)
+        {
+            if (pweights[j] == 0) //Ignore 'transparent' colours
+            {
+                probs[j] = 0.0;
+                continue;
+            }
+            ColourOkLabA col = KMeansPoint(pts, j);
+            float lowestDistance = lowestDistances[j];
+            for (int k = firstNewSample; k < totalSamples; k++)
+            {
+                const float dist = KMeansDistSq(col, csamples[k], uvbias);
+                if (dist < lowestDistance)
+                {
+                    lowestDistance = dist;
+                }
+            }
+            lowestDistances[j] = lowestDistance;
+            probs[j] = ((double)pweights[j]) * ((double)lowestDistance);
+        }
+        double cumProb = 0.0; //hee hee
+        for (long long j = 0; j < numPoints; j++)
+        {
+            cumProb += probs[j];
+            probs[j] = cumProb;
+        }
+        if (cumProb <= 0.0) break; //Every point is already a sample
+        //Pick samples
+        const unsigned long long roundKey = rng();
+        firstNewSample = totalSamples;
+        #pragma omp parallel for
+        for (int j = 0; j < sampPerIter; j++)
+        {
+            double p = KMeansUnitDouble(CounterRandom(roundKey, j)) * cumProb;
+            long long ind = numPoints/2;
+            long long lBound = 0;
+            long long uBound = numPoints - 1;
+            while (ind != lBound || ind != uBound)
+            {
+                if (p < probs[ind])
+                {
+                    uBound = ind;
+                }
+                else
+                {
+                    lBound = ind + 1;
+                }
+                ind = lBound + ((uBound - lBound)/2);
+            }
+            csamples[firstNewSample + j] = KMeansPoint(pts, ind);
+        }
+        totalSamples += sampPerIter;
+    }
+    delete[] lowestDistances;
+    //Weight the points, each thread counting into its own array
+    const int numThreads = omp_get_max_threads();
+    long long* weights = (long long*)calloc(totalSamples, sizeof(long long));
+    long long* threadWeights = (long long*)calloc(numThreads * totalSamples, sizeof(long long));
+    #pragma omp parallel num_threads(numThreads)
+    {
+        long long* tweights = threadWeights + omp_get_thread_num() * totalSamples;
+        #pragma omp for
+        for (long long i = 0; i < numPoints; i++)
+        {
+            if (pweights[i] == 0) continue; //Ignore 'transparent' colours
+            ColourOkLabA col = KMeansPoint(pts, i);
+            float lowestDistance = 999999999999999999999999.9;
+            int chosenColour = 0;
+            for (int j = 0; j < totalSamples; j++)
+            {
+                const float dist = KMeansDistSq(col, csamples[j], uvbias);
+                if (dist < lowestDistance)
+                {
+                    lowestDistance = dist;
+                    chosenColour = j;
+                }
+            }
+            tweights[chosenColour] += pweights[i];
+        }
+    }
+    for (int t = 0; t < numThreads; t++)
+    {
+        for (int j = 0; j < totalSamples; j++)
+        {
+            weights[j] += threadWeights[t * totalSamples + j];
+        }
+    }
+    free(threadWeights);
+    //Recluster according to k-means++
+    KMean* initM = &means[0];
+    rnum = rng() % totalSamples;
+    initM->mean = csamples[rnum];
+    for (int i = 1; i < numMeans; i++)
+    {
+        //Cost calculation
+        for (int j = 0; j < totalSamples; j++)
+        {
+            ColourOkLabA col = csamples[j];
+            if (col.A == 0.0f) //Ignore 'transparent' colours
+            {
+                probs[j] = 0.0;
+                continue;
+            }
+            float lowestDistance = 999999999999999999999999.9;
+            for (int k = 0; k < i; k++)
+            {
+                const float dist = KMeansDistSq(col, means[k].mean, uvbias);
+                if (dist < lowestDistance)
+                {
+                    lowestDistance = dist;
+                }
+            }
+            probs[j] = (double)lowestDistance;
+        }
+        double cumProb = 0.0; //hee hee
+        for (long long j = 0; j < totalSamples; j++)
+        {
+            cumProb += probs[j] * ((double)weights[j]);
+            probs[j] = cumProb;
+        }
+        double p = KMeansUnitDouble(rng()) * cumProb;
+        int ind = totalSamples/2;
+        int lBound = 0;
+        int uBound = totalSamples - 1;
+        while (ind != lBound || ind != uBound)
+        {
+            if (p < probs[ind])
+            {
+                uBound = ind;
+            }
+            else
+            {
+                lBound = ind + 1;
+            }
+            ind = lBound + ((uBound - lBound)/2);
+        }
+        means[i].mean = csamples[ind];
+    }
+
+    delete[] probs;
+    free(weights);
+    delete[] csamples;
+    for (int i = 0; i < numMeans; i++)
+    {
+        outMeans[i] = means[i].mean;
+    }
+}
+
+static inline void ZeroKMeanPartialSums(KMeanPartialSum* sums, int numSums)
+{
+    for (int i = 0; i < numSums; i++)
+    {
+        KMeanPartialSum* m = &sums[i];
+        m->numInCluster = 0;
+        m->sumL = 0; m->suma = 0; m->sumb = 0;
+    }
+}
+
+static inline void AddToKMean(KMeanPartialSum* m, ColourOkLabA col, unsigned int weight)
+{
+    const long long lweight = (long long)weight;
+    m->sumL += lweight * lrintf(col.L * KMEANS_FIXED_ONE);
+    m->suma += lweight * lrintf(col.a * KMEANS_FIXED_ONE);
+    m->sumb += lweight * lrintf(col.b * KMEANS_FIXED_ONE);
+    m->numInCluster += weight;
+}
+
+//Adds up every thread's sums
+static void MergeKMeanPartialSums(KMean* means, int numMeans, const KMeanPartialSum* partialSums, int numThreads)
+{
+    for (int i = 0; i < numMeans; i++)
+    {
+        KMean* m = &means[i];
+        m->lastmean = m->mean;
+        m->numInCluster = 0;
+        m->sumL = 0; m->suma = 0; m->sumb = 0;
+        for (int t = 0; t < numThreads; t++)
+        {
+            const KMeanPartialSum* p = &partialSums[t * numMeans + i];
+            m->sumL += p->sumL;
+            m->suma += p->suma;
+            m->sumb += p->sumb;
+            m->numInCluster += p->numInCluster;
+        }
+    }
+}
+
+//Moves every mean to the centroid of its cluster and returns the total distance moved, with each mean's own distance in moved
+static double UpdateKMeans(KMean* means, int numMeans, float uvbias, bool is8BitColour, std::mt19937_64& rng, float* moved)
+{
+    double meandiff = 0.0;
+    for (int i = 0; i < numMeans; i++)
+    {
+        KMean* m = &means[i];
+        ColourOkLabA meancol;
+        if (m->numInCluster <= 0) //Fallback because of suspected division by zero errors;
+        {
+            meancol.L = (KMeansRandomFloat(rng) * 0.5f) + 0.5f;
+            meancol.a = KMeansRandomFloat(rng) * 0.5f;
+            meancol.b = KMeansRandomFloat(rng) * 0.5f;
+        }
+        else
+        {
+            const double scale = 1.0/(((double)KMEANS_FIXED_ONE) * ((double)m->numInCluster));
+            meancol.L = ((double)m->sumL) * scale;
+            meancol.a = ((double)m->suma) * scale;
+            meancol.b = ((double)m->sumb) * scale;
+        }
+        meancol.A = 1.0f;
+        if (is8BitColour) meancol = RoundTripLabA8bpc(meancol);
+        else meancol = RoundTripLabA4bpc(meancol);
+        m->mean = meancol;
+        const double dL = (((double)m->mean.L) - ((double)m->lastmean.L)) * ((double)uvbias);
+        const double da = ((double)m->mean.a) - ((double)m->lastmean.a);
+        const double db = ((double)m->mean.b) - ((double)m->lastmean.b);
+        const double dist = sqrt((dL * dL) + (da * da) + (db * db));
+        moved[i] = (float)dist;
+        meandiff += dist;
+    }
+    return meandiff;
+}
+
+//Plain Lloyd's algorithm, every point is compared against every mean on every iteration
+static int IterateKMeansLloyd(const KMeansPoints* pts, KMean* means, int numMeans, float uvbias, bool is8BitColour, std::mt19937_64& rng)
+{
+    const long long numPoints = pts->numPoints;
+    const unsigned int* pweights = pts->weights;
+    const int numThreads = omp_get_max_threads();
+    KMeanPartialSum* partialSums = new KMeanPartialSum[numThreads * numMeans];
+    NearestColourSoA* meanSoA = new NearestColourSoA;
+    float moved[256];
+    int iterations = 0;
+    int iterationsLeft = 100 + numMeans;
+    while (iterationsLeft > 0)
+    {
+        //Associate each colour with the closest mean
+        FillKMeansSoA(meanSoA, means, numMeans, uvbias);
+        ZeroKMeanPartialSums(partialSums, numThreads * numMeans); //All of them, in case the team ends up smaller
+        #pragma omp parallel num_threads(numThreads)
+        {
+            KMeanPartialSum* sums = &partialSums[omp_get_thread_num() * numMeans];
+            #pragma omp for
+            for (long long i = 0; i < numPoints; i++)
+            {
+                const unsigned int weight = pweights[i];
+                if (weight == 0) continue; //Ignore 'transparent' colours
+                ColourOkLabA col = KMeansPoint(pts, i);
+                const int chosenColour = FindNearestColourSoA(meanSoA, col);
+                AddToKMean(&sums[chosenColour], col, weight);
+            }
+        }
+        MergeKMeanPartialSums(means, numMeans, partialSums, numThreads);
+
+        double meandiff = UpdateKMeans(means, numMeans, uvbias, is8BitColour, rng, moved);
+        iterations++;
+        if (meandiff == 0.0) iterationsLeft = 0; //Break out if convergence has been reached
+        iterationsLeft--;
+    }
+    delete[] partialSums;
+    delete meanSoA;
+    return iterations;
+}
+
+//Absorbs the rounding error in the bounds, so that a point is never skipped when a full search could have moved it
+#define KMEANS_BOUND_SLACK 1e-6f
+
+//Hamerly's algorithm: each point keeps an upper bound on the distance to its own mean and a lower bound on the distance to every other mean
+//While the upper bound is below both the lower bound and half the distance to the nearest other mean, the point can't change cluster
+//The assignments (and so the result) are the same as Lloyd's algorithm, which is still used whenever a point has to be searched
+static int IterateKMeansHamerly(const KMeansPoints* pts, KMean* means, int numMeans, float uvbias, bool is8BitColour, std::mt19937_64& rng)
+{
+    const long long numPoints = pts->numPoints;
+    const unsigned int* pweights = pts->weights;
+    int* assigned = new int[numPoints];
+    float* upper = new float[numPoints];
+    float* lower = new float[numPoints];
+    const int numThreads = omp_get_max_threads();
+    KMeanPartialSum* partialSums = new KMeanPartialSum[numThreads * numMeans];
+    NearestColourSoA* meanSoA = new NearestColourSoA;
+    float moved[256];
+    float halfNearest[256];
+    int iterations = 0;
+    int iterationsLeft = 100 + numMeans;
+    while (iterationsLeft > 0)
+    {
+        for (int i = 0; i < numMeans; i++)
+        {
+            float nearest = 999999999999999999999999.9;
+            for (int j = 0; j < numMeans; j++)
+            {
+                if (j == i) continue;
+                const float dist = KMeansDistSq(means[i].mean, means[j].mean, uvbias);
+                if (dist < nearest) nearest = dist;
+            }
+            halfNearest[i] = 0.5f * sqrtf(nearest);
+        }
+        FillKMeansSoA(meanSoA, means, numMeans, uvbias);
+
+        ZeroKMeanPartialSums(partialSums, numThreads * numMeans); //All of them, in case the team ends up smaller
+        #pragma omp parallel num_threads(numThreads)
+        {
+            KMeanPartialSum* sums = &partialSums[omp_get_thread_num() * numMeans];
+            #pragma omp for
+            for (long long i = 0; i < numPoints; i++)
+            {
+                const unsigned int weight = pweights[i];
+                if (weight == 0) continue; //Ignore 'transparent' colours
+                ColourOkLabA col = KMeansPoint(pts, i);
+                if (iterations > 0)
+                {
+                    int a = assigned[i];
+                    const float bound = (lower[i] > halfNearest[a]) ? lower[i] : halfNearest[a];
+                    if (upper[i] < bound)
+                    {
+                        AddToKMean(&sums[a], col, weight);
+                        continue;
+                    }
+                    upper[i] = sqrtf(KMeansDistSq(col, means[a].mean, uvbias)) + KMEANS_BOUND_SLACK;
+                    if (upper[i] < bound)
+                    {
+                        AddToKMean(&sums[a], col, weight);
+                        continue;
+                    }
+                }
+                float lowestDistance, secondDistance;
+                const int chosenColour = FindNearestTwoColoursSoA(meanSoA, col, &lowestDistance, &secondDistance);
+                assigned[i] = chosenColour;
+                upper[i] = sqrtf(lowestDistance) + KMEANS_BOUND_SLACK;
+                lower[i] = sqrtf(secondDistance) - KMEANS_BOUND_SLACK;
+                AddToKMean(&sums[chosenColour], col, weight);
+            }
+        }
+        MergeKMeanPartialSums(means, numMeans, partialSums, numThreads);
+
+        double meandiff = UpdateKMeans(means, numMeans, uvbias, is8BitColour, rng, moved);
+        iterations++;
+        if (meandiff == 0.0) break; //Break out if convergence has been reached
+        iterationsLeft--;
+
+        //Loosen the bounds by how far the means moved
+        int furthest = 0;
+        float secondFurthest = 0.0f;
+        for (int i = 1; i < numMeans; i++)
+        {
+            if (moved[i] > moved[furthest])
+            {
+                secondFurthest = moved[furthest];
+                furthest = i;
+            }
+            else if (moved[i] > secondFurthest)
+            {
+                secondFurthest = moved[i];
+            }
+        }
+        #pragma omp parallel for
+        for (long long i = 0; i < numPoints; i++)
+        {
+            if (pweights[i] == 0) continue;
+            const int a = assigned[i];
+            upper[i] += moved[a] + KMEANS_BOUND_SLACK;
+            lower[i] -= ((a == furthest) ? secondFurthest : moved[furthest]) + KMEANS_BOUND_SLACK;
+        }
+    }
+    delete[] assigned;
+    delete[] upper;
+    delete[] lower;
+    delete[] partialSums;
+    delete meanSoA;
+    return iterations;
+}
+
+int IterateKMeans(const KMeansPoints* pts, ColourOkLabA* inOutMeans, int numMeans, float uvbias, bool is8BitColour, std::mt19937_64& rng, int engine)
+{
+    KMean means[256];
+    for (int i = 0; i < numMeans; i++)
+    {
+        means[i].mean = inOutMeans[i];
+    }
+    int iterations;
+    if (engine == KMEANS_ENGINE_LLOYD) iterations = IterateKMeansLloyd(pts, means, numMeans, uvbias, is8BitColour, rng);
+    else iterations = IterateKMeansHamerly(pts, means, numMeans, uvbias, is8BitColour, rng);
+    for (int i = 0; i < numMeans; i++)
+    {
+        inOutMeans[i] = means[i].mean;
+    }
+    return iterations;
+}
+
+int RunKMeans(const KMeansPoints* pts, ColourOkLabA* means, int numMeans, float uvbias, bool is8BitColour, std::mt19937_64& rng, int engine)
+{
+    SeedKMeans(pts, means, numMeans, uvbias, rng);
+    return IterateKMeans(pts, means, numMeans, uvbias, is8BitColour, rng, engine);
+}
+
+//Mini-batch k-means (Sculley 2010): each batch is a random handful of points, and each mean steps towards the points assigned to it
+//The step size is the point's share of everything the mean has seen so far, so each mean tracks the running mean of its points
+#define KMEANS_MINIBATCH_SEED_POINTS 65536
+#define KMEANS_MINIBATCH_MAX_BATCHES 1000
+#define KMEANS_MINIBATCH_PATIENCE 10
+#define KMEANS_MINIBATCH_SMOOTHING 0.1
+
+void GatherKMeansPoints(const void* context, const long long* indices, int n, KMeansPoints* out)
+{
+    const KMeansPoints* pts = (const KMeansPoints*)context;
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++)
+    {
+        const long long ind = indices[i];
+        out->L[i] = pts->L[ind];
+        out->a[i] = pts->a[ind];
+        out->b[i] = pts->b[ind];
+        out->weights[i] = pts->weights[ind];
+    }
+}
+
+int RunMiniBatchKMeans(const KMeansPointSource* src, ColourOkLabA* means, int numMeans, float uvbias, bool is8BitColour, std::mt19937_64& rng, int batchSize)
+{
+    const long long numPoints = src->numPoints;
+    if (batchSize < 1) batchSize = 1;
+
+    //Seed from a fixed size random sample of the points, or all of them if there aren't that many
+    const int numSeedPoints = (numPoints <= KMEANS_MINIBATCH_SEED_POINTS) ? (int)numPoints : KMEANS_MINIBATCH_SEED_POINTS;
+    KMeansPoints seedPts;
+    AllocKMeansPoints(&seedPts, numSeedPoints);
+    long long* seedIndices = new long long[numSeedPoints];
+    if (numPoints <= KMEANS_MINIBATCH_SEED_POINTS)
+    {
+        for (int i = 0; i < numSeedPoints; i++)
+        {
+            seedIndices[i] = i;
+        }
+    }
+    else
+    {
+        const unsigned long long seedKey = rng();
+        for (int i = 0; i < numSeedPoints; i++)
+        {
+            seedIndices[i] = CounterRandom(seedKey, i) % numPoints;
+        }
+    }
+    src->Gather(src->context, seedIndices, numSeedPoints, &seedPts);
+    delete[] seedIndices;
+    SeedKMeans(&seedPts, means, numMeans, uvbias, rng);
+    FreeKMeansPoints(&seedPts);
+
+    long long* batchIndices = new long long[batchSize];
+    KMeansPoints batchPts;
+    AllocKMeansPoints(&batchPts, batchSize);
+    const unsigned int* pweights = batchPts.weights;
+    int* batchAssigned = new int[batchSize];
+    float* batchDistances = new float[batchSize];
+    double seen[256];
+    for (int i = 0; i < numMeans; i++)
+    {
+        seen[i] = 0.0;
+    }
+    //Smoothed cost per unit weight, the search stops once it hasn't improved for a while
+    double smoothedCost = 0.0;
+    double bestCost = 0.0;
+    int sinceBest = 0;
+    int batches = 0;
+    while (batches < KMEANS_MINIBATCH_MAX_BATCHES)
+    {
+        //Assign the batch to the current means
+        const unsigned long long batchKey = rng();
+        for (int j = 0; j < batchSize; j++)
+        {
+            batchIndices[j] = CounterRandom(batchKey, j) % numPoints;
+        }
+        src->Gather(src->context, batchIndices, batchSize, &batchPts);
+        #pragma omp parallel for
+        for (int j = 0; j < batchSize; j++)
+        {
+            if (pweights[j] == 0) continue; //Ignore 'transparent' colours
+            ColourOkLabA col = KMeansPoint(&batchPts, j);
+            float lowestDistance = 999999999999999999999999.9;
+            int chosenColour = 0;
+            for (int k = 0; k < numMeans; k++)
+            {
+                const float dist = KMeansDistSq(col, means[k], uvbias);
+                if (dist < lowestDistance)
+                {
+                    lowestDistance = dist;
+                    chosenColour = k;
+                }
+            }
+            batchAssigned[j] = chosenColour;
+            batchDistances[j] = lowestDistance;
+        }
+
+        //Step the means towards their points, in batch order so that the result doesn't depend on the threads
+        double batchCost = 0.0;
+        double batchWeight = 0.0;
+        for (int j = 0; j < batchSize; j++)
+        {
+            const unsigned int weight = pweights[j];
+            if (weight == 0) continue;
+            const double fweight = (double)weight;
+            const int k = batchAssigned[j];
+            seen[k] += fweight;
+            const float rate = (float)(fweight/seen[k]);
+            ColourOkLabA* m = &means[k];
+            m->L += rate * (batchPts.L[j] - m->L);
+            m->a += rate * (batchPts.a[j] - m->a);
+            m->b += rate * (batchPts.b[j] - m->b);
+            batchCost += fweight * batchDistances[j];
+            batchWeight += fweight;
+        }
+        batches++;
+        if (batchWeight == 0.0) continue;
+
+        //Convergence detection
+        const double cost = batchCost/batchWeight;
+        if (batches == 1)
+        {
+            smoothedCost = cost;
+            bestCost = cost;
+            continue;
+        }
+        smoothedCost = (smoothedCost * (1.0 - KMEANS_MINIBATCH_SMOOTHING)) + (cost * KMEANS_MINIBATCH_SMOOTHING);
+        if (smoothedCost < bestCost)
+        {
+            bestCost = smoothedCost;
+            sinceBest = 0;
+        }
+        else if (++sinceBest >= KMEANS_MINIBATCH_PATIENCE)
+        {
+            break;
+        }
+    }
+    delete[] batchIndices;
+    FreeKMeansPoints(&batchPts);
+    delete[] batchAssigned;
+    delete[] batchDistances;
+
+    for (int i = 0; i < numMeans; i++)
+    {
+        means[i].A = 1.0f;
+        if (is8BitColour) means[i] = RoundTripLabA8bpc(means[i]);
+        else means[i] = RoundTripLabA4bpc(means[i]);
+    }
+    return batches;
+}
+
+int RunMiniBatchKMeans(const KMeansPoints* pts, ColourOkLabA* means, int numMeans, float uvbias, bool is8BitColour, std::mt19937_64& rng, int batchSize, bool refine)
+{
+    const KMeansPointSource src = { pts->numPoints, GatherKMeansPoints, pts };
+    int batches = RunMiniBatchKMeans(&src, means, numMeans, uvbias, is8BitColour, rng, batchSize);
+    if (refine) batches += IterateKMeans(pts, means, numMeans, uvbias, is8BitColour, rng, KMEANS_ENGINE_HAMERLY);
+    return batches;
+}
@@ -0,0 +1,75 @@
+/* gpitool - Converts images into .GPI format
+ * Copyright (c) 2024 Maxim Hoxha
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * K-means clustering for palette generation
+ */
+
+#pragma once
+
+#include <random>
+#include "imagehandler.h"
+
+//Points to cluster in structure of arrays form, each with an integer weight (zero weight points are ignored)
+typedef struct KMeansPoints
+{
+    float* L;
+    float* a;
+    float* b;
+    unsigned int* weights;
+    long long numPoints;
+} KMeansPoints;
+
+enum kMeansEngines
+{
+    KMEANS_ENGINE_LLOYD,
+    KMEANS_ENGINE_HAMERLY //Same result as Lloyd's algorithm, but skips most distance calculations once the means settle down
+};
+
+void AllocKMeansPoints(KMeansPoints* pts, long long numPoints);
+void FreeKMeansPoints(KMeansPoints* pts);
+
+//Picks the starting means with k-means|| followed by weighted k-means++ over the samples
+void SeedKMeans(const KMeansPoints* pts, ColourOkLabA* means, int numMeans, float uvbias, std::mt19937_64& rng);
+//Moves the means until they stop, and returns the number of iterations taken
+//Means are snapped to the palette bit depth after every iteration, so the result is always representable
+int IterateKMeans(const KMeansPoints* pts, ColourOkLabA* means, int numMeans, float uvbias, bool is8BitColour, std::mt19937_64& rng, int engine = KMEANS_ENGINE_HAMERLY);
+//Seeds and iterates the means
+int RunKMeans(const KMeansPoints* pts, ColourOkLabA* means, int numMeans, float uvbias, bool is8BitColour, std::mt19937_64& rng, int engine = KMEANS_ENGINE_HAMERLY);
+
+//Where mini-batch k-means draws its points from, so that they never have to all be in memory at once
+//Gather puts the points at the n given indices into the first n points of out, and may run its own parallel loop
+typedef struct KMeansPointSource
+{
+    long long numPoints;
+    void (*Gather)(const void* context, const long long* indices, int n, KMeansPoints* out);
+    const void* context;
+} KMeansPointSource;
+
+//Gather for points that are all in memory already, the context being their KMeansPoints
+void GatherKMeansPoints(const void* context, const long long* indices, int n, KMeansPoints* out);
+
+//Mini-batch k-means for very large inputs: seeds from a sample of the points, then moves the means with batches of batchSize random points
+//until the cost stops improving. Only the seeding sample or one batch is ever gathered at once, so memory use doesn't grow with the number of points.
+//Returns the number of batches
+int RunMiniBatchKMeans(const KMeansPointSource* src, ColourOkLabA* means, int numMeans, float uvbias, bool is8BitColour, std::mt19937_64& rng, int batchSize);
+//As above over points in memory, optionally finishing off with full passes of Hamerly's algorithm over them
+//Returns the number of batches plus the number of full iterations
+int RunMiniBatchKMeans(const KMeansPoints* pts, ColourOkLabA* means, int numMeans, float uvbias, bool is8BitColour, std::mt19937_64& rng, int batchSize, bool refine);
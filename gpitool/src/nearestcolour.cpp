@@ -0,0 +1,736 @@
+/* gpitool - Converts images into .GPI format
+ * Copyright (c) 2024 Maxim Hoxha
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Nearest palette colour queries
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <omp.h>
+#include "nearestcolour.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NEARESTCOLOUR_X86
+#include <immintrin.h>
+#endif
+
+//Below this the contrast factor is treated as zero and the query colours are adjusted instead
+#define NEARESTCOLOUR_MIN_FOLD 1e-6f
+//Padding entries are far enough away to never be chosen, but not so far that their squared distance overflows
+#define NEARESTCOLOUR_PAD_VALUE 1e15f
+//Tiny palettes aren't worth a vector scan
+#define NEARESTCOLOUR_MIN_SIMD_ENTRIES 8
+
+NearestColourIndex::NearestColourIndex()
+{
+    numNodes = 0;
+    numEntries = 0;
+    useTree = false;
+    foldAdjust = true;
+    builtBright = 0.0f;
+    builtContrast = 0.0f;
+    builtBias = 1.0f;
+    isBuilt = false;
+}
+
+void FillNearestColourSoA(NearestColourSoA* soa, const ColourOkLabA* cols, int numColours, float uvbias, int kernel)
+{
+    if (numColours > NEARESTCOLOUR_MAX_ENTRIES) numColours = NEARESTCOLOUR_MAX_ENTRIES;
+    if (kernel == CONVERT_AUTO) kernel = GetBestConvertKernel();
+    const int width = (kernel == CONVERT_AVX512) ? 16 : ((kernel == CONVERT_AVX2) ? 8 : 4);
+    int numPadded = ((numColours + width - 1) / width) * width;
+    if (numPadded == 0) numPadded = width;
+    for (int i = 0; i < numColours; i++)
+    {
+        soa->L[i] = cols[i].L;
+        soa->a[i] = cols[i].a;
+        soa->b[i] = cols[i].b;
+    }
+    for (int i = numColours; i < numPadded; i++)
+    {
+        soa->L[i] = NEARESTCOLOUR_PAD_VALUE;
+        soa->a[i] = NEARESTCOLOUR_PAD_VALUE;
+        soa->b[i] = NEARESTCOLOUR_PAD_VALUE;
+    }
+    soa->uvbias = uvbias;
+    soa->numEntries = numColours;
+    soa->numPadded = numPadded;
+    soa->kernel = kernel;
+}
+
+static int FindNearestScalar(const NearestColourSoA* soa, ColourOkLabA col, float* outLowest, float* outSecond)
+{
+    float lowestDistance = 999999999999999999999999.9;
+    float secondDistance = 999999999999999999999999.9;
+    int chosen = 0;
+    for (int i = 0; i < soa->numEntries; i++)
+    {
+        const float dL = (col.L - soa->L[i]) * soa->uvbias;
+        const float da = col.a - soa->a[i];
+        const float db = col.b - soa->b[i];
+        const float dist = (dL * dL) + (da * da) + (db * db);
+        if (dist < lowestDistance)
+        {
+            secondDistance = lowestDistance;
+            lowestDistance = dist;
+            chosen = i;
+        }
+        else if (dist < secondDistance)
+        {
+            secondDistance = dist;
+        }
+    }
+    *outLowest = lowestDistance;
+    *outSecond = secondDistance;
+    return chosen;
+}
+
+//Each lane keeps its own lowest and second lowest, visiting its entries in index order, and the lanes are combined at the end
+static int ReduceNearestLanes(const float* lowest, const float* second, const int* index, int width, float* outLowest, float* outSecond)
+{
+    int bestLane = 0;
+    for (int i = 1; i < width; i++)
+    {
+        if (lowest[i] < lowest[bestLane] || (lowest[i] == lowest[bestLane] && index[i] < index[bestLane])) bestLane = i;
+    }
+    float secondDistance = 999999999999999999999999.9;
+    for (int i = 0; i < width; i++)
+    {
+        if (i != bestLane && lowest[i] < secondDistance) secondDistance = lowest[i];
+        if (second[i] < secondDistance) secondDistance = second[i];
+    }
+    *outLowest = lowest[bestLane];
+    *outSecond = secondDistance;
+    return index[bestLane];
+}
+
+#ifdef NEARESTCOLOUR_X86
+//No FMA in these, so that the distances are exactly the ones the scalar scan gets
+__attribute__((target("sse2"))) static int FindNearestSSE2(const NearestColourSoA* soa, ColourOkLabA col, float* outLowest, float* outSecond)
+{
+    const __m128 qL = _mm_set1_ps(col.L);
+    const __m128 qa = _mm_set1_ps(col.a);
+    const __m128 qb = _mm_set1_ps(col.b);
+    const __m128 bias = _mm_set1_ps(soa->uvbias);
+    __m128 lowest = _mm_set1_ps(999999999999999999999999.9f);
+    __m128 second = lowest;
+    __m128i chosen = _mm_setzero_si128();
+    __m128i index = _mm_set_epi32(3, 2, 1, 0);
+    const __m128i step = _mm_set1_epi32(4);
+    for (int i = 0; i < soa->numPadded; i += 4)
+    {
+        const __m128 dL = _mm_mul_ps(_mm_sub_ps(qL, _mm_load_ps(soa->L + i)), bias);
+        const __m128 da = _mm_sub_ps(qa, _mm_load_ps(soa->a + i));
+        const __m128 db = _mm_sub_ps(qb, _mm_load_ps(soa->b + i));
+        const __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dL, dL), _mm_mul_ps(da, da)), _mm_mul_ps(db, db));
+        const __m128 closer = _mm_cmplt_ps(dist, lowest);
+        second = _mm_or_ps(_mm_and_ps(closer, lowest), _mm_andnot_ps(closer, _mm_min_ps(second, dist)));
+        lowest = _mm_or_ps(_mm_and_ps(closer, dist), _mm_andnot_ps(closer, lowest));
+        const __m128i closeri = _mm_castps_si128(closer);
+        chosen = _mm_or_si128(_mm_and_si128(closeri, index), _mm_andnot_si128(closeri, chosen));
+        index = _mm_add_epi32(index, step);
+    }
+    alignas(16) float lowestLanes[4];
+    alignas(16) float secondLanes[4];
+    alignas(16) int chosenLanes[4];
+    _mm_store_ps(lowestLanes, lowest);
+    _mm_store_ps(secondLanes, second);
+    _mm_store_si128((__m128i*)chosenLanes, chosen);
+    return ReduceNearestLanes(lowestLanes, secondLanes, chosenLanes, 4, outLowest, outSecond);
+}
+
+//Minimum in every lane
+__attribute__((target("avx2"))) static inline __m256 HorizontalMinAVX2(__m256 x)
+{
+    x = _mm256_min_ps(x, _mm256_permute2f128_ps(x, x, 1));
+    x = _mm256_min_ps(x, _mm256_shuffle_ps(x, x, 0x4E));
+    return _mm256_min_ps(x, _mm256_shuffle_ps(x, x, 0xB1));
+}
+
+__attribute__((target("avx2"))) static inline __m256i HorizontalMinEpi32AVX2(__m256i x)
+{
+    x = _mm256_min_epi32(x, _mm256_permute2x128_si256(x, x, 1));
+    x = _mm256_min_epi32(x, _mm256_shuffle_epi32(x, 0x4E));
+    return _mm256_min_epi32(x, _mm256_shuffle_epi32(x, 0xB1));
+}
+
+__attribute__((target("avx2"))) static int FindNearestAVX2(const NearestColourSoA* soa, ColourOkLabA col, float* outLowest, float* outSecond)
+{
+    const __m256 qL = _mm256_set1_ps(col.L);
+    const __m256 qa = _mm256_set1_ps(col.a);
+    const __m256 qb = _mm256_set1_ps(col.b);
+    const __m256 bias = _mm256_set1_ps(soa->uvbias);
+    __m256 lowest = _mm256_set1_ps(999999999999999999999999.9f);
+    __m256 second = lowest;
+    __m256i chosen = _mm256_setzero_si256();
+    __m256i index = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    const __m256i step = _mm256_set1_epi32(8);
+    for (int i = 0; i < soa->numPadded; i += 8)
+    {
+        const __m256 dL = _mm256_mul_ps(_mm256_sub_ps(qL, _mm256_load_ps(soa->L + i)), bias);
+        const __m256 da = _mm256_sub_ps(qa, _mm256_load_ps(soa->a + i));
+        const __m256 db = _mm256_sub_ps(qb, _mm256_load_ps(soa->b + i));
+        const __m256 dist = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dL, dL), _mm256_mul_ps(da, da)), _mm256_mul_ps(db, db));
+        const __m256 closer = _mm256_cmp_ps(dist, lowest, _CMP_LT_OQ);
+        second = _mm256_blendv_ps(_mm256_min_ps(second, dist), lowest, closer);
+        lowest = _mm256_blendv_ps(lowest, dist, closer);
+        chosen = _mm256_blendv_epi8(chosen, index, _mm256_castps_si256(closer));
+        index = _mm256_add_epi32(index, step);
+    }
+    //Ties between lanes go to the lowest index, and the chosen lane's lowest can't also be the second lowest
+    const __m256 lowestAll = HorizontalMinAVX2(lowest);
+    const __m256i tied = _mm256_castps_si256(_mm256_cmp_ps(lowest, lowestAll, _CMP_EQ_OQ));
+    const __m256i chosenAll = HorizontalMinEpi32AVX2(_mm256_blendv_epi8(_mm256_set1_epi32(0x7FFFFFFF), chosen, tied));
+    const __m256 others = _mm256_blendv_ps(lowest, _mm256_set1_ps(999999999999999999999999.9f), _mm256_castsi256_ps(_mm256_cmpeq_epi32(chosen, chosenAll)));
+    *outLowest = _mm_cvtss_f32(_mm256_castps256_ps128(lowestAll));
+    *outSecond = _mm_cvtss_f32(_mm256_castps256_ps128(HorizontalMinAVX2(_mm256_min_ps(second, others))));
+    return _mm_cvtsi128_si32(_mm256_castsi256_si128(chosenAll));
+}
+
+__attribute__((target("avx512f"))) static inline __m512 HorizontalMinAVX512(__m512 x)
+{
+    x = _mm512_min_ps(x, _mm512_shuffle_f32x4(x, x, 0x4E));
+    x = _mm512_min_ps(x, _mm512_shuffle_f32x4(x, x, 0xB1));
+    x = _mm512_min_ps(x, _mm512_permute_ps(x, 0x4E));
+    return _mm512_min_ps(x, _mm512_permute_ps(x, 0xB1));
+}
+
+__attribute__((target("avx512f"))) static inline __m512i HorizontalMinEpi32AVX512(__m512i x)
+{
+    x = _mm512_min_epi32(x, _mm512_shuffle_i32x4(x, x, 0x4E));
+    x = _mm512_min_epi32(x, _mm512_shuffle_i32x4(x, x, 0xB1));
+    x = _mm512_min_epi32(x, _mm512_shuffle_epi32(x, (_MM_PERM_ENUM)0x4E));
+    return _mm512_min_epi32(x, _mm512_shuffle_epi32(x, (_MM_PERM_ENUM)0xB1));
+}
+
+__attribute__((target("avx512f"))) static int FindNearestAVX512(const NearestColourSoA* soa, ColourOkLabA col, float* outLowest, float* outSecond)
+{
+    const __m512 qL = _mm512_set1_ps(col.L);
+    const __m512 qa = _mm512_set1_ps(col.a);
+    const __m512 qb = _mm512_set1_ps(col.b);
+    const __m512 bias = _mm512_set1_ps(soa->uvbias);
+    __m512 lowest = _mm512_set1_ps(999999999999999999999999.9f);
+    __m512 second = lowest;
+    __m512i chosen = _mm512_setzero_si512();
+    __m512i index = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    const __m512i step = _mm512_set1_epi32(16);
+    for (int i = 0; i < soa->numPadded; i += 16)
+    {
+        const __m512 dL = _mm512_mul_ps(_mm512_sub_ps(qL, _mm512_load_ps(soa->L + i)), bias);
+        const __m512 da = _mm512_sub_ps(qa, _mm512_load_ps(soa->a + i));
+        const __m512 db = _mm512_sub_ps(qb, _mm512_load_ps(soa->b + i));
+        //The explicit rounding forms can't be fused into FMAs, and AVX-512 always has those
+        const __m512 dist = _mm512_add_round_ps(_mm512_add_round_ps(_mm512_mul_ps(dL, dL), _mm512_mul_ps(da, da), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), _mm512_mul_ps(db, db), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        const __mmask16 closer = _mm512_cmp_ps_mask(dist, lowest, _CMP_LT_OQ);
+        second = _mm512_mask_blend_ps(closer, _mm512_min_ps(second, dist), lowest);
+        lowest = _mm512_mask_blend_ps(closer, lowest, dist);
+        chosen = _mm512_mask_blend_epi32(closer, chosen, index);
+        index = _mm512_add_epi32(index, step);
+    }
+    const __m512 lowestAll = HorizontalMinAVX512(lowest);
+    const __mmask16 tied = _mm512_cmp_ps_mask(lowest, lowestAll, _CMP_EQ_OQ);
+    const __m512i chosenAll = HorizontalMinEpi32AVX512(_mm512_mask_blend_epi32(tied, _mm512_set1_epi32(0x7FFFFFFF), chosen));
+    const __mmask16 chosenLane = _mm512_cmpeq_epi32_mask(chosen, chosenAll);
+    const __m512 others = _mm512_mask_blend_ps(chosenLane, lowest, _mm512_set1_ps(999999999999999999999999.9f));
+    *outLowest = _mm512_cvtss_f32(lowestAll);
+    *outSecond = _mm512_cvtss_f32(HorizontalMinAVX512(_mm512_min_ps(second, others)));
+    return _mm_cvtsi128_si32(_mm512_castsi512_si128(chosenAll));
+}
+#endif
+
+int FindNearestTwoColoursSoA(const NearestColourSoA* soa, ColourOkLabA col, float* outLowest, float* outSecond)
+{
+    switch (soa->kernel)
+    {
+#ifdef NEARESTCOLOUR_X86
+        case CONVERT_SSE2:
+            return FindNearestSSE2(soa, col, outLowest, outSecond);
+        case CONVERT_AVX2:
+            return FindNearestAVX2(soa, col, outLowest, outSecond);
+        case CONVERT_AVX512:
+            return FindNearestAVX512(soa, col, outLowest, outSecond);
+#endif
+        default:
+            return FindNearestScalar(soa, col, outLowest, outSecond);
+    }
+}
+
+int FindNearestColourSoA(const NearestColourSoA* soa, ColourOkLabA col, float* outDist)
+{
+    if (soa->kernel == CONVERT_SCALAR) //Not worth keeping the second lowest for
+    {
+        float lowestDistance = 999999999999999999999999.9;
+        int chosen = 0;
+        for (int i = 0; i < soa->numEntries; i++)
+        {
+            const float dL = (col.L - soa->L[i]) * soa->uvbias;
+            const float da = col.a - soa->a[i];
+            const float db = col.b - soa->b[i];
+            const float dist = (dL * dL) + (da * da) + (db * db);
+            if (dist < lowestDistance)
+            {
+                lowestDistance = dist;
+                chosen = i;
+            }
+        }
+        if (outDist != nullptr) *outDist = lowestDistance;
+        return chosen;
+    }
+    float lowest, second;
+    int chosen = FindNearestTwoColoursSoA(soa, col, &lowest, &second);
+    if (outDist != nullptr) *outDist = lowest;
+    return chosen;
+}
+
+//Fills in nodes[node], taking new slots for its children from numNodes
+static void BuildNearestColourNode(NearestColourNode* nodes, int node, int* numNodes, float* coords[3], int* entry, int first, int count)
+{
+    NearestColourNode* n = &nodes[node];
+    n->first = first;
+    n->count = count;
+    n->axis = -1;
+    n->child = -1;
+    n->split = 0.0f;
+    if (count <= NEARESTCOLOUR_LEAF_SIZE) return;
+
+    //Split the widest axis at the median
+    int axis = 0;
+    float widest = -1.0f;
+    for (int d = 0; d < 3; d++)
+    {
+        float lo = coords[d][first];
+        float hi = lo;
+        for (int i = first + 1; i < first + count; i++)
+        {
+            if (coords[d][i] < lo) lo = coords[d][i];
+            if (coords[d][i] > hi) hi = coords[d][i];
+        }
+        if (hi - lo > widest)
+        {
+            widest = hi - lo;
+            axis = d;
+        }
+    }
+    if (widest <= 0.0f) return; //All the same colour
+
+    //Insertion sort is plenty for at most 256 entries
+    for (int i = first + 1; i < first + count; i++)
+    {
+        float c[3] = { coords[0][i], coords[1][i], coords[2][i] };
+        int e = entry[i];
+        int j = i - 1;
+        while (j >= first && coords[axis][j] > c[axis])
+        {
+            coords[0][j + 1] = coords[0][j]; coords[1][j + 1] = coords[1][j]; coords[2][j + 1] = coords[2][j];
+            entry[j + 1] = entry[j];
+            j--;
+        }
+        coords[0][j + 1] = c[0]; coords[1][j + 1] = c[1]; coords[2][j + 1] = c[2];
+        entry[j + 1] = e;
+    }
+
+    //Everything below the split goes left, everything at or above it goes right
+    int half = count / 2;
+    n->axis = axis;
+    n->split = coords[axis][first + half];
+    n->child = *numNodes;
+    *numNodes += 2;
+    BuildNearestColourNode(nodes, n->child, numNodes, coords, entry, first, half);
+    BuildNearestColourNode(nodes, n->child + 1, numNodes, coords, entry, first + half, count - half);
+}
+
+void NearestColourIndex::Build(const ColourOkLabA* labPalette, int numColours, float bright, float contrast, float uvbias, int kernel)
+{
+    if (numColours > NEARESTCOLOUR_MAX_ENTRIES) numColours = NEARESTCOLOUR_MAX_ENTRIES;
+    const float contrastfac = (1.05f * (contrast + 1.0f)) / (1.05f - contrast);
+    foldAdjust = contrastfac > NEARESTCOLOUR_MIN_FOLD;
+    ColourOkLabA folded[NEARESTCOLOUR_MAX_ENTRIES];
+    for (int i = 0; i < numColours; i++)
+    {
+        ColourOkLabA col = labPalette[i];
+        if (foldAdjust) //Inverse of ColourAdjust
+        {
+            col.L = (col.L - 0.5f) / contrastfac + 0.5f - bright;
+            col.a /= contrastfac;
+            col.b /= contrastfac;
+        }
+        folded[i] = col;
+        L[i] = col.L * uvbias;
+        a[i] = col.a;
+        b[i] = col.b;
+        entry[i] = i;
+    }
+    numEntries = numColours;
+
+    if (numColours < NEARESTCOLOUR_MIN_SIMD_ENTRIES) kernel = CONVERT_SCALAR;
+    FillNearestColourSoA(&scan, folded, numColours, uvbias, kernel);
+    //The wider the scan, the bigger the palette has to be before the tree is quicker
+    int minTreeEntries;
+    switch (scan.kernel)
+    {
+        case CONVERT_AVX2: minTreeEntries = 128; break;
+        case CONVERT_AVX512: minTreeEntries = NEARESTCOLOUR_MAX_ENTRIES + 1; break;
+        default: minTreeEntries = 32; break;
+    }
+    useTree = numEntries >= minTreeEntries;
+
+    float* coords[3] = { L, a, b };
+    numNodes = 1;
+    if (useTree) BuildNearestColourNode(nodes, 0, &numNodes, coords, entry, 0, numEntries);
+
+    builtBright = bright;
+    builtContrast = contrast;
+    builtBias = uvbias;
+    isBuilt = true;
+}
+
+int NearestColourIndex::FindNearest(ColourOkLabA col) const
+{
+    if (!foldAdjust) col = ColourAdjust(col, builtBright, builtContrast);
+    if (!useTree) return FindNearestColourSoA(&scan, col);
+    const float q[3] = { col.L * builtBias, col.a, col.b };
+
+    //Depth first, nearer child first, with the far child kept along with its distance to the splitting plane
+    int stack[NEARESTCOLOUR_MAX_NODES];
+    float stackDist[NEARESTCOLOUR_MAX_NODES];
+    int stackSize = 0;
+    float lowestDistance = 999999999999999999999999.9;
+    int chosen = 0;
+    int node = 0;
+    float planeDist = 0.0f;
+    while (true)
+    {
+        if (planeDist <= lowestDistance)
+        {
+            const NearestColourNode* n = &nodes[node];
+            if (n->axis < 0)
+            {
+                for (int i = n->first; i < n->first + n->count; i++)
+                {
+                    const float dL = q[0] - L[i];
+                    const float da = q[1] - a[i];
+                    const float db = q[2] - b[i];
+                    const float dist = (dL * dL) + (da * da) + (db * db);
+                    if (dist < lowestDistance || (dist == lowestDistance && entry[i] < chosen))
+                    {
+                        lowestDistance = dist;
+                        chosen = entry[i];
+                    }
+                }
+            }
+            else
+            {
+                const float diff = q[n->axis] - n->split;
+                const int near = (diff < 0.0f) ? n->child : n->child + 1;
+                stack[stackSize] = (2 * n->child + 1) - near;
+                stackDist[stackSize] = diff * diff;
+                stackSize++;
+                node = near;
+                planeDist = 0.0f;
+                continue;
+            }
+        }
+        if (stackSize == 0) break;
+        stackSize--;
+        node = stack[stackSize];
+        planeDist = stackDist[stackSize];
+    }
+    return chosen;
+}
+
+//Widens the cell bounds to cover the rounding in the conversion kernels, which only ever adds candidates
+#define INVERSEMAP_BOUND_SLACK 1e-4f
+#define INVERSEMAP_MAX_CANDIDATES 16
+
+InverseColourMap::InverseColourMap()
+{
+    cells = new unsigned int[INVERSEMAP_NUM_CELLS];
+    memset(cells, 0xFF, INVERSEMAP_NUM_CELLS * sizeof(unsigned int));
+    detail = nullptr;
+    detailSize = 0;
+    detailCapacity = 0;
+    index = new NearestColourIndex();
+    numEntries = 0;
+    builtPreBright = 0.0f;
+    builtPreContrast = 0.0f;
+    builtPostBright = 0.0f;
+    builtPostContrast = 0.0f;
+    builtBias = 1.0f;
+    isBuilt = false;
+    preparedPixels = nullptr;
+    preparedNumPixels = 0;
+    preparedThreshold = 0;
+}
+
+InverseColourMap::~InverseColourMap()
+{
+    delete[] cells;
+    free(detail);
+    delete index;
+}
+
+void InverseColourMap::Reset(const ColourOkLabA* labPalette, int numColours, float preBright, float preContrast, float postBright, float postContrast, float uvbias)
+{
+    if (numColours > NEARESTCOLOUR_MAX_ENTRIES) numColours = NEARESTCOLOUR_MAX_ENTRIES;
+    memcpy(palette, labPalette, numColours * sizeof(ColourOkLabA));
+    numEntries = numColours;
+    memset(cells, 0xFF, INVERSEMAP_NUM_CELLS * sizeof(unsigned int));
+    detailSize = 0; //Keep the allocation for the next palette
+    index->Build(labPalette, numColours, postBright, postContrast, uvbias);
+    builtPreBright = preBright;
+    builtPreContrast = preContrast;
+    builtPostBright = postBright;
+    builtPostContrast = postContrast;
+    builtBias = uvbias;
+    isBuilt = true;
+    preparedPixels = nullptr;
+}
+
+#define INVERSEMAP_NEEDED_WORDS (INVERSEMAP_NUM_CELLS / 64)
+
+void InverseColourMap::Prepare(const ColourRGBA8* pixels, long long numPixels, unsigned int alphaThreshold)
+{
+    //A higher threshold only needs a subset of the cells
+    if (pixels == preparedPixels && numPixels == preparedNumPixels && alphaThreshold >= preparedThreshold) return;
+
+    //Each thread marks the cells its pixels need in its own bitset, then they're ORed together
+    const int numThreads = omp_get_max_threads();
+    uint64_t* needed = (uint64_t*)calloc(((long long)numThreads) * INVERSEMAP_NEEDED_WORDS, sizeof(uint64_t));
+    #pragma omp parallel num_threads(numThreads)
+    {
+        uint64_t* marks = &needed[((long long)omp_get_thread_num()) * INVERSEMAP_NEEDED_WORDS];
+        #pragma omp for schedule(static)
+        for (long long i = 0; i < numPixels; i++)
+        {
+            ColourRGBA8 col = pixels[i];
+            if (col.A < alphaThreshold) continue;
+            const int cell = ((col.R >> INVERSEMAP_CELL_SHIFT) * INVERSEMAP_CELLS_PER_AXIS + (col.G >> INVERSEMAP_CELL_SHIFT)) * INVERSEMAP_CELLS_PER_AXIS + (col.B >> INVERSEMAP_CELL_SHIFT);
+            marks[cell >> 6] |= 1ULL << (cell & 0x3F);
+        }
+    }
+    #pragma omp parallel for schedule(static)
+    for (int w = 0; w < INVERSEMAP_NEEDED_WORDS; w++)
+    {
+        for (int t = 1; t < numThreads; t++)
+        {
+            needed[w] |= needed[((long long)t) * INVERSEMAP_NEEDED_WORDS + w];
+        }
+    }
+    int* toBuild = new int[INVERSEMAP_NUM_CELLS];
+    int numToBuild = 0;
+    for (int w = 0; w < INVERSEMAP_NEEDED_WORDS; w++)
+    {
+        for (uint64_t bits = needed[w]; bits != 0; bits &= bits - 1)
+        {
+            const int i = (w << 6) + __builtin_ctzll(bits);
+            if (cells[i] == INVERSEMAP_UNBUILT) toBuild[numToBuild++] = i;
+        }
+    }
+    free(needed);
+    preparedPixels = pixels;
+    preparedNumPixels = numPixels;
+    preparedThreshold = alphaThreshold;
+    if (numToBuild == 0)
+    {
+        delete[] toBuild;
+        return;
+    }
+
+    //Cells with one candidate are done straight away, the rest need their detail tables
+    unsigned char* candidates = new unsigned char[((long long)numToBuild) * (INVERSEMAP_MAX_CANDIDATES + 1)];
+    int* numCandidates = new int[numToBuild];
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 0; i < numToBuild; i++)
+    {
+        unsigned char* cands = &candidates[((long long)i) * (INVERSEMAP_MAX_CANDIDATES + 1)];
+        numCandidates[i] = GetCellCandidates(toBuild[i], cands, INVERSEMAP_MAX_CANDIDATES);
+        if (numCandidates[i] == 1) cells[toBuild[i]] = cands[0];
+    }
+    long long* offsets = new long long[numToBuild];
+    long long newSize = detailSize;
+    for (int i = 0; i < numToBuild; i++)
+    {
+        if (numCandidates[i] == 1) continue;
+        offsets[i] = newSize;
+        newSize += INVERSEMAP_CELL_COLOURS;
+    }
+    if (newSize > detailCapacity)
+    {
+        detailCapacity = (newSize > 2 * detailCapacity) ? newSize : 2 * detailCapacity;
+        detail = (unsigned char*)realloc(detail, detailCapacity);
+    }
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int i = 0; i < numToBuild; i++)
+    {
+        if (numCandidates[i] == 1) continue;
+        BuildCellDetail(toBuild[i], &candidates[((long long)i) * (INVERSEMAP_MAX_CANDIDATES + 1)], numCandidates[i], detail + offsets[i]);
+        cells[toBuild[i]] = INVERSEMAP_DETAIL | (unsigned int)offsets[i];
+    }
+    detailSize = newSize;
+    delete[] offsets;
+    delete[] numCandidates;
+    delete[] candidates;
+    delete[] toBuild;
+}
+
+//Interval form of ColourAdjust, flipped if the contrast factor is negative
+static inline void AdjustInterval(float* lo, float* hi, float bright, float contrastfac, bool isLightness)
+{
+    float nlo, nhi;
+    if (isLightness)
+    {
+        nlo = ((*lo + bright - 0.5f) * contrastfac) + 0.5f;
+        nhi = ((*hi + bright - 0.5f) * contrastfac) + 0.5f;
+    }
+    else
+    {
+        nlo = *lo * contrastfac;
+        nhi = *hi * contrastfac;
+    }
+    if (nlo > nhi) { float t = nlo; nlo = nhi; nhi = t; }
+    *lo = nlo; *hi = nhi;
+}
+
+static inline float OkLabToe(float L)
+{
+    return (OkLabK3 * L - OkLabK1 + sqrtf((OkLabK3 * L - OkLabK1) * (OkLabK3 * L - OkLabK1) + 4.0f * OkLabK2 * OkLabK3 * L)) * 0.5f;
+}
+
+int InverseColourMap::GetCellCandidates(int cellIndex, unsigned char* candidates, int maxCandidates)
+{
+    const int cr = cellIndex / (INVERSEMAP_CELLS_PER_AXIS * INVERSEMAP_CELLS_PER_AXIS);
+    const int cg = (cellIndex / INVERSEMAP_CELLS_PER_AXIS) % INVERSEMAP_CELLS_PER_AXIS;
+    const int cb = cellIndex % INVERSEMAP_CELLS_PER_AXIS;
+    const ColourRGBA8 loCol = { (unsigned char)(cr * INVERSEMAP_CELL_SIZE), (unsigned char)(cg * INVERSEMAP_CELL_SIZE), (unsigned char)(cb * INVERSEMAP_CELL_SIZE), 0xFF };
+    const ColourRGBA8 hiCol = { (unsigned char)(loCol.R + INVERSEMAP_CELL_SIZE - 1), (unsigned char)(loCol.G + INVERSEMAP_CELL_SIZE - 1), (unsigned char)(loCol.B + INVERSEMAP_CELL_SIZE - 1), 0xFF };
+    const ColourRGBA linLo = SRGB8ToLinearFloat(loCol);
+    const ColourRGBA linHi = SRGB8ToLinearFloat(hiCol);
+
+    //Every step of the conversion is monotonic or linear, so the cell's bounds follow exactly
+    //LMS only has positive coefficients and the cube root is increasing
+    float lmsLo[3], lmsHi[3];
+    for (int k = 0; k < 3; k++)
+    {
+        lmsLo[k] = cbrtf(SRGBtoLMS[k * 3] * linLo.R + SRGBtoLMS[k * 3 + 1] * linLo.G + SRGBtoLMS[k * 3 + 2] * linLo.B);
+        lmsHi[k] = cbrtf(SRGBtoLMS[k * 3] * linHi.R + SRGBtoLMS[k * 3 + 1] * linHi.G + SRGBtoLMS[k * 3 + 2] * linHi.B);
+    }
+    float lo[3], hi[3];
+    for (int k = 0; k < 3; k++)
+    {
+        lo[k] = 0.0f; hi[k] = 0.0f;
+        for (int j = 0; j < 3; j++)
+        {
+            const float c = CRLMStoOKLab[k * 3 + j];
+            if (c >= 0.0f) { lo[k] += c * lmsLo[j]; hi[k] += c * lmsHi[j]; }
+            else { lo[k] += c * lmsHi[j]; hi[k] += c * lmsLo[j]; }
+        }
+    }
+    lo[0] = OkLabToe(lo[0]); hi[0] = OkLabToe(hi[0]);
+    const float preFac = (1.05f * (builtPreContrast + 1.0f)) / (1.05f - builtPreContrast);
+    const float postFac = (1.05f * (builtPostContrast + 1.0f)) / (1.05f - builtPostContrast);
+    for (int k = 0; k < 3; k++)
+    {
+        lo[k] -= INVERSEMAP_BOUND_SLACK; hi[k] += INVERSEMAP_BOUND_SLACK;
+        AdjustInterval(&lo[k], &hi[k], (k == 0) ? builtPreBright : 0.0f, preFac, k == 0);
+        AdjustInterval(&lo[k], &hi[k], (k == 0) ? builtPostBright : 0.0f, postFac, k == 0);
+        lo[k] -= INVERSEMAP_BOUND_SLACK; hi[k] += INVERSEMAP_BOUND_SLACK;
+    }
+    const float biasL = fabsf(builtBias);
+    lo[0] *= biasL; hi[0] *= biasL;
+
+    //Anything closer to the cell than the best furthest distance could win somewhere in it
+    float minDist[NEARESTCOLOUR_MAX_ENTRIES];
+    float threshold = 999999999999999999999999.9;
+    for (int i = 0; i < numEntries; i++)
+    {
+        const float p[3] = { palette[i].L * biasL, palette[i].a, palette[i].b };
+        float nearDist = 0.0f;
+        float farDist = 0.0f;
+        for (int k = 0; k < 3; k++)
+        {
+            const float below = lo[k] - p[k];
+            const float above = p[k] - hi[k];
+            const float gap = (below > 0.0f) ? below : ((above > 0.0f) ? above : 0.0f);
+            const float far = (fabsf(below) > fabsf(above)) ? fabsf(below) : fabsf(above);
+            nearDist += gap * gap;
+            farDist += far * far;
+        }
+        minDist[i] = nearDist;
+        if (farDist < threshold) threshold = farDist;
+    }
+    int numCandidates = 0;
+    for (int i = 0; i < numEntries; i++)
+    {
+        if (minDist[i] > threshold) continue;
+        if (numCandidates == maxCandidates) return maxCandidates + 1;
+        candidates[numCandidates++] = (unsigned char)i;
+    }
+    return numCandidates;
+}
+
+//Converts the cell's colours the same way as the dither's working buffer, then picks between the candidates like a full scan would
+void InverseColourMap::BuildCellDetail(int cellIndex, const unsigned char* candidates, int numCandidates, unsigned char* outDetail)
+{
+    const int cr = cellIndex / (INVERSEMAP_CELLS_PER_AXIS * INVERSEMAP_CELLS_PER_AXIS);
+    const int cg = (cellIndex / INVERSEMAP_CELLS_PER_AXIS) % INVERSEMAP_CELLS_PER_AXIS;
+    const int cb = cellIndex % INVERSEMAP_CELLS_PER_AXIS;
+    ColourRGBA8 cols[INVERSEMAP_CELL_COLOURS];
+    for (int i = 0; i < INVERSEMAP_CELL_COLOURS; i++)
+    {
+        cols[i].R = (unsigned char)(cr * INVERSEMAP_CELL_SIZE + (i / (INVERSEMAP_CELL_SIZE * INVERSEMAP_CELL_SIZE)));
+        cols[i].G = (unsigned char)(cg * INVERSEMAP_CELL_SIZE + ((i / INVERSEMAP_CELL_SIZE) % INVERSEMAP_CELL_SIZE));
+        cols[i].B = (unsigned char)(cb * INVERSEMAP_CELL_SIZE + (i % INVERSEMAP_CELL_SIZE));
+        cols[i].A = 0xFF;
+    }
+    float L[INVERSEMAP_CELL_COLOURS];
+    float a[INVERSEMAP_CELL_COLOURS];
+    float b[INVERSEMAP_CELL_COLOURS];
+    float A[INVERSEMAP_CELL_COLOURS];
+    SRGB8ToOkLabBatch(cols, L, a, b, A, INVERSEMAP_CELL_COLOURS);
+    for (int i = 0; i < INVERSEMAP_CELL_COLOURS; i++)
+    {
+        ColourOkLabA pre = { L[i], a[i], b[i], 1.0f };
+        pre = ColourAdjust(pre, builtPreBright, builtPreContrast);
+        if (numCandidates > INVERSEMAP_MAX_CANDIDATES)
+        {
+            outDetail[i] = (unsigned char)index->FindNearest(pre);
+            continue;
+        }
+        const ColourOkLabA post = ColourAdjust(pre, builtPostBright, builtPostContrast);
+        float lowestDistance = 999999999999999999999999.9;
+        int chosen = 0;
+        for (int j = 0; j < numCandidates; j++)
+        {
+            const ColourOkLabA incol = palette[candidates[j]];
+            const float dL = (post.L - incol.L) * builtBias;
+            const float da = post.a - incol.a;
+            const float db = post.b - incol.b;
+            const float dist = (dL * dL) + (da * da) + (db * db);
+            if (dist < lowestDistance)
+            {
+                lowestDistance = dist;
+                chosen = candidates[j];
+            }
+        }
+        outDetail[i] = (unsigned char)chosen;
+    }
+}
@@ -0,0 +1,162 @@
+/* gpitool - Converts images into .GPI format
+ * Copyright (c) 2024 Maxim Hoxha
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Nearest palette colour queries
+ */
+
+#pragma once
+
+#include "imagehandler.h"
+#include "colourconvert.h"
+
+#define NEARESTCOLOUR_MAX_ENTRIES 256
+#define NEARESTCOLOUR_SIMD_WIDTH 16
+#define NEARESTCOLOUR_PADDED_ENTRIES (NEARESTCOLOUR_MAX_ENTRIES + NEARESTCOLOUR_SIMD_WIDTH)
+#define NEARESTCOLOUR_LEAF_SIZE 4
+#define NEARESTCOLOUR_MAX_NODES (2 * NEARESTCOLOUR_MAX_ENTRIES)
+
+//Colours in structure of arrays form for the vectorised searches, padded to the SIMD width with entries that are never chosen
+//kernel is one of convertKernels, resolved when it is filled
+typedef struct
+{
+    alignas(64) float L[NEARESTCOLOUR_PADDED_ENTRIES];
+    alignas(64) float a[NEARESTCOLOUR_PADDED_ENTRIES];
+    alignas(64) float b[NEARESTCOLOUR_PADDED_ENTRIES];
+    float uvbias;
+    int numEntries;
+    int numPadded;
+    int kernel;
+} NearestColourSoA;
+
+void FillNearestColourSoA(NearestColourSoA* soa, const ColourOkLabA* cols, int numColours, float uvbias, int kernel = CONVERT_AUTO);
+//Squared distances use the same arithmetic as a scalar scan, with lightness scaled by uvbias, and ties go to the lowest index
+int FindNearestColourSoA(const NearestColourSoA* soa, ColourOkLabA col, float* outDist = nullptr);
+//Also gives the second lowest squared distance, for bounds
+int FindNearestTwoColoursSoA(const NearestColourSoA* soa, ColourOkLabA col, float* outLowest, float* outSecond);
+
+//A leaf when axis is -1, otherwise the children are at child and child + 1
+typedef struct
+{
+    float split;
+    int axis;
+    int child;
+    int first;
+    int count;
+} NearestColourNode;
+
+//Vectorised scan or k-d tree over the palette (whichever is quicker for its size), built once per palette and post-adjustment
+//ColourAdjust is affine with a uniform scale, so instead of adjusting every query colour the palette is moved by the inverse
+//adjustment, which scales every distance by the same factor and leaves the nearest colour unchanged
+class NearestColourIndex
+{
+public:
+    NearestColourIndex();
+
+    void Build(const ColourOkLabA* labPalette, int numColours, float bright, float contrast, float uvbias, int kernel = CONVERT_AUTO);
+    inline void Invalidate() { isBuilt = false; }
+    inline bool IsBuiltFor(float bright, float contrast, float uvbias)
+    {
+        return isBuilt && bright == builtBright && contrast == builtContrast && uvbias == builtBias;
+    }
+
+    //Index of the palette colour closest to ColourAdjust(col, bright, contrast), lowest index on ties like a linear scan
+    int FindNearest(ColourOkLabA col) const;
+
+private:
+    NearestColourSoA scan; //Folded palette in palette order, searched directly when there's no tree
+    bool useTree;
+    //Palette in tree order, folded and with L already scaled by the bias
+    float L[NEARESTCOLOUR_MAX_ENTRIES];
+    float a[NEARESTCOLOUR_MAX_ENTRIES];
+    float b[NEARESTCOLOUR_MAX_ENTRIES];
+    int entry[NEARESTCOLOUR_MAX_ENTRIES];
+    NearestColourNode nodes[NEARESTCOLOUR_MAX_NODES];
+    int numNodes;
+    int numEntries;
+    bool foldAdjust; //False when the contrast flattens everything and the adjustment can't be inverted
+    float builtBright;
+    float builtContrast;
+    float builtBias;
+    bool isBuilt;
+};
+
+//Inverse colour map cells cover 4x4x4 sRGB8 colours
+#define INVERSEMAP_CELL_SHIFT 2
+#define INVERSEMAP_CELL_SIZE (1 << INVERSEMAP_CELL_SHIFT)
+#define INVERSEMAP_CELL_COLOURS (INVERSEMAP_CELL_SIZE * INVERSEMAP_CELL_SIZE * INVERSEMAP_CELL_SIZE)
+#define INVERSEMAP_CELLS_PER_AXIS (256 >> INVERSEMAP_CELL_SHIFT)
+#define INVERSEMAP_NUM_CELLS (INVERSEMAP_CELLS_PER_AXIS * INVERSEMAP_CELLS_PER_AXIS * INVERSEMAP_CELLS_PER_AXIS)
+//A cell is either unbuilt, one palette index for the whole cell, or (with the detail flag) an offset into the per colour tables
+#define INVERSEMAP_UNBUILT 0xFFFFFFFFu
+#define INVERSEMAP_DETAIL 0x80000000u
+
+//sRGB8 -> palette index for undithered output, built once per palette, pre- and post-adjustment and bias
+//Each cell's exact OkLab bounds give the palette entries that could win in it, so most cells have just the one answer
+//Cells on a boundary get a table with every colour in them converted and searched, so the result is the same as before
+class InverseColourMap
+{
+public:
+    InverseColourMap();
+    ~InverseColourMap();
+
+    //Clears all the cells, they're then built as Prepare finds they are needed
+    void Reset(const ColourOkLabA* labPalette, int numColours, float preBright, float preContrast, float postBright, float postContrast, float uvbias);
+    //Also has to be called when the pixels given to Prepare change
+    inline void Invalidate() { isBuilt = false; preparedPixels = nullptr; }
+    inline bool IsBuiltFor(float preBright, float preContrast, float postBright, float postContrast, float uvbias)
+    {
+        return isBuilt && preBright == builtPreBright && preContrast == builtPreContrast && postBright == builtPostBright && postContrast == builtPostContrast && uvbias == builtBias;
+    }
+
+    //Builds the cells for every pixel with at least alphaThreshold alpha, after which Lookup can be used on them from any thread
+    //Returns straight away if these pixels have been prepared for since the last Reset or Invalidate, at this or a lower threshold
+    void Prepare(const ColourRGBA8* pixels, long long numPixels, unsigned int alphaThreshold);
+    inline int Lookup(ColourRGBA8 col) const
+    {
+        const unsigned int cell = cells[((col.R >> INVERSEMAP_CELL_SHIFT) * INVERSEMAP_CELLS_PER_AXIS + (col.G >> INVERSEMAP_CELL_SHIFT)) * INVERSEMAP_CELLS_PER_AXIS + (col.B >> INVERSEMAP_CELL_SHIFT)];
+        if (!(cell & INVERSEMAP_DETAIL)) return cell;
+        const int mask = INVERSEMAP_CELL_SIZE - 1;
+        return detail[(cell & ~INVERSEMAP_DETAIL) + (((col.R & mask) * INVERSEMAP_CELL_SIZE + (col.G & mask)) * INVERSEMAP_CELL_SIZE + (col.B & mask))];
+    }
+
+private:
+    //Number of candidates, or more than maxCandidates if there are too many to list
+    int GetCellCandidates(int cellIndex, unsigned char* candidates, int maxCandidates);
+    void BuildCellDetail(int cellIndex, const unsigned char* candidates, int numCandidates, unsigned char* outDetail);
+
+    unsigned int* cells;
+    unsigned char* detail;
+    long long detailSize;
+    long long detailCapacity;
+    NearestColourIndex* index; //For cells with too many candidates to list
+    ColourOkLabA palette[NEARESTCOLOUR_MAX_ENTRIES];
+    int numEntries;
+    float builtPreBright;
+    float builtPreContrast;
+    float builtPostBright;
+    float builtPostContrast;
+    float builtBias;
+    bool isBuilt;
+    //What Prepare last built every needed cell for
+    const ColourRGBA8* preparedPixels;
+    long long preparedNumPixels;
+    unsigned int preparedThreshold;
+};
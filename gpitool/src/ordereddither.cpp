@@ -0,0 +1,175 @@
+/* gpitool - Converts images into .GPI format
+ * Copyright (c) 2024 Maxim Hoxha
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Ordered dithering kernels
+ */
+
+#include <math.h>
+#include "ordereddither.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ORDERED_X86
+#include <immintrin.h>
+#endif
+
+static inline float ThresholdAt(const ThresholdLookup* lookup, int x, int y)
+{
+    return lookup->matrix[((y + lookup->offsetY) % lookup->size) * lookup->size + ((x + lookup->offsetX) % lookup->size)];
+}
+
+void FillThresholdMatrixSet(ThresholdMatrixSet* set, const float* matrix, int size)
+{
+    const int half = size / 2;
+    for (int y = 0; y < size; y++)
+    {
+        for (int x = 0; x < size; x++)
+        {
+            set->lightness[y * size + x] = matrix[y * size + x];
+            set->saturation[y * size + x] = matrix[((y + half) % size) * size + x];
+            set->hue[y * size + x] = matrix[y * size + ((x + half) % size)];
+        }
+    }
+    set->size = size;
+}
+
+OrderedDitherPattern GetThresholdMatrixSetPattern(const ThresholdMatrixSet* set)
+{
+    OrderedDitherPattern pattern = { set->size, { set->lightness, set->size, 0, 0 }, { set->saturation, set->size, 0, 0 }, { set->hue, set->size, 0, 0 } };
+    return pattern;
+}
+
+static inline bool IsPowerOfTwo(int n)
+{
+    return (n & (n - 1)) == 0;
+}
+
+void BuildOrderedDitherTables(OrderedDitherTables* tables, const OrderedDitherPattern* pattern, float amtL, float amtS, float amtH)
+{
+    const int period = pattern->period;
+    const int stride = IsPowerOfTwo(period) ? ((period < 8) ? 8 : period) : ((period + 7 + 7) & ~7);
+    for (int y = 0; y < period; y++)
+    {
+        for (int x = 0; x < stride; x++)
+        {
+            const int px = x % period;
+            const int cell = y * stride + x;
+            const float midsat = -amtS * ThresholdAt(&pattern->saturation, px, y);
+            const float hue = amtH * ThresholdAt(&pattern->hue, px, y);
+            tables->addL[cell] = ThresholdAt(&pattern->lightness, px, y) * amtL;
+            tables->satScale[cell] = 1.0f + midsat;
+            tables->satAdd[cell] = midsat * 0.5f;
+            tables->cosH[cell] = cosf(hue);
+            tables->sinH[cell] = sinf(hue);
+        }
+    }
+    tables->period = period;
+    tables->stride = stride;
+}
+
+//STRIDE is the table row length when the period is a power of two, so finding the column is a mask, or 0 to wrap by the period at runtime
+template <int STRIDE> static inline int TableColumn(const OrderedDitherTables* tables, long long x)
+{
+    if (STRIDE) return (int)(x & (STRIDE - 1));
+    else return (int)(x % tables->period);
+}
+
+//Saturation is scaled about the colour's own hue (or the +a axis for greys, as atan2 gives 0 for them) and then rotated
+//The AVX2 kernel does the same operations in the same order without FMA, so the two give bit-identical results
+template <int STRIDE> static void OrderedDitherRowScalar(const OrderedDitherTables* tables, long long y, const float* L, const float* a, const float* b, long long start, long long n, float* outL, float* outa, float* outb)
+{
+    const int row = (int)(y % tables->period) * tables->stride;
+    for (long long i = start; i < n; i++)
+    {
+        const int cell = row + TableColumn<STRIDE>(tables, i);
+        const float sat = sqrtf(a[i] * a[i] + b[i] * b[i]);
+        float ua = 1.0f;
+        float ub = 0.0f;
+        if (sat > 0.0f)
+        {
+            ua = a[i] / sat;
+            ub = b[i] / sat;
+        }
+        const float newSat = sat * tables->satScale[cell] + tables->satAdd[cell];
+        outL[i] = L[i] + tables->addL[cell];
+        outa[i] = newSat * (ua * tables->cosH[cell] - ub * tables->sinH[cell]);
+        outb[i] = newSat * (ua * tables->sinH[cell] + ub * tables->cosH[cell]);
+    }
+}
+
+#ifdef ORDERED_X86
+//The 8 cells for a vector are always next to each other in the table row: with a power of two period i is a multiple of 8 and so is the stride,
+//otherwise the row carries on for 7 cells past the period
+template <int STRIDE> __attribute__((target("avx2"))) static void OrderedDitherRowAVX2(const OrderedDitherTables* tables, long long y, const float* L, const float* a, const float* b, long long n, float* outL, float* outa, float* outb)
+{
+    const int row = (int)(y % tables->period) * tables->stride;
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    long long i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        const int cell = row + TableColumn<STRIDE>(tables, i);
+        const __m256 ia = _mm256_loadu_ps(a + i);
+        const __m256 ib = _mm256_loadu_ps(b + i);
+        const __m256 sat = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(ia, ia), _mm256_mul_ps(ib, ib)));
+        const __m256 isGrey = _mm256_cmp_ps(sat, zero, _CMP_LE_OQ);
+        const __m256 safeSat = _mm256_blendv_ps(sat, one, isGrey);
+        const __m256 ua = _mm256_blendv_ps(_mm256_div_ps(ia, safeSat), one, isGrey);
+        const __m256 ub = _mm256_blendv_ps(_mm256_div_ps(ib, safeSat), zero, isGrey);
+        const __m256 newSat = _mm256_add_ps(_mm256_mul_ps(sat, _mm256_loadu_ps(tables->satScale + cell)), _mm256_loadu_ps(tables->satAdd + cell));
+        const __m256 c = _mm256_loadu_ps(tables->cosH + cell);
+        const __m256 s = _mm256_loadu_ps(tables->sinH + cell);
+        _mm256_storeu_ps(outL + i, _mm256_add_ps(_mm256_loadu_ps(L + i), _mm256_loadu_ps(tables->addL + cell)));
+        _mm256_storeu_ps(outa + i, _mm256_mul_ps(newSat, _mm256_sub_ps(_mm256_mul_ps(ua, c), _mm256_mul_ps(ub, s))));
+        _mm256_storeu_ps(outb + i, _mm256_mul_ps(newSat, _mm256_add_ps(_mm256_mul_ps(ua, s), _mm256_mul_ps(ub, c))));
+    }
+    OrderedDitherRowScalar<STRIDE>(tables, y, L, a, b, i, n, outL, outa, outb);
+}
+#endif
+
+template <int STRIDE> static void OrderedDitherRowKernel(const OrderedDitherTables* tables, long long y, const float* L, const float* a, const float* b, long long n, float* outL, float* outa, float* outb, int kernel)
+{
+    switch (kernel)
+    {
+#ifdef ORDERED_X86
+        case CONVERT_AVX2:
+        case CONVERT_AVX512: //Not worth a separate kernel, this is nowhere near the cost of the palette search
+            OrderedDitherRowAVX2<STRIDE>(tables, y, L, a, b, n, outL, outa, outb); break;
+#endif
+        default:
+            OrderedDitherRowScalar<STRIDE>(tables, y, L, a, b, 0, n, outL, outa, outb); break;
+    }
+}
+
+void OrderedDitherRow(const OrderedDitherTables* tables, long long y, const float* L, const float* a, const float* b, long long n, float* outL, float* outa, float* outb, int kernel)
+{
+    if (kernel == CONVERT_AUTO) kernel = GetBestConvertKernel();
+    //Only power of two periods repeat across a whole table row
+    const int stride = IsPowerOfTwo(tables->period) ? tables->stride : 0;
+    switch (stride)
+    {
+        case 8: OrderedDitherRowKernel<8>(tables, y, L, a, b, n, outL, outa, outb, kernel); break;
+        case 16: OrderedDitherRowKernel<16>(tables, y, L, a, b, n, outL, outa, outb, kernel); break;
+        case 32: OrderedDitherRowKernel<32>(tables, y, L, a, b, n, outL, outa, outb, kernel); break;
+        case 64: OrderedDitherRowKernel<64>(tables, y, L, a, b, n, outL, outa, outb, kernel); break;
+        case 128: OrderedDitherRowKernel<128>(tables, y, L, a, b, n, outL, outa, outb, kernel); break;
+        default: OrderedDitherRowKernel<0>(tables, y, L, a, b, n, outL, outa, outb, kernel); break;
+    }
+}
@@ -0,0 +1,85 @@
+/* gpitool - Converts images into .GPI format
+ * Copyright (c) 2024 Maxim Hoxha
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Ordered dithering kernels
+ */
+
+#pragma once
+
+#include "imagehandler.h"
+#include "colourconvert.h"
+
+//Largest threshold matrix, built in or loaded, that an ordered dither can use
+#define ORDERED_MAX_SIZE 128
+//Bits needed for a cell index into one of those matrices
+#define ORDERED_CELL_BITS 14
+
+//Entry (y % size + offsetY, x % size + offsetX) of a size x size threshold matrix, wrapping around
+typedef struct
+{
+    const float* matrix;
+    int size;
+    int offsetY;
+    int offsetX;
+} ThresholdLookup;
+
+//An ordered dither: the matrices used to offset lightness, scale saturation and rotate hue
+typedef struct
+{
+    int period;
+    ThresholdLookup lightness;
+    ThresholdLookup saturation;
+    ThresholdLookup hue;
+} OrderedDitherPattern;
+
+//A user supplied set of threshold matrices, one each for lightness, saturation and hue, with entries in [-0.5, 0.5)
+typedef struct ThresholdMatrixSet
+{
+    alignas(64) float lightness[ORDERED_MAX_SIZE * ORDERED_MAX_SIZE];
+    alignas(64) float saturation[ORDERED_MAX_SIZE * ORDERED_MAX_SIZE];
+    alignas(64) float hue[ORDERED_MAX_SIZE * ORDERED_MAX_SIZE];
+    int size;
+} ThresholdMatrixSet;
+
+//Rows of the per cell tables are at most this long
+#define ORDERED_TABLE_STRIDE (ORDERED_MAX_SIZE + 8)
+
+//Per cell adjustments for one pattern and set of amounts, period rows of stride cells each
+//Power of two periods are repeated out to at least 8 cells so a vector of cells is never split, other periods get the first 7 cells again on the end of each row
+//The hue offset is a fixed rotation per cell, so it's kept as its cosine and sine
+typedef struct
+{
+    alignas(64) float addL[ORDERED_MAX_SIZE * ORDERED_TABLE_STRIDE];
+    alignas(64) float satScale[ORDERED_MAX_SIZE * ORDERED_TABLE_STRIDE];
+    alignas(64) float satAdd[ORDERED_MAX_SIZE * ORDERED_TABLE_STRIDE];
+    alignas(64) float cosH[ORDERED_MAX_SIZE * ORDERED_TABLE_STRIDE];
+    alignas(64) float sinH[ORDERED_MAX_SIZE * ORDERED_TABLE_STRIDE];
+    int period;
+    int stride;
+} OrderedDitherTables;
+
+//Fills all three matrices from one, offsetting it by half its size for saturation and hue
+void FillThresholdMatrixSet(ThresholdMatrixSet* set, const float* matrix, int size);
+OrderedDitherPattern GetThresholdMatrixSetPattern(const ThresholdMatrixSet* set);
+
+void BuildOrderedDitherTables(OrderedDitherTables* tables, const OrderedDitherPattern* pattern, float amtL, float amtS, float amtH);
+//Applies the dither to n pixels of row y, starting at x = 0, ready for the palette search
+void OrderedDitherRow(const OrderedDitherTables* tables, long long y, const float* L, const float* a, const float* b, long long n, float* outL, float* outa, float* outb, int kernel = CONVERT_AUTO);
@@ -0,0 +1,175 @@
+/* gpitool - Converts images into .GPI format
+ * Copyright (c) 2024 Maxim Hoxha
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Chunky to planar conversion
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "planardata.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PLANAR_X86
+#include <immintrin.h>
+#endif
+
+//Each kernel transposes 8x8 bit matrices, 8 pixels of 8 index bits in, 8 planes of 8 pixel bits out
+
+//All of them go in groups of 8 from pixel start on, start being a multiple of 8
+//This one pads out the last group with index 0, so the others finish off with it
+static void IndicesToPlanarScalar(const unsigned char* indices, int start, int n, unsigned char* const* planes, int numPlanes, const unsigned char* mask)
+{
+    for (int j = start; j < n; j += 8)
+    {
+        const int count = (n - j < 8) ? (n - j) : 8;
+        uint64_t group = 0;
+        for (int k = 0; k < count; k++)
+        {
+            group |= ((uint64_t)indices[j + k]) << (8 * k);
+        }
+        const unsigned char keep = mask ? mask[j >> 3] : 0xFF;
+        for (int p = 0; p < numPlanes; p++)
+        {
+            //Gathers bit p of every byte into the top byte, the first pixel ending up in its most significant bit
+            planes[p][j >> 3] = (unsigned char)((((group >> p) & 0x0101010101010101ULL) * 0x8040201008040201ULL) >> 56) & keep;
+        }
+    }
+}
+
+#ifdef PLANAR_X86
+//16 pixels at a time, each plane being the top bits of the bytes once the wanted bit has been shifted up there
+__attribute__((target("sse2"))) static void IndicesToPlanarSSE2(const unsigned char* indices, int start, int n, unsigned char* const* planes, int numPlanes, const unsigned char* mask)
+{
+    int j = start;
+    for (; j + 16 <= n; j += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(indices + j));
+        //pmovmskb puts the first pixel in the least significant bit, so reverse each group of 8 first
+        v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3)), _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        const int keep = mask ? (mask[j >> 3] | (mask[(j >> 3) + 1] << 8)) : 0xFFFF;
+        for (int p = 0; p < numPlanes; p++)
+        {
+            const int bits = _mm_movemask_epi8(_mm_slli_epi16(v, 7 - p)) & keep;
+            planes[p][j >> 3] = (unsigned char)bits;
+            planes[p][(j >> 3) + 1] = (unsigned char)(bits >> 8);
+        }
+    }
+    IndicesToPlanarScalar(indices, j, n, planes, numPlanes, mask);
+}
+
+__attribute__((target("avx2"))) static void IndicesToPlanarAVX2(const unsigned char* indices, int start, int n, unsigned char* const* planes, int numPlanes, const unsigned char* mask)
+{
+    const __m256i reverse = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                             7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    int j = start;
+    for (; j + 32 <= n; j += 32)
+    {
+        const __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(indices + j)), reverse);
+        uint32_t keep = 0xFFFFFFFF;
+        if (mask) memcpy(&keep, mask + (j >> 3), 4);
+        for (int p = 0; p < numPlanes; p++)
+        {
+            const uint32_t bits = ((uint32_t)_mm256_movemask_epi8(_mm256_slli_epi16(v, 7 - p))) & keep;
+            memcpy(planes[p] + (j >> 3), &bits, 4);
+        }
+    }
+    IndicesToPlanarScalar(indices, j, n, planes, numPlanes, mask);
+}
+
+//64 pixels at a time. The affine transform does a whole 8x8 bit transpose per group of 8, using the pixels as the matrix,
+//which leaves each group's planes together, so a byte permute then gathers each plane's bytes from all 8 groups.
+__attribute__((target("avx512f,avx512bw,avx512vbmi,gfni"))) static void IndicesToPlanarGFNI(const unsigned char* indices, int start, int n, unsigned char* const* planes, int numPlanes, const unsigned char* mask)
+{
+    //Byte g of plane p's qword comes from byte p of group g's
+    static const unsigned char order[64] = { 0,  8, 16, 24, 32, 40, 48, 56,  1,  9, 17, 25, 33, 41, 49, 57,
+                                             2, 10, 18, 26, 34, 42, 50, 58,  3, 11, 19, 27, 35, 43, 51, 59,
+                                             4, 12, 20, 28, 36, 44, 52, 60,  5, 13, 21, 29, 37, 45, 53, 61,
+                                             6, 14, 22, 30, 38, 46, 54, 62,  7, 15, 23, 31, 39, 47, 55, 63 };
+    const __m512i selectBits = _mm512_set1_epi64(0x8040201008040201LL); //Byte p picks out bit p
+    const __m512i gather = _mm512_loadu_si512(order);
+    int j = start;
+    for (; j + 64 <= n; j += 64)
+    {
+        const __m512i v = _mm512_loadu_si512(indices + j);
+        __m512i bits = _mm512_permutexvar_epi8(gather, _mm512_gf2p8affine_epi64_epi8(selectBits, v, 0));
+        if (mask)
+        {
+            long long keep;
+            memcpy(&keep, mask + (j >> 3), 8);
+            bits = _mm512_and_si512(bits, _mm512_set1_epi64(keep));
+        }
+        uint64_t out[8];
+        _mm512_storeu_si512(out, bits);
+        for (int p = 0; p < numPlanes; p++)
+        {
+            memcpy(planes[p] + (j >> 3), &out[p], 8);
+        }
+    }
+    IndicesToPlanarAVX2(indices, j, n, planes, numPlanes, mask);
+}
+#endif
+
+//The AVX-512 level only gets its own kernel with GFNI and VBMI, which the fastest way to do this needs
+static bool IsGFNIKernelSupported()
+{
+#ifdef PLANAR_X86
+    __builtin_cpu_init();
+    static const bool supported = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("gfni");
+    return supported;
+#else
+    return false;
+#endif
+}
+
+void IndicesToPlanarRow(const unsigned char* indices, int n, unsigned char* const* planes, int numPlanes, const unsigned char* mask, int kernel)
+{
+    if (kernel == CONVERT_AUTO) kernel = GetBestConvertKernel();
+    switch (kernel)
+    {
+#ifdef PLANAR_X86
+        case CONVERT_SSE2: IndicesToPlanarSSE2(indices, 0, n, planes, numPlanes, mask); break;
+        case CONVERT_AVX2: IndicesToPlanarAVX2(indices, 0, n, planes, numPlanes, mask); break;
+        case CONVERT_AVX512:
+            if (IsGFNIKernelSupported()) IndicesToPlanarGFNI(indices, 0, n, planes, numPlanes, mask);
+            else IndicesToPlanarAVX2(indices, 0, n, planes, numPlanes, mask);
+            break;
+#endif
+        default: IndicesToPlanarScalar(indices, 0, n, planes, numPlanes, mask); break;
+    }
+}
+
+void CopyBitRow(const unsigned char* src, long long srcBit, int n, unsigned char* dst)
+{
+    src += srcBit >> 3;
+    const int shift = srcBit & 0x7;
+    if (shift == 0) memcpy(dst, src, (n + 0x7)/0x8);
+    else
+    {
+        for (int j = 0; j < n; j += 8)
+        {
+            unsigned char bits = src[j >> 3] << shift;
+            if (n - j > 8 - shift) bits |= src[(j >> 3) + 1] >> (8 - shift); //Only read the next byte if any of it is wanted
+            dst[j >> 3] = bits;
+        }
+    }
+    if (n & 0x7) dst[(n - 1) >> 3] &= 0xFF << (8 - (n & 0x7));
+}
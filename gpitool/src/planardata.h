@@ -0,0 +1,38 @@
+/* gpitool - Converts images into .GPI format
+ * Copyright (c) 2024 Maxim Hoxha
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Chunky to planar conversion
+ */
+
+#pragma once
+
+#include "imagehandler.h"
+#include "colourconvert.h"
+
+//What GeneratePlanarData lines each plane up to, so no two planes share a cache line
+#define PLANAR_ALIGN 64
+
+//Splits n palette indices into bit planes, 8 pixels to a byte with the first in the most significant bit, planes[p] getting bit p of each index
+//Only the first numPlanes planes are written. If mask isn't null, pixels without their bit set in it come out as 0 in every plane.
+//The spare bits of a partial last byte are always 0.
+void IndicesToPlanarRow(const unsigned char* indices, int n, unsigned char* const* planes, int numPlanes, const unsigned char* mask, int kernel = CONVERT_AUTO);
+//Copies n bits of a bit row, starting srcBit bits into src, to the start of dst, clearing the spare bits of the last byte
+void CopyBitRow(const unsigned char* src, long long srcBit, int n, unsigned char* dst);
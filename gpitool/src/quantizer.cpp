@@ -0,0 +1,535 @@
+/* gpitool - Converts images into .GPI format
+ * Copyright (c) 2024 Maxim Hoxha
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Fast palette quantizers (Wu, median cut and octree) working in OkLab
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include "quantizer.h"
+
+//Lightness is scaled by uvbias, so plain Euclidean distance in this space is the same distance the k-means clustering uses
+static inline void GetScaledPoint(const KMeansPoints* pts, long long index, float uvbias, float* out)
+{
+    out[0] = pts->L[index] * uvbias;
+    out[1] = pts->a[index];
+    out[2] = pts->b[index];
+}
+
+static inline ColourOkLabA UnscaledColour(double L, double a, double b, float uvbias)
+{
+    ColourOkLabA col = { (float)(L/uvbias), (float)a, (float)b, 1.0f };
+    return col;
+}
+
+//Returns false if every point is ignored
+static bool GetScaledBounds(const KMeansPoints* pts, float uvbias, float* minv, float* maxv)
+{
+    bool found = false;
+    for (int d = 0; d < 3; d++)
+    {
+        minv[d] = 999999999999999999999999.9;
+        maxv[d] = -999999999999999999999999.9;
+    }
+    for (long long i = 0; i < pts->numPoints; i++)
+    {
+        if (pts->weights[i] == 0) continue; //Ignore 'transparent' colours
+        float p[3];
+        GetScaledPoint(pts, i, uvbias, p);
+        for (int d = 0; d < 3; d++)
+        {
+            if (p[d] < minv[d]) minv[d] = p[d];
+            if (p[d] > maxv[d]) maxv[d] = p[d];
+        }
+        found = true;
+    }
+    return found;
+}
+
+
+//Wu's quantizer (Graphics Gems II), with the moments kept in OkLab instead of RGB
+//Index 0 on each axis is an empty plane, so that the cumulative moments of any box can be read off its corners
+#define WU_CELLS 32
+#define WU_SIZE (WU_CELLS + 1)
+#define WU_INDEX(i, j, k) (((((i) * WU_SIZE) + (j)) * WU_SIZE) + (k))
+
+typedef struct
+{
+    double w;
+    double L;
+    double a;
+    double b;
+    double sq;
+} WuMoment;
+
+//Cells lo (exclusive) to hi (inclusive) on each axis
+typedef struct
+{
+    int lo[3];
+    int hi[3];
+} WuBox;
+
+static inline void AddWuMoment(WuMoment* out, const WuMoment* in, double sign)
+{
+    out->w += sign * in->w;
+    out->L += sign * in->L;
+    out->a += sign * in->a;
+    out->b += sign * in->b;
+    out->sq += sign * in->sq;
+}
+
+static WuMoment WuVolume(const WuBox* box, const WuMoment* m)
+{
+    WuMoment v = { 0.0, 0.0, 0.0, 0.0, 0.0 };
+    for (int corner = 0; corner < 8; corner++)
+    {
+        const int i = (corner & 1) ? box->lo[0] : box->hi[0];
+        const int j = (corner & 2) ? box->lo[1] : box->hi[1];
+        const int k = (corner & 4) ? box->lo[2] : box->hi[2];
+        const int numLo = ((corner & 1) ? 1 : 0) + ((corner & 2) ? 1 : 0) + ((corner & 4) ? 1 : 0);
+        AddWuMoment(&v, &m[WU_INDEX(i, j, k)], (numLo & 1) ? -1.0 : 1.0);
+    }
+    return v;
+}
+
+static inline double WuVariance(const WuBox* box, const WuMoment* m)
+{
+    if (box->hi[0] - box->lo[0] <= 1 && box->hi[1] - box->lo[1] <= 1 && box->hi[2] - box->lo[2] <= 1) return 0.0; //Can't be cut any further
+    WuMoment v = WuVolume(box, m);
+    if (v.w <= 0.0) return 0.0;
+    return v.sq - (((v.L * v.L) + (v.a * v.a) + (v.b * v.b))/v.w);
+}
+
+//Splits set1 into set1 and set2 along whichever plane leaves the least variance
+static bool WuCut(WuBox* set1, WuBox* set2, const WuMoment* m)
+{
+    const WuMoment whole = WuVolume(set1, m);
+    double best = -1.0;
+    int bestAxis = 0;
+    int bestPos = 0;
+    for (int d = 0; d < 3; d++)
+    {
+        for (int p = set1->lo[d] + 1; p < set1->hi[d]; p++)
+        {
+            WuBox lower = *set1;
+            lower.hi[d] = p;
+            WuMoment half = WuVolume(&lower, m);
+            WuMoment other = whole;
+            AddWuMoment(&other, &half, -1.0);
+            if (half.w <= 0.0 || other.w <= 0.0) continue;
+            const double temp = (((half.L * half.L) + (half.a * half.a) + (half.b * half.b))/half.w) + (((other.L * other.L) + (other.a * other.a) + (other.b * other.b))/other.w);
+            if (temp > best)
+            {
+                best = temp;
+                bestAxis = d;
+                bestPos = p;
+            }
+        }
+    }
+    if (best < 0.0) return false;
+    *set2 = *set1;
+    set1->hi[bestAxis] = bestPos;
+    set2->lo[bestAxis] = bestPos;
+    return true;
+}
+
+int QuantizeWu(const KMeansPoints* pts, ColourOkLabA* outCols, int numColours, float uvbias)
+{
+    float minv[3];
+    float maxv[3];
+    if (!GetScaledBounds(pts, uvbias, minv, maxv)) return 0;
+    float scale[3];
+    for (int d = 0; d < 3; d++)
+    {
+        scale[d] = (maxv[d] > minv[d]) ? ((float)WU_CELLS)/(maxv[d] - minv[d]) : 0.0f;
+    }
+
+    //Gather the moments of each cell
+    WuMoment* m = (WuMoment*)calloc(WU_SIZE * WU_SIZE * WU_SIZE, sizeof(WuMoment));
+    for (long long i = 0; i < pts->numPoints; i++)
+    {
+        const unsigned int weight = pts->weights[i];
+        if (weight == 0) continue; //Ignore 'transparent' colours
+        float p[3];
+        GetScaledPoint(pts, i, uvbias, p);
+        int c[3];
+        for (int d = 0; d < 3; d++)
+        {
+            c[d] = 1 + (int)((p[d] - minv[d]) * scale[d]);
+            if (c[d] > WU_CELLS) c[d] = WU_CELLS;
+        }
+        WuMoment* cell = &m[WU_INDEX(c[0], c[1], c[2])];
+        const double w = (double)weight;
+        cell->w += w;
+        cell->L += w * p[0];
+        cell->a += w * p[1];
+        cell->b += w * p[2];
+        cell->sq += w * (((double)p[0] * p[0]) + ((double)p[1] * p[1]) + ((double)p[2] * p[2]));
+    }
+    //Make them cumulative along each axis in turn
+    for (int i = 0; i < WU_SIZE; i++)
+    {
+        for (int j = 0; j < WU_SIZE; j++)
+        {
+            for (int k = 1; k < WU_SIZE; k++)
+            {
+                AddWuMoment(&m[WU_INDEX(i, j, k)], &m[WU_INDEX(i, j, k - 1)], 1.0);
+            }
+        }
+    }
+    for (int i = 0; i < WU_SIZE; i++)
+    {
+        for (int j = 1; j < WU_SIZE; j++)
+        {
+            for (int k = 0; k < WU_SIZE; k++)
+            {
+                AddWuMoment(&m[WU_INDEX(i, j, k)], &m[WU_INDEX(i, j - 1, k)], 1.0);
+            }
+        }
+    }
+    for (int i = 1; i < WU_SIZE; i++)
+    {
+        for (int j = 0; j < WU_SIZE; j++)
+        {
+            for (int k = 0; k < WU_SIZE; k++)
+            {
+                AddWuMoment(&m[WU_INDEX(i, j, k)], &m[WU_INDEX(i - 1, j, k)], 1.0);
+            }
+        }
+    }
+
+    //Keep cutting the box with the most variance
+    WuBox boxes[256];
+    double variances[256];
+    for (int d = 0; d < 3; d++)
+    {
+        boxes[0].lo[d] = 0;
+        boxes[0].hi[d] = WU_CELLS;
+    }
+    variances[0] = WuVariance(&boxes[0], m);
+    int numBoxes = 1;
+    int next = 0;
+    while (numBoxes < numColours)
+    {
+        if (WuCut(&boxes[next], &boxes[numBoxes], m))
+        {
+            variances[next] = WuVariance(&boxes[next], m);
+            variances[numBoxes] = WuVariance(&boxes[numBoxes], m);
+            numBoxes++;
+        }
+        else
+        {
+            variances[next] = 0.0;
+        }
+        next = 0;
+        for (int i = 1; i < numBoxes; i++)
+        {
+            if (variances[i] > variances[next]) next = i;
+        }
+        if (variances[next] <= 0.0) break;
+    }
+
+    for (int i = 0; i < numBoxes; i++)
+    {
+        WuMoment v = WuVolume(&boxes[i], m);
+        outCols[i] = UnscaledColour(v.L/v.w, v.a/v.w, v.b/v.w, uvbias);
+    }
+    free(m);
+    return numBoxes;
+}
+
+
+//Median cut, over a list of point indices that gets partitioned in place
+typedef struct
+{
+    long long start;
+    long long count;
+    double w;
+    double L;
+    double a;
+    double b;
+    double spread; //Weighted sum of squared distances from the mean
+    int axis; //Longest axis
+} MedianCutBox;
+
+static void MeasureMedianCutBox(MedianCutBox* box, const KMeansPoints* pts, const long long* indices, float uvbias)
+{
+    float minv[3] = { 999999999999999999999999.9, 999999999999999999999999.9, 999999999999999999999999.9 };
+    float maxv[3] = { -999999999999999999999999.9, -999999999999999999999999.9, -999999999999999999999999.9 };
+    double w = 0.0;
+    double sum[3] = { 0.0, 0.0, 0.0 };
+    double sq = 0.0;
+    for (long long i = box->start; i < box->start + box->count; i++)
+    {
+        const long long ind = indices[i];
+        const double pw = (double)pts->weights[ind];
+        float p[3];
+        GetScaledPoint(pts, ind, uvbias, p);
+        for (int d = 0; d < 3; d++)
+        {
+            if (p[d] < minv[d]) minv[d] = p[d];
+            if (p[d] > maxv[d]) maxv[d] = p[d];
+            sum[d] += pw * p[d];
+            sq += pw * ((double)p[d] * p[d]);
+        }
+        w += pw;
+    }
+    box->w = w;
+    box->L = sum[0]/w;
+    box->a = sum[1]/w;
+    box->b = sum[2]/w;
+    box->axis = 0;
+    for (int d = 1; d < 3; d++)
+    {
+        if (maxv[d] - minv[d] > maxv[box->axis] - minv[box->axis]) box->axis = d;
+    }
+    //A box can only be split if its points aren't all the same colour
+    if (box->count < 2 || maxv[box->axis] <= minv[box->axis]) box->spread = 0.0;
+    else box->spread = sq - (((sum[0] * sum[0]) + (sum[1] * sum[1]) + (sum[2] * sum[2]))/w);
+}
+
+int QuantizeMedianCut(const KMeansPoints* pts, ColourOkLabA* outCols, int numColours, float uvbias)
+{
+    long long numIndices = 0;
+    for (long long i = 0; i < pts->numPoints; i++)
+    {
+        if (pts->weights[i] != 0) numIndices++; //Ignore 'transparent' colours
+    }
+    if (numIndices == 0) return 0;
+    long long* indices = new long long[numIndices];
+    numIndices = 0;
+    for (long long i = 0; i < pts->numPoints; i++)
+    {
+        if (pts->weights[i] != 0) indices[numIndices++] = i;
+    }
+
+    MedianCutBox boxes[256];
+    boxes[0].start = 0;
+    boxes[0].count = numIndices;
+    MeasureMedianCutBox(&boxes[0], pts, indices, uvbias);
+    int numBoxes = 1;
+    while (numBoxes < numColours)
+    {
+        int next = 0;
+        for (int i = 1; i < numBoxes; i++)
+        {
+            if (boxes[i].spread > boxes[next].spread) next = i;
+        }
+        MedianCutBox* box = &boxes[next];
+        if (box->spread <= 0.0) break;
+
+        //Sort along the longest axis (ties broken by index, so the order is always the same) and split at the weighted median
+        const float* coords = (box->axis == 0) ? pts->L : ((box->axis == 1) ? pts->a : pts->b);
+        long long* first = indices + box->start;
+        std::sort(first, first + box->count, [coords](long long l, long long r) { return (coords[l] < coords[r]) || (coords[l] == coords[r] && l < r); });
+        const double halfWeight = 0.5 * box->w;
+        double w = 0.0;
+        long long split = 1;
+        for (long long i = 0; i < box->count - 1; i++)
+        {
+            w += (double)pts->weights[first[i]];
+            split = i + 1;
+            if (w >= halfWeight) break;
+        }
+        //Never split between two points with the same coordinate, there is always somewhere else since the axis isn't flat
+        long long up = split;
+        while (up < box->count && coords[first[up]] == coords[first[up - 1]]) up++;
+        if (up < box->count)
+        {
+            split = up;
+        }
+        else
+        {
+            while (split > 1 && coords[first[split]] == coords[first[split - 1]]) split--;
+        }
+
+        MedianCutBox* newBox = &boxes[numBoxes];
+        newBox->start = box->start + split;
+        newBox->count = box->count - split;
+        box->count = split;
+        MeasureMedianCutBox(box, pts, indices, uvbias);
+        MeasureMedianCutBox(newBox, pts, indices, uvbias);
+        numBoxes++;
+    }
+
+    for (int i = 0; i < numBoxes; i++)
+    {
+        outCols[i] = UnscaledColour(boxes[i].L, boxes[i].a, boxes[i].b, uvbias);
+    }
+    delete[] indices;
+    return numBoxes;
+}
+
+
+//Octree over the smallest cube containing the points, where every node keeps the sums of everything below it
+#define OCTREE_DEPTH 6
+
+typedef struct
+{
+    double w;
+    double L;
+    double a;
+    double b;
+    int children[8];
+    int numChildren;
+    int level;
+    bool merged; //Folded into its parent
+} OctreeNode;
+
+typedef struct
+{
+    OctreeNode* nodes;
+    int numNodes;
+    int capacity;
+} Octree;
+
+static int AddOctreeNode(Octree* tree, int level)
+{
+    if (tree->numNodes == tree->capacity)
+    {
+        tree->capacity *= 2;
+        tree->nodes = (OctreeNode*)realloc(tree->nodes, tree->capacity * sizeof(OctreeNode));
+    }
+    OctreeNode* node = &tree->nodes[tree->numNodes];
+    memset(node, 0, sizeof(OctreeNode));
+    for (int i = 0; i < 8; i++)
+    {
+        node->children[i] = -1;
+    }
+    node->level = level;
+    return tree->numNodes++;
+}
+
+int QuantizeOctree(const KMeansPoints* pts, ColourOkLabA* outCols, int numColours, float uvbias)
+{
+    float minv[3];
+    float maxv[3];
+    if (!GetScaledBounds(pts, uvbias, minv, maxv)) return 0;
+    float size = 0.0f;
+    for (int d = 0; d < 3; d++)
+    {
+        if (maxv[d] - minv[d] > size) size = maxv[d] - minv[d];
+    }
+    const float scale = (size > 0.0f) ? ((float)(1 << OCTREE_DEPTH))/size : 0.0f;
+
+    Octree tree;
+    tree.capacity = 4096;
+    tree.numNodes = 0;
+    tree.nodes = (OctreeNode*)malloc(tree.capacity * sizeof(OctreeNode));
+    AddOctreeNode(&tree, 0);
+    int numLeaves = 0;
+    for (long long i = 0; i < pts->numPoints; i++)
+    {
+        const unsigned int weight = pts->weights[i];
+        if (weight == 0) continue; //Ignore 'transparent' colours
+        float p[3];
+        GetScaledPoint(pts, i, uvbias, p);
+        int c[3];
+        for (int d = 0; d < 3; d++)
+        {
+            c[d] = (int)((p[d] - minv[d]) * scale);
+            if (c[d] >= (1 << OCTREE_DEPTH)) c[d] = (1 << OCTREE_DEPTH) - 1;
+        }
+        const double w = (double)weight;
+        int node = 0;
+        for (int level = 0; ; level++)
+        {
+            OctreeNode* n = &tree.nodes[node];
+            n->w += w;
+            n->L += w * p[0];
+            n->a += w * p[1];
+            n->b += w * p[2];
+            if (level == OCTREE_DEPTH) break;
+            const int shift = OCTREE_DEPTH - 1 - level;
+            const int octant = (((c[0] >> shift) & 1) << 2) | (((c[1] >> shift) & 1) << 1) | ((c[2] >> shift) & 1);
+            int child = n->children[octant];
+            if (child < 0)
+            {
+                child = AddOctreeNode(&tree, level + 1); //Might move the nodes
+                tree.nodes[node].children[octant] = child;
+                tree.nodes[node].numChildren++;
+                if (level + 1 == OCTREE_DEPTH) numLeaves++;
+            }
+            node = child;
+        }
+    }
+
+    //Merge the lightest nodes into their parents, a whole level at a time from the bottom up
+    int* candidates = new int[tree.numNodes];
+    for (int level = OCTREE_DEPTH - 1; level >= 0 && numLeaves > numColours; level--)
+    {
+        int numCandidates = 0;
+        for (int i = 0; i < tree.numNodes; i++)
+        {
+            if (tree.nodes[i].level == level && tree.nodes[i].numChildren > 0) candidates[numCandidates++] = i;
+        }
+        const OctreeNode* nodes = tree.nodes;
+        std::sort(candidates, candidates + numCandidates, [nodes](int l, int r) { return (nodes[l].w < nodes[r].w) || (nodes[l].w == nodes[r].w && l < r); });
+        for (int i = 0; i < numCandidates && numLeaves > numColours; i++)
+        {
+            OctreeNode* n = &tree.nodes[candidates[i]];
+            for (int j = 0; j < 8; j++)
+            {
+                if (n->children[j] >= 0) tree.nodes[n->children[j]].merged = true;
+                n->children[j] = -1;
+            }
+            numLeaves -= n->numChildren - 1;
+            n->numChildren = 0;
+        }
+    }
+    delete[] candidates;
+
+    int numFound = 0;
+    for (int i = 0; i < tree.numNodes && numFound < numColours; i++)
+    {
+        const OctreeNode* n = &tree.nodes[i];
+        if (n->merged || n->numChildren > 0 || n->w <= 0.0) continue;
+        outCols[numFound++] = UnscaledColour(n->L/n->w, n->a/n->w, n->b/n->w, uvbias);
+    }
+    free(tree.nodes);
+    return numFound;
+}
+
+
+void RunQuantizer(int quantizer, const KMeansPoints* pts, ColourOkLabA* outCols, int numColours, float uvbias)
+{
+    int numFound;
+    switch (quantizer)
+    {
+        case QUANTIZER_MEDIANCUT:
+            numFound = QuantizeMedianCut(pts, outCols, numColours, uvbias);
+            break;
+        case QUANTIZER_OCTREE:
+            numFound = QuantizeOctree(pts, outCols, numColours, uvbias);
+            break;
+        case QUANTIZER_WU:
+        default:
+            numFound = QuantizeWu(pts, outCols, numColours, uvbias);
+            break;
+    }
+    for (int i = numFound; i < numColours; i++)
+    {
+        if (numFound > 0) outCols[i] = outCols[i % numFound];
+        else outCols[i] = { 0.0f, 0.0f, 0.0f, 1.0f };
+    }
+}
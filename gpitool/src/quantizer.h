@@ -0,0 +1,48 @@
+/* gpitool - Converts images into .GPI format
+ * Copyright (c) 2024 Maxim Hoxha
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * Fast palette quantizers (Wu, median cut and octree) working in OkLab
+ */
+
+#pragma once
+
+#include "imagehandler.h"
+#include "kmeans.h"
+
+//How GetBestPalette finds a palette when there are too many colours in the image
+enum paletteQuantizers
+{
+    QUANTIZER_KMEANS,
+    QUANTIZER_WU,
+    QUANTIZER_MEDIANCUT,
+    QUANTIZER_OCTREE
+};
+
+//All of these work on the same weighted points as the k-means clustering, with lightness scaled by uvbias
+//They return the number of colours found, which can be fewer than numColours if the points can't be split any further
+//Wu's variance minimising quantizer, over a 32x32x32 grid of moments spanning the points
+int QuantizeWu(const KMeansPoints* pts, ColourOkLabA* outCols, int numColours, float uvbias);
+//Repeatedly splits the box with the largest weighted spread at the weighted median of its longest axis
+int QuantizeMedianCut(const KMeansPoints* pts, ColourOkLabA* outCols, int numColours, float uvbias);
+//Builds an octree over the cube spanning the points and merges the lightest nodes, deepest first
+int QuantizeOctree(const KMeansPoints* pts, ColourOkLabA* outCols, int numColours, float uvbias);
+//Runs one of the quantizers above, filling any leftover entries with copies of the found colours
+void RunQuantizer(int quantizer, const KMeansPoints* pts, ColourOkLabA* outCols, int numColours, float uvbias);